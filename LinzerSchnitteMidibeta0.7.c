@@ -17,7 +17,7 @@
     Based on miniFMsynth by Matthias Nagorni. 	
     
     Complie with
-	$ gcc -lm -lasound -lcurses -o LinzerSchnitteMidi0.7 LinzerSchnitteMidibeta0.7.c 
+	$ gcc -lm -lasound -lcurses -o LinzerSchnitteMidi0.7 LinzerSchnitteMidibeta0.7.c ls_sync.c ls_audio.c ls_synth.c ls_verify.c ls_cmd.c -lpthread
 */
 
 
@@ -28,21 +28,59 @@
 //#include <ncurses.h>
 #include <unistd.h>
 #include <ctype.h>
-
-#define NOTES 128
-#define SAMPLES 480
+#include <signal.h>
+#include "ls_sync.h"
+#include "ls_audio.h"
+#include "ls_synth.h"
+#include "ls_verify.h"
+#include "ls_cmd.h"
 
 snd_seq_t *seq_handle;
-snd_pcm_t *playback_handle;
-short *buf;
-double phi[512], velocity[512], midichannel[512], attack, decay, sustain, release, env_time[512], env_level[512];
-int note[512], gate[512], note_active[512];
+double attack, decay, sustain, release;
 unsigned int rate; 
 int poly, gain, buffer_size, freq_start, freq_channel_width, row, col;
+unsigned int periods;
+snd_pcm_access_t pcm_access;
 //WINDOW *my_win, *my_other_win;
 
-int sample[NOTES][SAMPLES];
-int sample_offset[NOTES];
+int phase_mode, env_shape;
+
+/* with -V every buffer is also checked by the Goertzel verifier */
+double verify_snr;
+long long verify_frames;
+int verify_freq[LS_SYNTH_NOTES];
+
+/* with -S notes start and stop at a local time (ns) on the shared timeline instead of at arrival */
+int sync_latency, sync_grid, sync_locked;
+
+/* with -U receiver commands come in on a socket of their own, -1 without */
+int cmd_fd = -1;
+struct ls_cmd_config cmd;
+
+/* set by SIGINT and SIGTERM, the main loop ends and the sinks are closed */
+volatile sig_atomic_t stop;
+
+void on_stop(int sig) {
+
+    stop = 1;
+}
+
+/* local time at which a note arriving now plays, on the shared timeline of all nodes */
+long long sync_schedule() {
+
+    long long t;
+
+    t = ls_sync_shared_ns(ls_sync_local_ns()) + sync_latency * 1000000LL;
+    if (sync_grid > 0) t = (t / (sync_grid * 1000000LL) + 1) * (sync_grid * 1000000LL);
+    return ls_sync_local_from_shared(t);
+}
+
+/* local time at which a command batch arriving now starts, after what is queued for the DAC */
+long long cmd_schedule() {
+
+    if (sync_latency) return sync_schedule();
+    return ls_sync_local_ns() + (ls_audio_delay() + buffer_size) * 1000000000LL / rate;
+}
 
 void connect2MidiThroughPort(snd_seq_t *seq_handle) {
         snd_seq_addr_t sender, dest;
@@ -63,31 +101,26 @@ void connect2MidiThroughPort(snd_seq_t *seq_handle) {
         snd_seq_subscribe_port(seq_handle, subs);
 }
 
-int generate_samples()
-{
-    int note_frequency;
-    int sample_rate;
-    //double sample_gain;
-    double phase, sound, delta_phase;
-
-    sample_rate = rate;
-    //sample_gain = gain;
-
-    int i;
-    int n;
-    for (i=0; i<NOTES; i++){
-      note_frequency = (i*freq_channel_width)+freq_start;
-      delta_phase = (M_PI * note_frequency * 2) / sample_rate ;
-      phase = 0;
-      for (n=0; n<SAMPLES; n++ ){
-        if (phase > 2 * M_PI) {
-            phase -= 2 * M_PI;
-          }
-        sound = sin(phase) * gain;
-        sample[i][n]= sound;
-        phase += delta_phase;
-      }
+/* reads key=value lines as written by hw_params -t, unknown keys are ignored */
+int load_config(char *file_name, char **hwdevice) {
+
+    FILE *f;
+    char line[256], key[64], value[192];
+
+    if ((f = fopen(file_name, "r")) == NULL) {
+        fprintf(stderr, "Error: cannot read config %s\n", file_name);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#' || sscanf(line, " %63[^= ] = %191s", key, value) != 2) continue;
+        if (!strcmp(key, "device")) *hwdevice = strdup(value);
+        else if (!strcmp(key, "rate")) rate = atoi(value);
+        else if (!strcmp(key, "period_size")) buffer_size = atoi(value);
+        else if (!strcmp(key, "periods")) periods = atoi(value);
+        else if (!strcmp(key, "access"))
+            pcm_access = strcmp(value, "mmap") ? SND_PCM_ACCESS_RW_INTERLEAVED : SND_PCM_ACCESS_MMAP_INTERLEAVED;
     }
+    fclose(f);
     return 0;
 }
 
@@ -113,105 +146,43 @@ snd_seq_t *open_seq() {
     return(seq_handle);
 }
 
-snd_pcm_t *open_pcm(char *pcm_name) {
-
-    snd_pcm_t *playback_handle;
-    snd_pcm_hw_params_t *hw_params;
-    snd_pcm_sw_params_t *sw_params;
-
-    if (snd_pcm_open (&playback_handle, pcm_name, SND_PCM_STREAM_PLAYBACK, 0) < 0) {
-//	attron(COLOR_PAIR(1));
-	printf("\n Error: cannot open audio device %s\n\n", pcm_name);
-//        attroff(COLOR_PAIR(1));
-        exit (1);
-    }
-    snd_pcm_hw_params_alloca(&hw_params);
-    snd_pcm_hw_params_any(playback_handle, hw_params);
-    snd_pcm_hw_params_set_access(playback_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED);
-    snd_pcm_hw_params_set_format(playback_handle, hw_params, SND_PCM_FORMAT_S16_LE);
-
-    snd_pcm_hw_params_set_rate_near(playback_handle, hw_params, &rate, 0);
-
-    snd_pcm_hw_params_set_channels(playback_handle, hw_params, 2);
-    snd_pcm_hw_params_set_periods(playback_handle, hw_params, 2, 0);
-    snd_pcm_hw_params_set_period_size(playback_handle, hw_params, buffer_size, 0);
-    snd_pcm_hw_params(playback_handle, hw_params);
-    snd_pcm_sw_params_alloca(&sw_params);
-    snd_pcm_sw_params_current(playback_handle, sw_params);
-    snd_pcm_sw_params_set_avail_min(playback_handle, sw_params, buffer_size);
-    snd_pcm_sw_params(playback_handle, sw_params);
-    return(playback_handle);
-}
-
-double envelope(int *note_active, int gate, double *env_level, double t, double attack, double decay, double sustain, double release) {
-
-    if (gate)  {
-        if (t > attack + decay) return(*env_level = sustain);
-        if (t > attack) return(*env_level = 1.0 - (1.0 - sustain) * (t - attack) / decay);
-        return(*env_level = t / attack);
-    } else {
-        if (t > release) {
-            if (note_active) *note_active = 0;
-            return(*env_level = 0);
-        }
-        return(*env_level * (1.0 - t / release));
-    }
-}
 /* TODO: ADD MIDI PANIC/ALL NOTES OFF */
 int midi_callback() {
 
     snd_seq_event_t *ev;
-    int l1;
 
     do {
         snd_seq_event_input(seq_handle, &ev);
         switch (ev->type) {
             case SND_SEQ_EVENT_NOTEON:
-                for (l1 = 0; l1 < poly; l1++) {
-                    if (!note_active[l1]) {
-                        note[l1] = ev->data.note.note;
-			midichannel[l1] = ev->data.note.channel;
-			velocity[l1] = ev->data.note.velocity;
-			velocity[l1] = velocity[l1] / 127;
-//			wattrset(my_win, COLOR_PAIR(3));			
-//			wprintw(my_win,"CH %2.0f ", midichannel[l1]+1);
-//			wprintw(my_win,"Note %3d ON  ", note[l1]);
-//			wprintw(my_win,"Velocity %3.0f ", velocity[l1]*127);
-//			wprintw(my_win,"Frequency %6.0f Hz \n", ((note[l1]*freq_channel_width)+((128*freq_channel_width*midichannel[l1])+freq_start)) );
+                if (ls_synth_note_on(ev->data.note.note, sync_latency ? sync_schedule() : 0) >= 0) {
+//			wattrset(my_win, COLOR_PAIR(3));
+//			wprintw(my_win,"CH %2d ", ev->data.note.channel+1);
+//			wprintw(my_win,"Note %3d ON  ", ev->data.note.note);
+//			wprintw(my_win,"Velocity %3d ", ev->data.note.velocity);
+//			wprintw(my_win,"Frequency %6d Hz\n", ((ev->data.note.note*freq_channel_width)+((128*freq_channel_width*ev->data.note.channel)+freq_start)) );
 //			refresh();
 //			wrefresh(my_win);
 //			attroff(COLOR_PAIR(1));
-			printf("CH %2.0f ", midichannel[l1]+1);
-			printf("Note %3d ON  ", note[l1]);
-			printf("Vel %3.0f ", velocity[l1]*127);
-			printf("Frequency %6.0f Hz\n", ((note[l1]*freq_channel_width)+((128*freq_channel_width*midichannel[l1])+freq_start)) );
-                        env_time[l1] = 0;
-                        gate[l1] = 1;
-                        note_active[l1] = 1;
-                        break;
-                    }
+			printf("CH %2d ", ev->data.note.channel+1);
+			printf("Note %3d ON  ", ev->data.note.note);
+			printf("Vel %3d ", ev->data.note.velocity);
+			printf("Frequency %6d Hz\n", ((ev->data.note.note*freq_channel_width)+((128*freq_channel_width*ev->data.note.channel)+freq_start)) );
                 }
                 break;
             case SND_SEQ_EVENT_NOTEOFF:
-                for (l1 = 0; l1 < poly; l1++) {
-                    if (gate[l1] && note_active[l1] && (note[l1] == ev->data.note.note)) {
-			midichannel[l1] = ev->data.note.channel;
-			velocity[l1] = ev->data.note.velocity;
-			velocity[l1] = velocity[l1] / 127;
+                if (ls_synth_note_off(ev->data.note.note, sync_latency ? sync_schedule() : 0) > 0) {
 //			wattrset(my_win, COLOR_PAIR(1));
-//			wprintw(my_win,"CH %2.0f ", midichannel[l1]+1);
-//			wprintw(my_win,"Note %3d OFF ", note[l1]);
-//			wprintw(my_win,"Velocity %3.0f ", velocity[l1]*127);
-//			wprintw(my_win,"Frequency %6.0f Hz\n", ((note[l1]*freq_channel_width)+((128*freq_channel_width*midichannel[l1])+freq_start)) );
+//			wprintw(my_win,"CH %2d ", ev->data.note.channel+1);
+//			wprintw(my_win,"Note %3d OFF ", ev->data.note.note);
+//			wprintw(my_win,"Velocity %3d ", ev->data.note.velocity);
+//			wprintw(my_win,"Frequency %6d Hz\n", ((ev->data.note.note*freq_channel_width)+((128*freq_channel_width*ev->data.note.channel)+freq_start)) );
 //			refresh();
 //			wrefresh(my_win);
-			printf("CH %2.0f ", midichannel[l1]+1);
-			printf("Note %3d OFF ", note[l1]);
-			printf("Vel %3.0f ", velocity[l1]*127);
-			printf("Frequency %6.0f Hz\n", ((note[l1]*freq_channel_width)+((128*freq_channel_width*midichannel[l1])+freq_start)) );
-                        env_time[l1] = 0;
-                        gate[l1] = 0;
-                    }
+			printf("CH %2d ", ev->data.note.channel+1);
+			printf("Note %3d OFF ", ev->data.note.note);
+			printf("Vel %3d ", ev->data.note.velocity);
+			printf("Frequency %6d Hz\n", ((ev->data.note.note*freq_channel_width)+((128*freq_channel_width*ev->data.note.channel)+freq_start)) );
                 }
                 break;
         }
@@ -220,31 +191,32 @@ int midi_callback() {
     return (0);
 }
 
-int playback_callback (snd_pcm_sframes_t nframes) {
+int playback_callback (int nframes) {
 
-    int l1, l2, b ,c;
-    double sound;
+    long long t0;
+    short *buf;
 
-    memset(buf, 0, nframes * 4);
-    for (l2 = 0; l2 < poly; l2++) {
-        if (note_active[l2]) {
-	    b = note[l2];
-	    for (l1 = 0; l1 < nframes; l1++) {
-		c = sample_offset[b];
-                sound = sample[b][c] * envelope(&note_active[l2], gate[l2], &env_level[l2], env_time[l2], attack, decay, sustain, release);
-                if (sample_offset[b]!=(SAMPLES-1)){
-		   ++sample_offset[b];
-                }
-                else {
-                   sample_offset[b] = 0;
-                }
-                env_time[l2] += 1.0 / rate;
-                buf[2 * l1] += sound;
-                buf[2 * l1 + 1] += sound;
-            }
+    /* local time at which the first frame of this buffer leaves the DAC */
+    t0 = 0;
+    if (sync_latency || cmd_fd >= 0) {
+        t0 = ls_sync_local_ns() + ls_audio_delay() * 1000000000LL / rate;
+    }
+
+    buf = ls_audio_begin(&nframes);
+    if (cmd_fd >= 0) ls_cmd_run(t0, t0 + nframes * 1000000000LL / rate);
+    ls_synth_render(buf, nframes, t0);
+    if (verify_snr > 0) {
+        unsigned char state[LS_SYNTH_NOTES];
+
+        ls_synth_note_state(state);
+        ls_verify_push(buf, nframes, state);
+        verify_frames += nframes;
+        if (verify_frames >= 10LL * rate) {
+            ls_verify_print(stderr);
+            verify_frames = 0;
         }
     }
-    return snd_pcm_writei (playback_handle, buf, nframes);
+    return ls_audio_commit(nframes);
 }
 /*
 void do_endwin(void)
@@ -266,7 +238,9 @@ int main (int argc, char *argv[]) {
 //    height = 20;
 //    width = 20;
 
-    int nfds, seq_nfds, l1;
+    int nfds, seq_nfds, l1, timeout;
+    struct ls_synth_config synth;
+    double peak;
 
     char *hwdevice;
     char *Dvalue = NULL;
@@ -283,6 +257,8 @@ int main (int argc, char *argv[]) {
     char *ovalue = NULL;
     char *tvalue = NULL;
     char *wvalue = NULL;
+    char *Ivalue = NULL;
+    char *Uvalue = NULL;
     
     //int index;
     int c;
@@ -303,8 +279,18 @@ int main (int argc, char *argv[]) {
     buffer_size = 512;	      //case b
     freq_start = 300;         //case t
     freq_channel_width = 100; //case w
+    sync_latency = 0;         //case S
+    sync_grid = 0;            //case G
+    periods = 2;              //case C
+    pcm_access = SND_PCM_ACCESS_RW_INTERLEAVED; //case C
+    phase_mode = LS_PHASE_ZERO; //case P
+    env_shape = LS_ENV_LINEAR; //case E
+    verify_snr = 0;           //case V
+    cmd.max_peak = 1;         //case K
+    cmd.spacing = 1;          //case N
+    cmd.gap = 20;             //case Q
 	
-while ((c = getopt (argc, argv, "D:p:v:ha:d:g:r:b:s:o:t:w:")) != -1)
+while ((c = getopt (argc, argv, "D:p:v:ha:d:g:r:b:s:o:t:w:S:G:I:C:P:E:V:U:K:N:Q:")) != -1)
 	switch (c)
 	{
 	case 'D':
@@ -319,18 +305,30 @@ while ((c = getopt (argc, argv, "D:p:v:ha:d:g:r:b:s:o:t:w:")) != -1)
 		//vvalue = optarg;
 		break;
 	case 'h':
-		printf("Usage: LinzerSchnitteMidi  [-Dadsoprgbtw]\n");
+		printf("Usage: LinzerSchnitteMidi  [-DadsoprgbtwSGICPEVUKNQ]\n");
 		printf("-D hardware device eg hw:0,0,1  Default= %s \n", hwdevice);
+		printf("   or null, wav:<file>, raw:<file>, - for raw to stdout\n");
 		printf("-a Attack time in seconds     Default= %3.3f \n", attack);
 		printf("-d Decay time in seconds      Default= %3.3f \n", decay);
 //		printf("-s Sustain level 0-1          Default= %3.3f \n", sustain);
 		printf("-o Release time               Default= %3.3f \n", release);
+		printf("-E Envelope linear, cosine, blackman or curve (-4)  Default= linear \n");
 		printf("-p Polyphony                  Default= %d \n", poly);
 		printf("-r Sample rate in Hz          Default= %d \n", rate);
 		printf("-g Gain level                 Default= %d \n", gain);
 		printf("-b Buffer/period size         Default= %d \n", buffer_size);
 //		printf("-t base frequency             Default= %d \n", freq_start);
 //		printf("-w Frequency step             Default= %d \n", freq_channel_width);
+		printf("-S Sync latency in ms, 0 off  Default= %d \n", sync_latency);
+		printf("-G Sync grid in ms, 0 off     Default= %d \n", sync_grid);
+		printf("-I Sync network interface     Default= any \n");
+		printf("-C Config from hw_params -t, options after it override it\n");
+		printf("-V Verify the output, fault below this snr in dB, 0 off  Default= %.0f \n", verify_snr);
+		printf("-P Note phases zero, newman, schroeder or opt, for lower peaks  Default= zero \n");
+		printf("-U Receiver commands on this UDP port or Unix socket path  Default= off \n");
+		printf("-K Peak of command bursts sounding together, of full scale  Default= %.2f \n", cmd.max_peak);
+		printf("-N Notes between command bursts sounding together  Default= %d \n", cmd.spacing);
+		printf("-Q Quiet ms between command bursts on one receiver  Default= %.0f \n", cmd.gap);
 		return(1);
 		break;
 	case 'a':
@@ -369,6 +367,45 @@ while ((c = getopt (argc, argv, "D:p:v:ha:d:g:r:b:s:o:t:w:")) != -1)
 		wvalue = optarg;
 		freq_channel_width = atoi(wvalue);
 		break;
+	case 'S':
+		sync_latency = atoi(optarg);
+		break;
+	case 'G':
+		sync_grid = atoi(optarg);
+		break;
+	case 'I':
+		Ivalue = optarg;
+		break;
+	case 'C':
+		if (load_config(optarg, &hwdevice) < 0) return 1;
+		break;
+	case 'V':
+		verify_snr = atof(optarg);
+		break;
+	case 'U':
+		Uvalue = optarg;
+		break;
+	case 'K':
+		cmd.max_peak = atof(optarg);
+		break;
+	case 'N':
+		cmd.spacing = atoi(optarg);
+		break;
+	case 'Q':
+		cmd.gap = atof(optarg);
+		break;
+	case 'E':
+		if ((env_shape = ls_synth_env_shape(optarg)) < 0) {
+		    fprintf(stderr, "Unknown envelope %s\n", optarg);
+		    return 1;
+		}
+		break;
+	case 'P':
+		if ((phase_mode = ls_synth_phase_mode(optarg)) < 0) {
+		    fprintf(stderr, "Unknown phases %s\n", optarg);
+		    return 1;
+		}
+		break;
 	case '?':
 		if (optopt == 'c')
 		    fprintf (stderr, "Option -%c requires an value.\n", optopt);
@@ -430,36 +467,88 @@ while ((c = getopt (argc, argv, "D:p:v:ha:d:g:r:b:s:o:t:w:")) != -1)
 
 */
 
-    generate_samples();
- 
-    buf = (short *) malloc (2 * sizeof (short) * buffer_size);
-    playback_handle = open_pcm(hwdevice);
+    if (ls_audio_open(hwdevice, &rate, buffer_size, periods, pcm_access == SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) exit(1);
+    synth.rate = rate;
+    synth.poly = poly;
+    synth.gain = gain;
+    synth.freq_start = freq_start;
+    synth.freq_channel_width = freq_channel_width;
+    synth.attack = attack;
+    synth.decay = decay;
+    synth.sustain = sustain;
+    synth.release = release;
+    synth.phase_mode = phase_mode;
+    synth.env_shape = env_shape;
+    if (ls_synth_init(&synth) < 0) exit(1);
+    printf("Crest factor of all notes %.1f dB, ", 20 * log10(ls_synth_crest_factor(&peak)));
+    printf("their sum peaks at %.0f x gain\n", peak);
+    if (verify_snr > 0) {
+        for (l1 = 0; l1 < LS_SYNTH_NOTES && ls_synth_frequency(l1) < (int) rate / 2; l1++)
+            verify_freq[l1] = ls_synth_frequency(l1);
+        if (ls_verify_open(rate, 2 * ls_synth_table_len(), verify_freq, l1, gain * sustain / 32768, verify_snr) < 0)
+            verify_snr = 0;
+    }
     seq_handle = open_seq();
     seq_nfds = snd_seq_poll_descriptors_count(seq_handle, POLLIN);
-    nfds = snd_pcm_poll_descriptors_count (playback_handle);
-    pfds = (struct pollfd *)alloca(sizeof(struct pollfd) * (seq_nfds + nfds));
+    nfds = ls_audio_poll_count();
+    pfds = (struct pollfd *)alloca(sizeof(struct pollfd) * (seq_nfds + nfds + 2));
     snd_seq_poll_descriptors(seq_handle, pfds, seq_nfds, POLLIN);
-    snd_pcm_poll_descriptors (playback_handle, pfds+seq_nfds, nfds);
+    ls_audio_poll_descriptors(pfds+seq_nfds, nfds);
+    pfds[seq_nfds + nfds].fd = -1;
+    pfds[seq_nfds + nfds].events = POLLIN;
+    if (sync_latency && (pfds[seq_nfds + nfds].fd = ls_sync_open(Ivalue, 0)) < 0) {
+        fprintf(stderr, "Error opening clock sync, notes are not aligned with other nodes\n");
+        sync_latency = 0;
+    }
+    pfds[seq_nfds + nfds + 1].fd = -1;
+    pfds[seq_nfds + nfds + 1].events = POLLIN;
+    if (Uvalue) {
+        for (l1 = 0; l1 < LS_SYNTH_NOTES && ls_synth_frequency(l1) < (int) rate / 2; l1++);
+        cmd.tones = l1;
+        cmd.poly = poly;
+        cmd.max_peak *= 32767;
+        cmd.release = release * 1000;
+        if ((cmd_fd = ls_cmd_open(Uvalue, &cmd)) < 0) {
+            fprintf(stderr, "Error opening the command socket, receiver commands are off\n");
+        }
+        pfds[seq_nfds + nfds + 1].fd = cmd_fd;
+    }
     connect2MidiThroughPort(seq_handle);
-    for (l1 = 0; l1 < poly; note_active[l1++] = 0);
-    while (1) {
-	if (poll (pfds, seq_nfds + nfds, 1000) > 0) {
+    signal(SIGINT, on_stop);
+    signal(SIGTERM, on_stop);
+    /* a closed pipe is a write error of the sink, not the end of the process */
+    signal(SIGPIPE, SIG_IGN);
+    while (!stop) {
+        timeout = 1000;
+        if (sync_latency) {
+            timeout = ls_sync_poll();
+            if (timeout > 1000) timeout = 1000;
+            if (ls_sync_locked() != sync_locked) {
+                sync_locked = ls_sync_locked();
+                ls_sync_print(stderr);
+            }
+        }
+	if (poll (pfds, seq_nfds + nfds + 2, timeout) > 0) {
+            if (pfds[seq_nfds + nfds].revents > 0) ls_sync_receive();
+            if (pfds[seq_nfds + nfds + 1].revents > 0) ls_cmd_receive(cmd_schedule());
             for (l1 = 0; l1 < seq_nfds; l1++) {
                if (pfds[l1].revents > 0) midi_callback();
             }
-            for (l1 = seq_nfds; l1 < seq_nfds + nfds; l1++) {
-                if (pfds[l1].revents > 0) {
-                    if (playback_callback(buffer_size) < buffer_size) {
-                        fprintf (stderr, "xrun ! increase buffer \n");
-                        snd_pcm_prepare(playback_handle);
-                    }
+            if (ls_audio_ready(pfds + seq_nfds, nfds)) {
+                l1 = playback_callback(buffer_size);
+                if (l1 == LS_AUDIO_LOST) break;
+                if (l1 < buffer_size) {
+                    fprintf (stderr, "xrun ! increase buffer \n");
+                    ls_audio_recover();
                 }
             }
         }
     }
-    snd_pcm_close (playback_handle);
+    ls_cmd_close();
+    ls_verify_close();
+    ls_audio_close();
     snd_seq_close (seq_handle);
-    free(buf);
+    ls_sync_close();
     return (0);
 }
 
@@ -1,10 +1,19 @@
 /*
  * hw_params.c - print hardware capabilities
  *
- * compile with: gcc -o hw_params hw_params.c -lasound
+ * With -t, tries every candidate period size, period count and access
+ * mode under a synthetic render load, and writes the lowest latency
+ * setting that ran without xruns as a config for LSMidi -C.
+ *
+ * compile with: gcc -o hw_params hw_params.c -lasound -lm
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
 #include <alsa/asoundlib.h>
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof *(a))
@@ -74,18 +83,289 @@ static const unsigned int rates[] = {
 	192000,
 };
 
+static const snd_pcm_uframes_t tune_period_sizes[] = {
+	32, 64, 128, 256, 480, 512, 1024, 2048,
+};
+
+static const unsigned int tune_periods[] = {
+	2, 3, 4,
+};
+
+static const snd_pcm_access_t tune_accesses[] = {
+	SND_PCM_ACCESS_MMAP_INTERLEAVED,
+	SND_PCM_ACCESS_RW_INTERLEAVED,
+};
+
+struct tune_result {
+	snd_pcm_access_t access;
+	snd_pcm_uframes_t period_size;
+	unsigned int periods;
+	unsigned int rate;
+	int xruns;
+	double jitter_max_us;	/* worst deviation of a wakeup from one period after the last */
+	double jitter_avg_us;
+	double load_max;	/* worst render time, as a fraction of the period time */
+};
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Render load like LSMidi's playback_callback(), poly tones from the
+ * LSMidi frequency plan, but with sin() per sample, so it is never
+ * lighter than the real thing.
+ */
+static void tune_render(short *buf, snd_pcm_uframes_t frames, int poly, unsigned int rate, double *phase)
+{
+	snd_pcm_uframes_t i;
+	double sound;
+	int v;
+
+	for (i = 0; i < frames; ++i) {
+		sound = 0;
+		for (v = 0; v < poly; ++v) {
+			sound += sin(phase[v]) * 1000;
+			phase[v] += 2 * M_PI * (300 + v * 100) / rate;
+			if (phase[v] > 2 * M_PI)
+				phase[v] -= 2 * M_PI;
+		}
+		buf[2 * i] = sound;
+		buf[2 * i + 1] = sound;
+	}
+}
+
+/*
+ * Plays the synthetic load with one setting for soak seconds.
+ * Returns 0 when done, 1 when the device does not support the setting,
+ * or a negative error code.
+ */
+static int tune_run(const char *device_name, struct tune_result *res, int soak, int poly)
+{
+	snd_pcm_t *pcm;
+	snd_pcm_hw_params_t *hw_params;
+	snd_pcm_sw_params_t *sw_params;
+	snd_pcm_sframes_t written;
+	double phase[128] = { 0 };
+	double end, now, last, took, period_us, jitter_sum;
+	short *buf;
+	long wakeups;
+	int skip;
+	int err;
+
+	err = snd_pcm_open(&pcm, device_name, SND_PCM_STREAM_PLAYBACK, 0);
+	if (err < 0) {
+		fprintf(stderr, "cannot open device '%s': %s\n", device_name, snd_strerror(err));
+		return err;
+	}
+
+	snd_pcm_hw_params_alloca(&hw_params);
+	snd_pcm_hw_params_any(pcm, hw_params);
+	if (snd_pcm_hw_params_set_access(pcm, hw_params, res->access) < 0 ||
+	    snd_pcm_hw_params_set_format(pcm, hw_params, SND_PCM_FORMAT_S16_LE) < 0 ||
+	    snd_pcm_hw_params_set_channels(pcm, hw_params, 2) < 0 ||
+	    snd_pcm_hw_params_set_rate_near(pcm, hw_params, &res->rate, 0) < 0 ||
+	    snd_pcm_hw_params_set_periods(pcm, hw_params, res->periods, 0) < 0 ||
+	    snd_pcm_hw_params_set_period_size(pcm, hw_params, res->period_size, 0) < 0 ||
+	    snd_pcm_hw_params(pcm, hw_params) < 0) {
+		snd_pcm_close(pcm);
+		return 1;
+	}
+
+	/* wake up once a period, start once the whole buffer is filled */
+	snd_pcm_sw_params_alloca(&sw_params);
+	snd_pcm_sw_params_current(pcm, sw_params);
+	snd_pcm_sw_params_set_avail_min(pcm, sw_params, res->period_size);
+	snd_pcm_sw_params_set_start_threshold(pcm, sw_params, res->period_size * res->periods);
+	snd_pcm_sw_params(pcm, sw_params);
+
+	buf = calloc(res->period_size, 2 * sizeof(short));
+	if (!buf) {
+		snd_pcm_close(pcm);
+		return -ENOMEM;
+	}
+
+	period_us = res->period_size * 1e6 / res->rate;
+	res->xruns = 0;
+	res->jitter_max_us = 0;
+	res->load_max = 0;
+	jitter_sum = 0;
+	wakeups = 0;
+	last = 0;
+	skip = res->periods;
+	end = now_us() + soak * 1e6;
+	for (now = now_us(); now < end; now = now_us()) {
+		/* the first wakeups only fill the buffer, they are not paced by the device */
+		if (skip > 0) {
+			skip--;
+			last = 0;
+		} else if (last > 0) {
+			jitter_sum += fabs(now - last - period_us);
+			if (fabs(now - last - period_us) > res->jitter_max_us)
+				res->jitter_max_us = fabs(now - last - period_us);
+			wakeups++;
+		}
+		if (skip == 0)
+			last = now;
+
+		tune_render(buf, res->period_size, poly, res->rate, phase);
+		took = now_us() - now;
+		if (took / period_us > res->load_max)
+			res->load_max = took / period_us;
+
+		if (res->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+			written = snd_pcm_mmap_writei(pcm, buf, res->period_size);
+		else
+			written = snd_pcm_writei(pcm, buf, res->period_size);
+		if (written < 0) {
+			res->xruns++;
+			err = snd_pcm_recover(pcm, written, 1);
+			if (err < 0) {
+				fprintf(stderr, "cannot recover from xrun: %s\n", snd_strerror(err));
+				break;
+			}
+			skip = res->periods;
+		}
+	}
+	res->jitter_avg_us = wakeups ? jitter_sum / wakeups : 0;
+
+	snd_pcm_drop(pcm);
+	snd_pcm_close(pcm);
+	free(buf);
+
+	/* a short pause between runs, so the device settles */
+	usleep(100000);
+	return 0;
+}
+
+static double tune_latency_ms(const struct tune_result *res)
+{
+	return res->period_size * res->periods * 1000.0 / res->rate;
+}
+
+/*
+ * A setting is stable when it had no xruns and no wakeup came later than
+ * half the time the other periods in the buffer leave for it.
+ */
+static int tune_stable(const struct tune_result *res)
+{
+	double headroom_us = (res->periods - 1) * res->period_size * 1e6 / res->rate;
+
+	return res->xruns == 0 && res->jitter_max_us < headroom_us / 2;
+}
+
+static int tune(const char *device_name, const char *config_name, unsigned int rate, int soak, int poly)
+{
+	struct tune_result res, best;
+	unsigned int a, p, n;
+	int found = 0;
+	FILE *config;
+	int err;
+
+	printf("Tuning %s at %u Hz, %d tones, %d s per setting\n", device_name, rate, poly, soak);
+	printf("%-6s %6s %7s %10s %5s %12s %12s %6s\n",
+	       "access", "period", "periods", "latency ms", "xruns", "jitter avg", "jitter max", "load");
+	for (a = 0; a < ARRAY_SIZE(tune_accesses); ++a) {
+		for (n = 0; n < ARRAY_SIZE(tune_periods); ++n) {
+			for (p = 0; p < ARRAY_SIZE(tune_period_sizes); ++p) {
+				memset(&res, 0, sizeof(res));
+				res.access = tune_accesses[a];
+				res.period_size = tune_period_sizes[p];
+				res.periods = tune_periods[n];
+				res.rate = rate;
+				err = tune_run(device_name, &res, soak, poly);
+				if (err < 0)
+					return 1;
+				if (err > 0)
+					continue;
+				printf("%-6s %6lu %7u %10.2f %5d %9.0f us %9.0f us %5.0f%% %s\n",
+				       res.access == SND_PCM_ACCESS_MMAP_INTERLEAVED ? "mmap" : "rw",
+				       res.period_size, res.periods, tune_latency_ms(&res), res.xruns,
+				       res.jitter_avg_us, res.jitter_max_us, res.load_max * 100,
+				       tune_stable(&res) ? "stable" : "");
+				fflush(stdout);
+				if (tune_stable(&res) && (!found || tune_latency_ms(&res) < tune_latency_ms(&best) ||
+				    (tune_latency_ms(&res) == tune_latency_ms(&best) && res.jitter_max_us < best.jitter_max_us))) {
+					best = res;
+					found = 1;
+				}
+			}
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "no stable setting found\n");
+		return 1;
+	}
+
+	config = config_name ? fopen(config_name, "w") : stdout;
+	if (!config) {
+		fprintf(stderr, "cannot write '%s': %s\n", config_name, strerror(errno));
+		return 1;
+	}
+	fprintf(config, "# LSMidi config written by hw_params -t, load with LSMidi -C <file>\n");
+	fprintf(config, "# latency %.2f ms, %d xruns, wakeup jitter avg %.0f us max %.0f us, load %.0f%%\n",
+		tune_latency_ms(&best), best.xruns, best.jitter_avg_us, best.jitter_max_us, best.load_max * 100);
+	fprintf(config, "device=%s\n", device_name);
+	fprintf(config, "rate=%u\n", best.rate);
+	fprintf(config, "access=%s\n", best.access == SND_PCM_ACCESS_MMAP_INTERLEAVED ? "mmap" : "rw");
+	fprintf(config, "period_size=%lu\n", best.period_size);
+	fprintf(config, "periods=%u\n", best.periods);
+	if (config != stdout)
+		fclose(config);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	const char *device_name = "hw";
+	const char *config_name = NULL;
 	snd_pcm_t *pcm;
 	snd_pcm_hw_params_t *hw_params;
 	unsigned int i;
 	unsigned int min, max;
+	unsigned int tune_rate = 48000;
+	int tune_soak = 10, tune_poly = 16;
+	int do_tune = 0;
 	int any_rate;
 	int err;
+	int c;
+
+	while ((c = getopt(argc, argv, "to:r:s:p:h")) != -1) {
+		switch (c) {
+		case 't':
+			do_tune = 1;
+			break;
+		case 'o':
+			config_name = optarg;
+			break;
+		case 'r':
+			tune_rate = atoi(optarg);
+			break;
+		case 's':
+			tune_soak = atoi(optarg);
+			break;
+		case 'p':
+			tune_poly = atoi(optarg);
+			if (tune_poly > 128)
+				tune_poly = 128;
+			break;
+		default:
+			printf("Usage: hw_params [-t] [-o config file] [-r rate] [-s soak seconds] [-p tones] [device]\n");
+			printf("Without -t, prints the capabilities of the device.\n");
+			printf("-t tries every period size, period count and access mode for soak seconds\n");
+			printf("   each, and writes the lowest latency stable setting for LSMidi -C.\n");
+			return 1;
+		}
+	}
+	if (optind < argc)
+		device_name = argv[optind];
 
-	if (argc > 1)
-		device_name = argv[1];
+	if (do_tune)
+		return tune(device_name, config_name, tune_rate, tune_soak, tune_poly);
 
 	err = snd_pcm_open(&pcm, device_name, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK);
 	if (err < 0) {
@@ -0,0 +1,425 @@
+/*
+    LinzerSchnitte Audio - audio sinks for the LinzerSchnitte sound server
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <alsa/asoundlib.h>
+#include "ls_audio.h"
+
+struct backend {
+    const char *name;
+    int (*open)(const char *device, unsigned int *rate, int period_size, int periods, int mmap);
+    void (*close)(void);
+    int (*poll_count)(void);
+    int (*poll_descriptors)(struct pollfd *pfds, int space);
+    int (*ready)(struct pollfd *pfds, int nfds);
+    short *(*begin)(int *frames);
+    int (*commit)(int frames);
+    long (*delay)(void);
+    void (*recover)(void);
+};
+
+static const struct backend *backend;
+static short *buf;			/* one period, for sinks that can not be rendered into directly */
+static int period_frames, buffer_periods;
+
+/* ALSA */
+
+static snd_pcm_t *pcm;
+static int pcm_mmap, mmap_direct;
+static snd_pcm_uframes_t mmap_offset;
+
+static int alsa_open(const char *device, unsigned int *rate, int period_size, int periods, int mmap) {
+
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_sw_params_t *sw_params;
+
+    if (snd_pcm_open (&pcm, device, SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+        printf("\n Error: cannot open audio device %s\n\n", device);
+        return -1;
+    }
+    pcm_mmap = mmap;
+    snd_pcm_hw_params_alloca(&hw_params);
+    snd_pcm_hw_params_any(pcm, hw_params);
+    snd_pcm_hw_params_set_access(pcm, hw_params, mmap ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED);
+    snd_pcm_hw_params_set_format(pcm, hw_params, SND_PCM_FORMAT_S16_LE);
+
+    snd_pcm_hw_params_set_rate_near(pcm, hw_params, rate, 0);
+
+    snd_pcm_hw_params_set_channels(pcm, hw_params, 2);
+    snd_pcm_hw_params_set_periods(pcm, hw_params, periods, 0);
+    snd_pcm_hw_params_set_period_size(pcm, hw_params, period_size, 0);
+    snd_pcm_hw_params(pcm, hw_params);
+    snd_pcm_sw_params_alloca(&sw_params);
+    snd_pcm_sw_params_current(pcm, sw_params);
+    snd_pcm_sw_params_set_avail_min(pcm, sw_params, period_size);
+    snd_pcm_sw_params(pcm, sw_params);
+    return 0;
+}
+
+static void alsa_close() {
+
+    if (pcm) snd_pcm_close(pcm);
+    pcm = NULL;
+}
+
+static int alsa_poll_count() {
+
+    return snd_pcm_poll_descriptors_count(pcm);
+}
+
+static int alsa_poll_descriptors(struct pollfd *pfds, int space) {
+
+    return snd_pcm_poll_descriptors(pcm, pfds, space);
+}
+
+static int alsa_ready(struct pollfd *pfds, int nfds) {
+
+    unsigned short revents;
+
+    if (snd_pcm_poll_descriptors_revents(pcm, pfds, nfds, &revents) < 0) return 0;
+    return (revents & (POLLOUT | POLLERR)) != 0;
+}
+
+/* with mmap the period is rendered straight into the ring buffer, when it does not wrap */
+static short *alsa_begin(int *frames) {
+
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, n;
+
+    mmap_direct = 0;
+    if (pcm_mmap && snd_pcm_avail_update(pcm) >= *frames) {
+        n = *frames;
+        if (snd_pcm_mmap_begin(pcm, &areas, &offset, &n) >= 0 && n == (snd_pcm_uframes_t)*frames &&
+            areas[0].step == 32 && areas[0].first == 0 && areas[1].addr == areas[0].addr && areas[1].first == 16) {
+            mmap_direct = 1;
+            mmap_offset = offset;
+            return (short *)areas[0].addr + 2 * offset;
+        }
+    }
+    return buf;
+}
+
+static int alsa_commit(int frames) {
+
+    snd_pcm_sframes_t r;
+
+    if (!mmap_direct) return pcm_mmap ? snd_pcm_mmap_writei(pcm, buf, frames) : snd_pcm_writei(pcm, buf, frames);
+
+    /* mmap does not start the device by itself, start it once the buffer is full */
+    r = snd_pcm_mmap_commit(pcm, mmap_offset, frames);
+    if (r >= 0 && snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED && snd_pcm_avail_update(pcm) < period_frames)
+        snd_pcm_start(pcm);
+    return r;
+}
+
+static long alsa_delay() {
+
+    snd_pcm_sframes_t delay;
+
+    if (snd_pcm_delay(pcm, &delay) < 0) return 0;
+    return delay;
+}
+
+static void alsa_recover() {
+
+    snd_pcm_prepare(pcm);
+}
+
+static const struct backend alsa_backend = {
+    "alsa", alsa_open, alsa_close, alsa_poll_count, alsa_poll_descriptors,
+    alsa_ready, alsa_begin, alsa_commit, alsa_delay, alsa_recover
+};
+
+/*
+    null, WAV and raw: a timerfd ticks once a period, each tick frees a
+    period in an imaginary buffer of the configured number of periods.
+    More ticks than that before the next commit is an xrun.
+*/
+
+static int timer_fd = -1, out_fd = -1, out_wav;
+static long long free_periods, frames_out;
+static unsigned int out_rate;
+static struct itimerspec timer_period;
+static int timer_running;
+
+/* while the buffer fills the timer fires at once, so poll() does not wait */
+static void timer_arm(int running) {
+
+    struct itimerspec kick = { { 0, 0 }, { 0, 1 } };
+
+    timer_running = running;
+    timerfd_settime(timer_fd, 0, running ? &timer_period : &kick, NULL);
+}
+
+static void put16(unsigned char *b, unsigned int v) {
+
+    b[0] = v; b[1] = v >> 8;
+}
+
+static void put32(unsigned char *b, unsigned long v) {
+
+    b[0] = v; b[1] = v >> 8; b[2] = v >> 16; b[3] = v >> 24;
+}
+
+static int write_all(const void *data, size_t size) {
+
+    const char *p = data;
+    ssize_t r;
+
+    while (size > 0) {
+        r = write(out_fd, p, size);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += r;
+        size -= r;
+    }
+    return 0;
+}
+
+/* 44 byte canonical WAV header, the sizes are the largest allowed until they are known */
+static int write_wav_header(long long data_bytes) {
+
+    unsigned char h[44];
+
+    if (data_bytes > 0x7FFFFFDB) data_bytes = 0x7FFFFFDB;
+    memcpy(h, "RIFF", 4);
+    put32(h + 4, 36 + data_bytes);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put32(h + 16, 16);
+    put16(h + 20, 1);			/* PCM */
+    put16(h + 22, 2);			/* channels */
+    put32(h + 24, out_rate);
+    put32(h + 28, out_rate * 4);	/* bytes per second */
+    put16(h + 32, 4);			/* bytes per frame */
+    put16(h + 34, 16);			/* bits per sample */
+    memcpy(h + 36, "data", 4);
+    put32(h + 40, data_bytes);
+    return write_all(h, sizeof(h));
+}
+
+static int timer_open(const char *path, unsigned int *rate, int period_size, int periods) {
+
+    long long period_ns;
+
+    out_rate = *rate;
+    free_periods = periods;
+    frames_out = 0;
+
+    if (path) {
+        if (!strcmp(path, "-")) {
+            /* the audio owns stdout now, what LSMidi prints goes to stderr */
+            out_fd = dup(1);
+            dup2(2, 1);
+        } else {
+            out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (out_fd < 0) {
+            fprintf(stderr, "Error: cannot open audio output %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        if (out_wav && write_wav_header(0x7FFFFFDB) < 0) {
+            fprintf(stderr, "Error: cannot write %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timer_fd < 0) {
+        fprintf(stderr, "Error: cannot create audio timer: %s\n", strerror(errno));
+        return -1;
+    }
+    /* armed by the commit that fills the buffer, like an ALSA start threshold */
+    period_ns = period_size * 1000000000LL / *rate;
+    timer_period.it_interval.tv_sec = period_ns / 1000000000LL;
+    timer_period.it_interval.tv_nsec = period_ns % 1000000000LL;
+    timer_period.it_value = timer_period.it_interval;
+    timer_arm(0);
+    return 0;
+}
+
+static int null_open(const char *device, unsigned int *rate, int period_size, int periods, int mmap) {
+
+    out_wav = 0;
+    return timer_open(NULL, rate, period_size, periods);
+}
+
+static int wav_open(const char *device, unsigned int *rate, int period_size, int periods, int mmap) {
+
+    out_wav = 1;
+    return timer_open(device + 4, rate, period_size, periods);
+}
+
+static int raw_open(const char *device, unsigned int *rate, int period_size, int periods, int mmap) {
+
+    out_wav = 0;
+    return timer_open(strcmp(device, "-") ? device + 4 : "-", rate, period_size, periods);
+}
+
+static void timer_close() {
+
+    /* patch in the real sizes, when the file can seek */
+    if (out_fd >= 0 && out_wav && lseek(out_fd, 0, SEEK_SET) == 0)
+        write_wav_header(frames_out * 4);
+    if (out_fd >= 0) close(out_fd);
+    if (timer_fd >= 0) close(timer_fd);
+    out_fd = timer_fd = -1;
+}
+
+static int timer_poll_count() {
+
+    return 1;
+}
+
+static int timer_poll_descriptors(struct pollfd *pfds, int space) {
+
+    if (space < 1) return 0;
+    pfds[0].fd = timer_fd;
+    pfds[0].events = POLLIN;
+    return 1;
+}
+
+static int timer_ready(struct pollfd *pfds, int nfds) {
+
+    uint64_t ticks;
+
+    if (nfds > 0 && (pfds[0].revents & POLLIN) && read(timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks)
+        && timer_running)
+        free_periods += ticks;
+    return free_periods > 0;
+}
+
+static short *timer_begin(int *frames) {
+
+    return buf;
+}
+
+static int timer_commit(int frames) {
+
+    /* the imaginary buffer ran empty, stop the clock until it is full again */
+    if (free_periods > buffer_periods) {
+        free_periods = buffer_periods;
+        timer_arm(0);
+        return -EPIPE;
+    }
+    if (out_fd >= 0 && write_all(buf, frames * 4) < 0) {
+        perror("audio output");
+        return LS_AUDIO_LOST;
+    }
+    free_periods--;
+    frames_out += frames;
+    if (!timer_running) timer_arm(free_periods == 0);
+    return frames;
+}
+
+static long timer_delay() {
+
+    return (buffer_periods - free_periods) * period_frames;
+}
+
+static void timer_recover() {
+}
+
+static const struct backend null_backend = {
+    "null", null_open, timer_close, timer_poll_count, timer_poll_descriptors,
+    timer_ready, timer_begin, timer_commit, timer_delay, timer_recover
+};
+
+static const struct backend wav_backend = {
+    "wav", wav_open, timer_close, timer_poll_count, timer_poll_descriptors,
+    timer_ready, timer_begin, timer_commit, timer_delay, timer_recover
+};
+
+static const struct backend raw_backend = {
+    "raw", raw_open, timer_close, timer_poll_count, timer_poll_descriptors,
+    timer_ready, timer_begin, timer_commit, timer_delay, timer_recover
+};
+
+int ls_audio_open(const char *device, unsigned int *rate, int period_size, int periods, int mmap) {
+
+    if (!strcmp(device, "null")) backend = &null_backend;
+    else if (!strncmp(device, "wav:", 4)) backend = &wav_backend;
+    else if (!strncmp(device, "raw:", 4) || !strcmp(device, "-")) backend = &raw_backend;
+    else backend = &alsa_backend;
+
+    period_frames = period_size;
+    buffer_periods = periods;
+    buf = (short *) calloc (period_size, 2 * sizeof (short));
+    if (!buf) return -1;
+    if (backend->open(device, rate, period_size, periods, mmap) < 0) {
+        ls_audio_close();
+        return -1;
+    }
+    return 0;
+}
+
+void ls_audio_close() {
+
+    if (backend) backend->close();
+    backend = NULL;
+    free(buf);
+    buf = NULL;
+}
+
+const char *ls_audio_name() {
+
+    return backend ? backend->name : "none";
+}
+
+int ls_audio_poll_count() {
+
+    return backend->poll_count();
+}
+
+int ls_audio_poll_descriptors(struct pollfd *pfds, int space) {
+
+    return backend->poll_descriptors(pfds, space);
+}
+
+int ls_audio_ready(struct pollfd *pfds, int nfds) {
+
+    return backend->ready(pfds, nfds);
+}
+
+short *ls_audio_begin(int *frames) {
+
+    return backend->begin(frames);
+}
+
+int ls_audio_commit(int frames) {
+
+    return backend->commit(frames);
+}
+
+long ls_audio_delay() {
+
+    return backend->delay();
+}
+
+void ls_audio_recover() {
+
+    backend->recover();
+}
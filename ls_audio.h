@@ -0,0 +1,58 @@
+/*
+    LinzerSchnitte Audio - audio sinks for the LinzerSchnitte sound server
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef LS_AUDIO_H
+#define LS_AUDIO_H
+
+#include <poll.h>
+
+/* of ls_audio_commit(), the sink cannot take audio any more */
+#define LS_AUDIO_LOST (-100000)
+
+/*
+    The device name picks the sink:
+
+        null            throws the audio away
+        wav:<file>      16 bit stereo WAV file
+        raw:<file>      headerless 16 bit little endian stereo, "raw:-" or
+                        just "-" is stdout, for piping into an encoder
+        anything else   ALSA PCM device, rw or mmap access
+
+    The sinks that are not ALSA are clocked by a timerfd at the sample
+    rate, so LSMidi runs in real time without audio hardware.
+
+    Audio goes out one period at a time: wait with poll() on the
+    descriptors until ls_audio_ready(), render interleaved stereo
+    frames into ls_audio_begin() and hand them over with
+    ls_audio_commit(). A commit that returns less than a period is an
+    xrun, ls_audio_recover() gets the sink going again, except for
+    LS_AUDIO_LOST when a write to the file or pipe failed.
+*/
+
+int ls_audio_open(const char *device, unsigned int *rate, int period_size, int periods, int mmap);
+void ls_audio_close(void);
+const char *ls_audio_name(void);
+int ls_audio_poll_count(void);
+int ls_audio_poll_descriptors(struct pollfd *pfds, int space);
+int ls_audio_ready(struct pollfd *pfds, int nfds);
+short *ls_audio_begin(int *frames);
+int ls_audio_commit(int frames);
+long ls_audio_delay(void);
+void ls_audio_recover(void);
+
+#endif
@@ -0,0 +1,673 @@
+/*
+    LinzerSchnitte Commands - receiver commands straight into the tone engine
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "ls_synth.h"
+#include "ls_cmd.h"
+
+#define MAX_EVENTS 16384        /* scheduled and not yet handed to ls_synth */
+#define MAX_DATAGRAM 8192
+#define MAX_BLINKS 1000
+#define MAX_BURSTS 16384        /* waiting to fit */
+#define PACK_TRIES 64           /* bursts tried per buffer, the others wait for the next */
+#define WAIT_MS 10000           /* longest wait the percentiles tell apart */
+#define SLOTS LS_SYNTH_SLOTS      /* receivers, then patterns */
+#define WORDS ((SLOTS + 63) / 64)
+#define TONE_WORDS (LS_SYNTH_NOTES / 64)
+#define NAME_LEN 16
+#define FRAMES 16               /* bitmap frames waiting for their buffer */
+
+struct event {
+    long long t;
+    unsigned int seq;           /* keeps the order of events at the same time */
+    unsigned char note, on, burst;
+};
+
+/* a pulse, or one of a blink, waiting for a voice */
+struct burst {
+    long long ready;            /* due from here */
+    long long length;
+    unsigned char note;
+};
+
+static int cmd_fd = -1;
+static struct ls_cmd_config cfg;
+static char unix_path[108];
+
+/* min heap on (t, seq) */
+static struct event heap[MAX_EVENTS], batch[MAX_EVENTS], deferred[MAX_EVENTS];
+static int heap_n;
+static unsigned int next_seq;
+/* receivers switched on by on, off and bitmap frames, a bit per note */
+static unsigned long long lit[WORDS];
+/* receivers sounding a pulse or blink burst of their own, never lit at the same time */
+static unsigned long long burst_lit[WORDS];
+
+/* the last bitmap frame due in a buffer is applied, the others in it are merged into it */
+static struct {
+    long long t;
+    unsigned long long want[TONE_WORDS];
+} frame[FRAMES];
+static unsigned int frame_head, frame_tail;
+
+/* in order of arrival, bursts of a batch in the order of its lines */
+static struct burst backlog[MAX_BURSTS], batch_bursts[MAX_BURSTS];
+static int backlog_n;
+static long long sounding_until[SLOTS], quiet_until[SLOTS];
+/* sum of the tables of the notes on in pack(), table_len ints */
+static int *peak_sum;
+
+/* names of the patterns, "" when free */
+static char pattern_name[LS_SYNTH_PATTERNS][NAME_LEN], saved_name[LS_SYNTH_PATTERNS][NAME_LEN];
+static struct {
+    int p;
+    unsigned char notes[LS_SYNTH_NOTES];
+} define[LS_SYNTH_PATTERNS];
+static int defines;
+
+static long batches, rejected, events, late, no_voice, frames, merged, changes;
+static long bursts, backlog_max, waits[WAIT_MS + 1];
+static long long first_start, last_start;
+
+static const char *names[] = { "off", "on", "pulse", "blink" };
+
+static int is_set(const unsigned long long *map, int k) {
+
+    return map[k / 64] >> (k % 64) & 1;
+}
+
+static void set_bit(unsigned long long *map, int k, int on) {
+
+    if (on) map[k / 64] |= 1ULL << (k % 64);
+    else map[k / 64] &= ~(1ULL << (k % 64));
+}
+
+static int before(const struct event *a, const struct event *b) {
+
+    return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+static void heap_push(const struct event *e) {
+
+    struct event t;
+    int i, p;
+
+    i = heap_n++;
+    heap[i] = *e;
+    while (i > 0 && before(&heap[i], &heap[p = (i - 1) / 2])) {
+        t = heap[i];
+        heap[i] = heap[p];
+        heap[p] = t;
+        i = p;
+    }
+}
+
+static void heap_pop(struct event *e) {
+
+    struct event t;
+    int i, c;
+
+    *e = heap[0];
+    heap[0] = heap[--heap_n];
+    for (i = 0; (c = 2 * i + 1) < heap_n; i = c) {
+        if (c + 1 < heap_n && before(&heap[c + 1], &heap[c])) c++;
+        if (!before(&heap[c], &heap[i])) break;
+        t = heap[i];
+        heap[i] = heap[c];
+        heap[c] = t;
+    }
+}
+
+int ls_cmd_open(const char *where, const struct ls_cmd_config *config) {
+
+    struct sockaddr_in addr;
+    struct sockaddr_un uaddr;
+    struct stat st;
+
+    cfg = *config;
+    free(peak_sum);
+    peak_sum = malloc(ls_synth_table_len() * sizeof(int));
+    if (!peak_sum) {
+        fprintf(stderr, "Error: no memory for the command peak limit\n");
+        return -1;
+    }
+    if (cfg.tones > LS_SYNTH_NOTES) cfg.tones = LS_SYNTH_NOTES;
+    if (cfg.spacing < 1) cfg.spacing = 1;
+    heap_n = backlog_n = 0;
+    memset(lit, 0, sizeof(lit));
+    memset(burst_lit, 0, sizeof(burst_lit));
+    memset(pattern_name, 0, sizeof(pattern_name));
+    frame_head = frame_tail = 0;
+    memset(sounding_until, 0, sizeof(sounding_until));
+    memset(quiet_until, 0, sizeof(quiet_until));
+    if (where[0] == '/') {
+        /* a Unix datagram socket at this path */
+        if (strlen(where) >= sizeof(uaddr.sun_path)) {
+            fprintf(stderr, "Error: command socket path too long\n");
+            return -1;
+        }
+        cmd_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        memset(&uaddr, 0, sizeof(uaddr));
+        uaddr.sun_family = AF_UNIX;
+        strcpy(uaddr.sun_path, where);
+        /* a socket left behind by an earlier run is replaced, any other file is not */
+        if (lstat(where, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(where);
+        if (cmd_fd < 0 || bind(cmd_fd, (struct sockaddr *)&uaddr, sizeof(uaddr)) < 0) {
+            perror("command socket");
+            ls_cmd_close();
+            return -1;
+        }
+        strcpy(unix_path, where);
+        return cmd_fd;
+    }
+    cmd_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(atoi(where));
+    if (cmd_fd < 0 || bind(cmd_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("command socket");
+        ls_cmd_close();
+        return -1;
+    }
+    return cmd_fd;
+}
+
+void ls_cmd_close() {
+
+    if (cmd_fd >= 0) close(cmd_fd);
+    cmd_fd = -1;
+    if (unix_path[0]) unlink(unix_path);
+    unix_path[0] = 0;
+    free(peak_sum);
+    peak_sum = NULL;
+}
+
+static int find_pattern(const char *name) {
+
+    int p;
+
+    for (p = 0; p < LS_SYNTH_PATTERNS; p++) if (!strcmp(pattern_name[p], name)) return p;
+    return -1;
+}
+
+/* marks the receivers of a list like 1,4,10-20,@name in want, 0 when it is not one */
+static int parse_receivers(char *list, unsigned char *want) {
+
+    char *tok, *save, *end;
+    long lo, hi;
+    int p;
+
+    memset(want, 0, SLOTS);
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (tok[0] == '@') {
+            if ((p = find_pattern(tok + 1)) < 0) return 0;
+            want[LS_SYNTH_NOTES + p] = 1;
+            continue;
+        }
+        lo = strtol(tok, &end, 10);
+        hi = lo;
+        if (*end == '-') hi = strtol(end + 1, &end, 10);
+        if (end == tok || *end || lo < 0 || hi < lo || hi >= cfg.tones) return 0;
+        for (; lo <= hi; lo++) want[lo] = 1;
+    }
+    return 1;
+}
+
+static int add_event(int *n, long long t, int note, int on) {
+
+    if (*n + heap_n >= MAX_EVENTS) return 0;
+    batch[*n].t = t;
+    batch[*n].seq = next_seq++;
+    batch[*n].note = note;
+    batch[*n].on = on;
+    batch[*n].burst = 0;
+    (*n)++;
+    return 1;
+}
+
+static int add_burst(int *nb, long long ready, long long length, int note) {
+
+    if (*nb + backlog_n >= MAX_BURSTS) return 0;
+    batch_bursts[*nb].ready = ready;
+    batch_bursts[*nb].length = length;
+    batch_bursts[*nb].note = note;
+    (*nb)++;
+    return 1;
+}
+
+/*
+   pattern name receivers, the notes are premixed once the batch is
+   taken. A new name gets a free slot whose last voice has faded.
+*/
+static const char *define_pattern(char *name, char *list, long long start_ns) {
+
+    unsigned char want[SLOTS];
+    int p, i;
+
+    if (!name || strlen(name) >= NAME_LEN) return "pattern needs a name";
+    if (list && (!parse_receivers(list, want) || memchr(want + LS_SYNTH_NOTES, 1, LS_SYNTH_PATTERNS)))
+        return "bad receiver list";
+    if ((p = find_pattern(name)) < 0) {
+        if (!list) return "no such pattern";
+        for (p = 0; p < LS_SYNTH_PATTERNS && (pattern_name[p][0] || sounding_until[LS_SYNTH_NOTES + p] > start_ns); p++);
+        if (p == LS_SYNTH_PATTERNS) return "too many patterns";
+        strcpy(pattern_name[p], name);
+    }
+    for (i = 0; i < defines && define[i].p != p; i++);
+    if (i == defines) defines++;
+    define[i].p = p;
+    if (list) memcpy(define[i].notes, want, LS_SYNTH_NOTES);
+    else memset(define[i].notes, 0, LS_SYNTH_NOTES);
+    /*
+       without notes the pattern is dropped once the batch is taken: the
+       name can still be used in the rest of the batch, but drop_slot()
+       forgets those commands with the others of the pattern
+    */
+    return NULL;
+}
+
+/* compiles one line into batch and batch_bursts, returns an error or NULL */
+static const char *compile_line(char *line, long long start_ns, int *n, int *nb) {
+
+    char *tok[6], *save, *end;
+    unsigned char want[SLOTS];
+    long long t, ms, delay;
+    int ntok, first, code, count, r, i, ok;
+
+    /* tok[5] is the sixth token, one more than any line has */
+    ntok = 0;
+    for (tok[0] = strtok_r(line, " \t\r", &save); tok[ntok] && ntok < 5; tok[ntok] = strtok_r(NULL, " \t\r", &save))
+        ntok++;
+    if (ntok == 0 || tok[0][0] == '#') return NULL;
+    if (ntok == 5 && tok[5]) return "too many words";
+    if (!strcmp(tok[0], "pattern")) {
+        if (ntok > 3) return "too many words";
+        return define_pattern(tok[1], ntok > 2 ? tok[2] : NULL, start_ns);
+    }
+    first = 0;
+    delay = 0;
+    if (tok[0][0] == '+') {
+        delay = strtoll(tok[0] + 1, &end, 10);
+        if (end == tok[0] + 1 || *end || delay < 0) return "bad delay";
+        first = 1;
+    }
+    if (ntok < first + 2) return "expected receivers and a command";
+    if (!parse_receivers(tok[first], want)) return "bad receiver list";
+    for (code = 0; code < 4 && strcmp(tok[first + 1], names[code]); code++);
+    if (code == 4) {
+        code = atoi(tok[first + 1]);
+        if (code < LS_CMD_OFF || code > LS_CMD_BLINK || !strchr("0123456789", tok[first + 1][0]))
+            return "unknown command";
+    }
+    if (ntok > first + 2 + (code == LS_CMD_PULSE ? 1 : code == LS_CMD_BLINK ? 2 : 0)) return "too many words";
+    ms = ntok > first + 2 ? atoll(tok[first + 2]) : 0;
+    count = ntok > first + 3 ? atoi(tok[first + 3]) : 1;
+    if ((code == LS_CMD_PULSE || code == LS_CMD_BLINK) && ms < 1) return "needs a time in ms";
+    if (code == LS_CMD_BLINK && (count < 1 || count > MAX_BLINKS)) return "bad blink count";
+
+    t = start_ns + delay * 1000000LL;
+    ok = 1;
+    for (r = 0; r < SLOTS && ok; r++) {
+        if (!want[r]) continue;
+        switch (code) {
+        case LS_CMD_OFF:
+            ok = add_event(n, t, r, 0);
+            break;
+        case LS_CMD_ON:
+            ok = add_event(n, t, r, 1);
+            break;
+        default:
+            for (i = 0; i < count && ok; i++) ok = add_burst(nb, t + 2 * i * ms * 1000000LL, ms * 1000000LL, r);
+        }
+    }
+    return ok ? NULL : "schedule full";
+}
+
+/* ms that share p of all bursts waited at most */
+static int wait_percentile(double p) {
+
+    long n, sum;
+    int ms;
+
+    n = 0;
+    for (ms = 0; ms <= WAIT_MS; ms++) n += waits[ms];
+    sum = 0;
+    for (ms = 0; ms < WAIT_MS; ms++) {
+        sum += waits[ms];
+        if (sum >= p * n) break;
+    }
+    return ms;
+}
+
+static void stats_text(char *text, int size) {
+
+    double seconds;
+
+    seconds = (last_start - first_start) / 1e9;
+    snprintf(text, size, "%ld batches, %ld rejected, %ld events, %ld late, %ld without a voice, "
+        "%ld bursts, %.1f per second, backlog %d, at most %ld, wait %d %d %d ms at 50 95 99 %%, "
+        "%ld bitmaps, %ld merged, %ld tones changed",
+        batches, rejected, events, late, no_voice, bursts, seconds > 0 ? (bursts - 1) / seconds : 0,
+        backlog_n, backlog_max, wait_percentile(0.50), wait_percentile(0.95), wait_percentile(0.99),
+        frames, merged, changes);
+}
+
+/* queues a bitmap frame, returns an error or NULL */
+static const char *receive_bitmap(const unsigned char *buf, int len, long long start_ns) {
+
+    unsigned long long *want;
+    int w, i;
+
+    if (len != LS_CMD_BITMAP_LEN || buf[1] != 1) return "bad bitmap frame";
+    if (frame_head - frame_tail >= FRAMES) return "too many bitmap frames";
+    frame[frame_head % FRAMES].t = start_ns + (buf[2] << 8 | buf[3]) * 1000000LL;
+    want = frame[frame_head % FRAMES].want;
+    for (w = 0; w < TONE_WORDS; w++) {
+        want[w] = 0;
+        for (i = 0; i < 8; i++) want[w] |= (unsigned long long) buf[4 + 8 * w + i] << (8 * i);
+        /* tones above half the rate are never on */
+        if (cfg.tones <= 64 * w) want[w] = 0;
+        else if (cfg.tones < 64 * (w + 1)) want[w] &= (1ULL << (cfg.tones - 64 * w)) - 1;
+    }
+    frame_head++;
+    return NULL;
+}
+
+/*
+   A dropped pattern leaves no events or bursts behind, of this batch
+   or of earlier ones, so a later pattern in its slot starts clean. Its
+   voice is released now and counts as sounding until it has faded.
+*/
+static void drop_slot(int slot, long long start_ns, int *n, int *nb) {
+
+    long long until;
+    int i, j, k;
+
+    for (i = k = 0; i < heap_n; i++) if (heap[i].note != slot) deferred[k++] = heap[i];
+    heap_n = 0;
+    for (i = 0; i < k; i++) heap_push(&deferred[i]);
+    for (i = j = 0; i < *n; i++) if (batch[i].note != slot) batch[j++] = batch[i];
+    *n = j;
+    for (i = j = 0; i < backlog_n; i++) if (backlog[i].note != slot) backlog[j++] = backlog[i];
+    backlog_n = j;
+    for (i = j = 0; i < *nb; i++) if (batch_bursts[i].note != slot) batch_bursts[j++] = batch_bursts[i];
+    *nb = j;
+    until = start_ns + cfg.release * 1000000LL;
+    if (is_set(lit, slot) || is_set(burst_lit, slot) || sounding_until[slot] > until) sounding_until[slot] = until;
+    set_bit(lit, slot, 0);
+    set_bit(burst_lit, slot, 0);
+    quiet_until[slot] = sounding_until[slot] + cfg.gap * 1000000LL;
+}
+
+void ls_cmd_receive(long long start_ns) {
+
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    char buf[MAX_DATAGRAM + 1], reply[512], text[400], *line, *save;
+    const char *error;
+    int len, n, nb, i, line_no, stats;
+
+    from_len = sizeof(from);
+    /* MSG_TRUNC gives the whole length, a cut batch is not taken at all */
+    len = recvfrom(cmd_fd, buf, MAX_DATAGRAM, MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr *)&from, &from_len);
+    if (len < 0) return;
+    if (len > MAX_DATAGRAM) {
+        rejected++;
+        strcpy(reply, "error: batch too long\n");
+        if (from_len > sizeof(sa_family_t))
+            sendto(cmd_fd, reply, strlen(reply), MSG_DONTWAIT, (struct sockaddr *)&from, from_len);
+        return;
+    }
+    buf[len] = 0;
+
+    if (len > 0 && (unsigned char) buf[0] == LS_CMD_BITMAP) {
+        if ((error = receive_bitmap((unsigned char *) buf, len, start_ns))) {
+            rejected++;
+            snprintf(reply, sizeof(reply), "error: %s\n", error);
+        } else {
+            strcpy(reply, "ok\n");
+        }
+        if (from_len > sizeof(sa_family_t))
+            sendto(cmd_fd, reply, strlen(reply), MSG_DONTWAIT, (struct sockaddr *)&from, from_len);
+        return;
+    }
+
+    n = nb = 0;
+    error = NULL;
+    stats = 0;
+    line_no = 0;
+    defines = 0;
+    memcpy(saved_name, pattern_name, sizeof(pattern_name));
+    for (line = strtok_r(buf, "\n", &save); line && !error; line = strtok_r(NULL, "\n", &save)) {
+        line_no++;
+        if (!strncmp(line, "stats", 5) && !line[5 + strspn(line + 5, " \t\r")]) stats = 1;
+        else error = compile_line(line, start_ns, &n, &nb);
+    }
+    if (error) {
+        rejected++;
+        memcpy(pattern_name, saved_name, sizeof(pattern_name));
+        snprintf(reply, sizeof(reply), "error line %d: %s\n", line_no, error);
+    } else {
+        for (i = 0; i < defines; i++) {
+            if (ls_synth_pattern(define[i].p, define[i].notes) < 0 || !memchr(define[i].notes, 1, LS_SYNTH_NOTES)) {
+                pattern_name[define[i].p][0] = 0;
+                drop_slot(LS_SYNTH_NOTES + define[i].p, start_ns, &n, &nb);
+            }
+        }
+        for (i = 0; i < n; i++) heap_push(&batch[i]);
+        for (i = 0; i < nb; i++) backlog[backlog_n++] = batch_bursts[i];
+        if (backlog_n > backlog_max) backlog_max = backlog_n;
+        batches++;
+        if (stats) {
+            stats_text(text, sizeof(text));
+            snprintf(reply, sizeof(reply), "ok %d, %s\n", n + 2 * nb, text);
+        } else {
+            snprintf(reply, sizeof(reply), "ok %d\n", n + 2 * nb);
+        }
+    }
+    /* a Unix socket client without a name of its own gets no reply */
+    if (from_len > sizeof(sa_family_t))
+        sendto(cmd_fd, reply, strlen(reply), MSG_DONTWAIT, (struct sockaddr *)&from, from_len);
+}
+
+/*
+   whether b can start at start next to the notes in on, on and peak_sum
+   then hold its note. Only the sum with the new note is checked.
+*/
+static int fits(const struct burst *b, long long start, unsigned char *on) {
+
+    int k;
+
+    if (heap_n + 2 > MAX_EVENTS || quiet_until[b->note] > start) return 0;
+    for (k = b->note - cfg.spacing + 1; k < b->note + cfg.spacing; k++)
+        if (k >= 0 && k < cfg.tones && k != b->note && on[k]) return 0;
+    if (cfg.max_peak > 0) {
+        if (ls_synth_peak(peak_sum, on[b->note] ? -1 : b->note) > cfg.max_peak) return 0;
+        if (!on[b->note]) ls_synth_sum(peak_sum, b->note);
+    }
+    on[b->note] = 1;
+    return 1;
+}
+
+/* starts the bursts of the backlog that fit, in order, before the events of this buffer go out */
+static void pack(long long t0, long long t1) {
+
+    unsigned char on[SLOTS], held[SLOTS];
+    struct burst *b;
+    struct event e;
+    long long start, wait;
+    int i, j, k, voices, tries;
+
+    voices = cfg.poly - ls_synth_active();
+    if (voices <= 0 || backlog_n == 0) return;
+    memset(on, 0, sizeof(on));
+    for (k = 0; k < SLOTS; k++) on[k] = is_set(lit, k) || sounding_until[k] > t0;
+    if (cfg.max_peak > 0) {
+        memset(peak_sum, 0, ls_synth_table_len() * sizeof(int));
+        for (k = 0; k < SLOTS; k++) if (on[k]) ls_synth_sum(peak_sum, k);
+    }
+    memset(held, 0, sizeof(held));
+    tries = 0;
+    for (i = j = 0; i < backlog_n; i++) {
+        if (voices <= 0 || tries >= PACK_TRIES) {
+            /* the rest keep their order for the next buffer */
+            if (j < i) memmove(&backlog[j], &backlog[i], (backlog_n - i) * sizeof(struct burst));
+            j += backlog_n - i;
+            break;
+        }
+        b = &backlog[i];
+        start = b->ready > t0 ? b->ready : t0;
+        if (b->ready >= t1 || held[b->note] || (++tries && !fits(b, start, on))) {
+            /* later bursts for this note wait behind it */
+            held[b->note] = 1;
+            backlog[j++] = *b;
+            continue;
+        }
+        e.note = b->note;
+        e.burst = 1;
+        e.on = 1;
+        e.t = start;
+        e.seq = next_seq++;
+        heap_push(&e);
+        e.on = 0;
+        e.t = start + b->length;
+        e.seq = next_seq++;
+        heap_push(&e);
+        sounding_until[b->note] = e.t + cfg.release * 1000000LL;
+        quiet_until[b->note] = sounding_until[b->note] + cfg.gap * 1000000LL;
+        voices--;
+
+        wait = (start - b->ready) / 1000000;
+        waits[wait < WAIT_MS ? wait : WAIT_MS]++;
+        if (bursts++ == 0) first_start = start;
+        last_start = start;
+    }
+    backlog_n = j;
+}
+
+/*
+   The receivers that change are the bits that differ between the frame
+   and lit, a word at a time, so the notes that stay as they are cost
+   nothing. Bursts are not in lit, a frame leaves them running unless it
+   switches their receiver on, then the burst's voice stays on as the
+   receiver's. All changes start at the same frame.
+*/
+static void apply_frame(long long t0, long long t1) {
+
+    unsigned long long diff, bit, *want;
+    long long t;
+    int due, w, k;
+
+    due = -1;
+    while (frame_tail != frame_head && frame[frame_tail % FRAMES].t < t1) {
+        if (due >= 0) merged++;
+        due = frame_tail++ % FRAMES;
+    }
+    if (due < 0) return;
+    frames++;
+    want = frame[due].want;
+    t = frame[due].t;
+    if (t < t0) {
+        late++;
+        t = t0;
+    }
+    for (w = 0; w < TONE_WORDS; w++) {
+        for (diff = want[w] ^ lit[w]; diff; diff ^= bit) {
+            bit = diff & -diff;
+            k = 64 * w + __builtin_ctzll(diff);
+            changes++;
+            if (want[w] & bit) {
+                if (burst_lit[w] & bit) {
+                    burst_lit[w] &= ~bit;
+                    lit[w] |= bit;
+                } else if (ls_synth_note_on(k, t) < 0) no_voice++;
+                else lit[w] |= bit;
+            } else {
+                ls_synth_note_off(k, t);
+                lit[w] &= ~bit;
+            }
+        }
+    }
+}
+
+void ls_cmd_run(long long t0, long long t1) {
+
+    unsigned char busy[SLOTS];
+    struct event e;
+    int n, i;
+
+    apply_frame(t0, t1);
+    pack(t0, t1);
+    memset(busy, 0, sizeof(busy));
+    n = 0;
+    while (heap_n > 0 && heap[0].t < t1) {
+        heap_pop(&e);
+        if (busy[e.note]) {
+            deferred[n++] = e;
+            continue;
+        }
+        busy[e.note] = 1;
+        events++;
+        if (e.t < t0) {
+            late++;
+            e.t = t0;
+        }
+        if (e.burst) {
+            /* a burst sounds by itself, a receiver that is on already stays as it is */
+            if (e.on) {
+                if (is_set(lit, e.note) || is_set(burst_lit, e.note)) continue;
+                if (ls_synth_note_on(e.note, e.t) < 0) no_voice++;
+                else set_bit(burst_lit, e.note, 1);
+            } else if (is_set(burst_lit, e.note)) {
+                ls_synth_note_off(e.note, e.t);
+                set_bit(burst_lit, e.note, 0);
+            }
+        } else if (e.on) {
+            /* on is a state, a receiver that is on already stays as it is */
+            if (is_set(lit, e.note)) continue;
+            if (is_set(burst_lit, e.note)) {
+                /* the burst's voice stays on as the receiver's */
+                set_bit(burst_lit, e.note, 0);
+                set_bit(lit, e.note, 1);
+            } else if (ls_synth_note_on(e.note, e.t) < 0) no_voice++;
+            else set_bit(lit, e.note, 1);
+        } else {
+            ls_synth_note_off(e.note, e.t);
+            set_bit(lit, e.note, 0);
+            set_bit(burst_lit, e.note, 0);
+        }
+    }
+    for (i = 0; i < n; i++) heap_push(&deferred[i]);
+}
+
+void ls_cmd_print(FILE *f) {
+
+    char text[400];
+
+    stats_text(text, sizeof(text));
+    fprintf(f, "commands: %s\n", text);
+}
@@ -0,0 +1,123 @@
+/*
+    LinzerSchnitte Commands - receiver commands straight into the tone engine
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef LS_CMD_H
+#define LS_CMD_H
+
+#include <stdio.h>
+
+#define LS_CMD_OFF 0
+#define LS_CMD_ON 1
+#define LS_CMD_PULSE 2          /* on for ms */
+#define LS_CMD_BLINK 3          /* count pulses of ms, ms apart */
+
+/* first byte of a bitmap frame, text never starts with it */
+#define LS_CMD_BITMAP 0xFE
+#define LS_CMD_BITMAP_LEN 260
+#define LS_CMD_BITMAP_TONES 2048
+
+/*
+    Show control sends receiver commands as text datagrams to a UDP port
+    or a Unix datagram socket, one batch per datagram, one command per
+    line:
+
+        [+delay_ms] receivers command [ms [count]]
+
+        12 on
+        0-15,40 pulse 50
+        +200 7,9 blink 30 4
+        pattern chord 3,7,11,20-24
+        @chord pulse 80
+        stats
+
+    receivers is a list of ids, ranges and @name patterns, command a
+    name or its code from above.
+
+        pattern name receivers
+        pattern name
+
+    defines a pattern, a set of receivers that ls_synth premixes and
+    plays as one voice with one envelope, or drops it. A dropped pattern
+    fades out and its commands still waiting are forgotten. Bursts of a
+    pattern are not held apart from other notes by spacing.
+
+    Receiver r listens on note r, at the beta0.7 frequency
+    note * step + 128 * step * channel + base with channel r / 128 and
+    note r % 128. All commands of a batch are timed from the same start,
+    the batch is compiled into tone on/off events and is taken whole or
+    not at all, a datagram over 8192 bytes is refused. The sender gets
+    "ok <events>" or "error line <n>: ..." back when it has an address
+    to reply to.
+
+    A bitmap frame sets which receivers are on, all at once:
+
+         0  0xFE, version 1
+         2  delay in ms, big endian
+         4  256 bytes, bit r % 8 of byte r / 8 is receiver r
+
+    It covers the 2048 tones of 16 MIDI channels, those the engine does
+    not play are ignored. Only the receivers whose bit changed since the
+    last frame, on or off command are switched, at the same frame. When
+    several frames fall into one buffer the last one wins.
+
+    on and off take effect at their time. Pulses and blinks are bursts
+    that wait in a backlog until they fit: ls_cmd_run() goes through it
+    in order before every buffer and starts each burst that is due when
+
+        a voice is free (poly)
+        its note has been quiet for gap ms since its last burst
+        no note closer than spacing notes is sounding
+        the notes sounding with it peak at most max_peak
+
+    A burst that does not fit lets later ones past, except those for the
+    same note, so a receiver gets its bursts in order. Blinks wait gap
+    ms at least between their bursts. At most 64 bursts are tried per
+    buffer and none once the voices are taken, the rest wait for the
+    next buffer. A burst is not part of the on state: frames leave it
+    running, on takes its voice over, off ends it, and a burst on a
+    receiver that is on changes nothing.
+
+    With -P opt the notes sounding are summed with the phase shift of
+    their voice and a new burst unshifted, the shift it gets at its
+    start only lowers the peak. Bursts started in the same buffer are
+    summed unshifted too, for those max_peak is approximate.
+
+    ls_cmd_run() then hands the events due before the end of the buffer
+    to ls_synth with their start and stop times, so they are sample
+    exact. A note gets at most one event per buffer, a second one waits
+    for the next buffer.
+
+    All times are CLOCK_MONOTONIC nanoseconds, as in ls_sync.
+*/
+
+struct ls_cmd_config {
+    int tones;                  /* receivers, notes below half the rate */
+    int poly;                   /* voices of ls_synth */
+    int spacing;                /* notes between bursts at the same time, 1 lets neighbours sound together */
+    double max_peak;            /* of the sum of the notes sounding, as ls_synth_peak() */
+    double gap;                 /* ms, quiet between bursts on one note */
+    double release;             /* ms, of the envelope */
+};
+
+int ls_cmd_open(const char *where, const struct ls_cmd_config *config);
+void ls_cmd_close(void);
+void ls_cmd_receive(long long start_ns);
+void ls_cmd_run(long long t0, long long t1);
+void ls_cmd_print(FILE *f);
+
+#endif
@@ -0,0 +1,369 @@
+/*
+    LinzerSchnitte Clock Sync - shared timeline for several LinzerSchnitte sound servers
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include "ls_sync.h"
+
+/*
+    Sync packet, numbers in network byte order, sent to LS_SYNC_PORT.
+    The first bytes are a multimidicast header with the SYNC flag, which
+    a framing multimidicast skips should it get one all the same.
+
+     0  0xFD, 1, flags 0x02, type
+     4  node id of the sender
+     8  node id of the addressee, 0 for everybody
+    12  sequence number
+    16  t1: follower clock when the delay request was sent
+    24  t2: master clock when the delay request arrived
+    32  t3: master clock when the delay response was sent
+*/
+#define SYNC_PACKETSIZE 40
+#define SYNC_ANNOUNCE 1
+#define SYNC_REQUEST 2
+#define SYNC_RESPONSE 3
+
+#define ANNOUNCE_INTERVAL 1000000000LL	/* ns */
+#define MASTER_TIMEOUT 3500000000LL	/* ns without announce until a master is dropped */
+#define REQUEST_INTERVAL 250000000LL	/* ns */
+#define SAMPLES 32			/* exchanges kept for the offset and drift fit */
+#define LOCK_SAMPLES 4
+
+static int sync_fd = -1;
+static struct sockaddr_in sync_addr;
+static unsigned int node_id, master_id, request_seq;
+static long long master_seen, next_announce, next_request, request_t1;
+static long long skew_offset, skew_start;
+static double skew_drift;
+
+/* offset = master clock - local clock, measured at local time t */
+static long long sample_t[SAMPLES], sample_offset[SAMPLES], sample_rtt[SAMPLES];
+static int nsamples, sample_pos;
+
+/* current estimate: offset(t) = est_offset + est_drift * (t - est_t) */
+static long long est_t, est_offset, est_rtt;
+static double est_drift;
+
+static long long mono_ns() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* local clock, with the test skew of ls_sync_set_skew() applied */
+static long long local_from_mono(long long mono) {
+
+    return mono + skew_offset + (long long)(skew_drift * 1e-6 * (mono - skew_start));
+}
+
+long long ls_sync_local_ns() {
+
+    return local_from_mono(mono_ns());
+}
+
+void ls_sync_set_skew(long long offset_ns, double drift_ppm) {
+
+    skew_start = mono_ns();
+    skew_offset = offset_ns;
+    skew_drift = drift_ppm;
+}
+
+static void put32(unsigned char *b, unsigned long v) {
+
+    b[0] = v >> 24; b[1] = v >> 16; b[2] = v >> 8; b[3] = v;
+}
+
+static unsigned long get32(const unsigned char *b) {
+
+    return ((unsigned long)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static void put64(unsigned char *b, long long v) {
+
+    put32(b, (unsigned long long)v >> 32);
+    put32(b + 4, v & 0xFFFFFFFF);
+}
+
+static long long get64(const unsigned char *b) {
+
+    return (long long)(((unsigned long long)get32(b) << 32) | get32(b + 4));
+}
+
+static void send_packet(int type, unsigned int to, unsigned int seq, long long t1, long long t2) {
+
+    unsigned char pkt[SYNC_PACKETSIZE];
+
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = 0xFD;
+    pkt[1] = 1;
+    pkt[2] = 0x02;
+    pkt[3] = type;
+    put32(pkt + 4, node_id);
+    put32(pkt + 8, to);
+    put32(pkt + 12, seq);
+    put64(pkt + 16, t1);
+    put64(pkt + 24, t2);
+    put64(pkt + 32, ls_sync_local_ns());
+    if (type == SYNC_REQUEST) request_t1 = get64(pkt + 32);
+    if (sendto(sync_fd, pkt, sizeof(pkt), 0, (struct sockaddr *)&sync_addr, sizeof(sync_addr)) < 0)
+        perror("sync sendto");
+}
+
+/* least squares fit of offset over time, using the exchanges with the shortest round trip */
+static void estimate() {
+
+    long long min_rtt, limit;
+    double st = 0, so = 0, stt = 0, sto = 0, n = 0, t, o;
+    int l1;
+
+    min_rtt = sample_rtt[0];
+    for (l1 = 1; l1 < nsamples; l1++)
+        if (sample_rtt[l1] < min_rtt) min_rtt = sample_rtt[l1];
+    limit = min_rtt * 2 + 20000;
+
+    est_t = sample_t[(sample_pos + SAMPLES - 1) % SAMPLES];
+    for (l1 = 0; l1 < nsamples; l1++) {
+        if (sample_rtt[l1] > limit) continue;
+        t = (sample_t[l1] - est_t) * 1e-9;
+        o = sample_offset[l1];
+        st += t; so += o; stt += t * t; sto += t * o; n++;
+    }
+    est_rtt = min_rtt;
+    if (n >= LOCK_SAMPLES && n * stt - st * st > 1e-6) {
+        est_drift = (n * sto - st * so) / (n * stt - st * st) * 1e-9;
+        est_offset = (so - est_drift * 1e9 * st) / n;
+    } else {
+        est_drift = 0;
+        est_offset = so / n;
+    }
+}
+
+static void add_sample(long long t1, long long t2, long long t3, long long t4) {
+
+    sample_t[sample_pos] = t4;
+    sample_offset[sample_pos] = ((t2 - t1) + (t3 - t4)) / 2;
+    sample_rtt[sample_pos] = (t4 - t1) - (t3 - t2);
+    sample_pos = (sample_pos + 1) % SAMPLES;
+    if (nsamples < SAMPLES) nsamples++;
+    estimate();
+}
+
+static void set_master(unsigned int id, long long now) {
+
+    if (id != master_id) {
+        master_id = id;
+        nsamples = 0;
+        sample_pos = 0;
+        est_offset = 0;
+        est_drift = 0;
+        next_request = now;
+        fprintf(stderr, "sync: master is node %08x%s\n", id, (id == node_id) ? " (this node)" : "");
+    }
+    master_seen = now;
+}
+
+int ls_sync_open(const char *interface_name, unsigned int id) {
+
+    struct sockaddr_in addr;
+    struct ip_mreq mreq;
+    struct in_addr if_addr;
+    struct ifreq ifr;
+    int on = 1;
+    long long now;
+
+    if_addr.s_addr = htonl(INADDR_ANY);
+    sync_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sync_fd < 0) {
+        perror("sync socket");
+        return -1;
+    }
+    /* other nodes on this host, lssync over loopback, listen on the same port */
+    setsockopt(sync_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sync_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(LS_SYNC_PORT);
+    if (bind(sync_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("sync bind");
+        ls_sync_close();
+        return -1;
+    }
+
+    if (interface_name) {
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, interface_name, sizeof(ifr.ifr_name) - 1);
+        if (ioctl(sync_fd, SIOCGIFADDR, &ifr) < 0) {
+            perror("sync interface");
+            ls_sync_close();
+            return -1;
+        }
+        if_addr = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+        if (setsockopt(sync_fd, IPPROTO_IP, IP_MULTICAST_IF, &if_addr, sizeof(if_addr)) < 0)
+            perror("sync IP_MULTICAST_IF");
+    }
+    mreq.imr_multiaddr.s_addr = inet_addr(LS_SYNC_GROUP);
+    mreq.imr_interface = if_addr;
+    if (setsockopt(sync_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("sync IP_ADD_MEMBERSHIP");
+        ls_sync_close();
+        return -1;
+    }
+    /* several nodes may run on one host, our own packets are recognised by the node id */
+    setsockopt(sync_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on));
+
+    memset(&sync_addr, 0, sizeof(sync_addr));
+    sync_addr.sin_family = AF_INET;
+    sync_addr.sin_addr.s_addr = inet_addr(LS_SYNC_GROUP);
+    sync_addr.sin_port = htons(LS_SYNC_PORT);
+
+    node_id = id ? id : (unsigned int)(getpid() ^ (mono_ns() << 8)) | 1;
+    now = ls_sync_local_ns();
+    master_id = 0;
+    set_master(node_id, now);
+    next_announce = now;
+    return sync_fd;
+}
+
+void ls_sync_close() {
+
+    if (sync_fd >= 0) close(sync_fd);
+    sync_fd = -1;
+}
+
+int ls_sync_fd() {
+
+    return sync_fd;
+}
+
+/* the node follows a master once enough exchanges were measured */
+int ls_sync_locked() {
+
+    return master_id == node_id || nsamples >= LOCK_SAMPLES;
+}
+
+long long ls_sync_shared_ns(long long local_ns) {
+
+    if (master_id == node_id || nsamples == 0) return local_ns;
+    return local_ns + est_offset + (long long)(est_drift * (local_ns - est_t));
+}
+
+long long ls_sync_local_from_shared(long long shared_ns) {
+
+    if (master_id == node_id || nsamples == 0) return shared_ns;
+    return (long long)((shared_ns - est_offset + est_drift * est_t) / (1.0 + est_drift));
+}
+
+/* reads one sync packet, call when ls_sync_fd() is readable */
+void ls_sync_receive() {
+
+    unsigned char pkt[SYNC_PACKETSIZE + 64];
+    char control[256];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct timespec real, *stamp = NULL;
+    unsigned int from, to;
+    long long now, t4;
+    int r;
+
+    iov.iov_base = pkt;
+    iov.iov_len = sizeof(pkt);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    r = recvmsg(sync_fd, &msg, MSG_DONTWAIT);
+    now = ls_sync_local_ns();
+    if (r < SYNC_PACKETSIZE || pkt[0] != 0xFD || pkt[1] != 1 || !(pkt[2] & 0x02)) return;
+
+    /* the kernel receive time stamp is CLOCK_REALTIME, move it onto our clock */
+    t4 = now;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            stamp = (struct timespec *)CMSG_DATA(cmsg);
+    if (stamp) {
+        clock_gettime(CLOCK_REALTIME, &real);
+        t4 = now - ((long long)(real.tv_sec - stamp->tv_sec) * 1000000000LL + (real.tv_nsec - stamp->tv_nsec));
+        if (t4 > now) t4 = now;
+    }
+
+    from = get32(pkt + 4);
+    to = get32(pkt + 8);
+    if (from == node_id) return;
+
+    switch (pkt[3]) {
+        case SYNC_ANNOUNCE:
+            if (from <= master_id || now - master_seen > MASTER_TIMEOUT) set_master(from, now);
+            break;
+        case SYNC_REQUEST:
+            if (to == node_id && master_id == node_id)
+                send_packet(SYNC_RESPONSE, from, get32(pkt + 12), get64(pkt + 32), t4);
+            break;
+        case SYNC_RESPONSE:
+            if (to == node_id && from == master_id && get32(pkt + 12) == request_seq
+                && get64(pkt + 16) == request_t1)
+                add_sample(request_t1, get64(pkt + 24), get64(pkt + 32), t4);
+            break;
+    }
+}
+
+/* sends due packets, returns the number of ms until it wants to be called again */
+int ls_sync_poll() {
+
+    long long now, next;
+
+    now = ls_sync_local_ns();
+    if (master_id != node_id && now - master_seen > MASTER_TIMEOUT) set_master(node_id, now);
+
+    if (now >= next_announce) {
+        if (master_id == node_id) send_packet(SYNC_ANNOUNCE, 0, 0, 0, 0);
+        next_announce = now + ANNOUNCE_INTERVAL;
+    }
+    if (master_id != node_id && now >= next_request) {
+        send_packet(SYNC_REQUEST, master_id, ++request_seq, 0, 0);
+        next_request = now + REQUEST_INTERVAL;
+    }
+
+    next = next_announce;
+    if (master_id != node_id && next_request < next) next = next_request;
+    return (next - now) / 1000000 + 1;
+}
+
+void ls_sync_print(FILE *f) {
+
+    if (master_id == node_id)
+        fprintf(f, "sync: node %08x is master\n", node_id);
+    else
+        fprintf(f, "sync: node %08x master %08x offset %+.3f ms drift %+.2f ppm round trip %.3f ms%s\n",
+            node_id, master_id, est_offset / 1e6, est_drift * 1e6, est_rtt / 1e6,
+            ls_sync_locked() ? "" : " (not locked)");
+}
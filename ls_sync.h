@@ -0,0 +1,55 @@
+/*
+    LinzerSchnitte Clock Sync - shared timeline for several LinzerSchnitte sound servers
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef LS_SYNC_H
+#define LS_SYNC_H
+
+#include <stdio.h>
+
+/*
+   the multicast group of multimidicast on a port below its 21928 + port
+   range, multimidicast plays whatever arrives on its ports as MIDI
+*/
+#define LS_SYNC_GROUP "225.0.0.37"
+#define LS_SYNC_PORT 21920
+
+/*
+    The master announces itself once a second. A node starts as master
+    and gives way to the first announce of a lower id, or takes over
+    when the master has been silent for 3.5 s, so the node with the
+    lowest id ends up master and its clock is the shared timeline.
+    The other nodes measure their offset to the master with PTP style
+    delay request/response exchanges and fit offset and drift over the
+    exchanges with the shortest round trip.
+
+    All times are CLOCK_MONOTONIC nanoseconds.
+*/
+
+int ls_sync_open(const char *interface_name, unsigned int node_id);
+void ls_sync_close(void);
+int ls_sync_fd(void);
+void ls_sync_receive(void);
+int ls_sync_poll(void);
+int ls_sync_locked(void);
+long long ls_sync_local_ns(void);
+long long ls_sync_shared_ns(long long local_ns);
+long long ls_sync_local_from_shared(long long shared_ns);
+void ls_sync_set_skew(long long offset_ns, double drift_ppm);
+void ls_sync_print(FILE *f);
+
+#endif
@@ -0,0 +1,557 @@
+/*
+    LinzerSchnitte Synth - tone engine of the LinzerSchnitte sound server
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+    Based on miniFMsynth by Matthias Nagorni.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "ls_synth.h"
+
+#define NOTES LS_SYNTH_NOTES
+#define SLOTS LS_SYNTH_SLOTS
+#define ENV_LUT 1024
+
+static unsigned int rate;
+static int poly, gain, freq_start, freq_channel_width, phase_mode, env_shape;
+static double attack, decay, sustain, release;
+
+static double env_time[LS_SYNTH_VOICES], env_level[LS_SYNTH_VOICES];
+static int note[LS_SYNTH_VOICES], gate[LS_SYNTH_VOICES], note_active[LS_SYNTH_VOICES], note_shift[LS_SYNTH_VOICES];
+static long long start_time[LS_SYNTH_VOICES], stop_time[LS_SYNTH_VOICES];
+
+/* one period of every note, then of every pattern, table_len frames, read at sample_clock */
+static int *sample[SLOTS];
+static unsigned char pattern_note[LS_SYNTH_PATTERNS][NOTES];
+static int pattern_notes[LS_SYNTH_PATTERNS];   /* 0 once dropped, its table plays out the releases */
+static int *shift_sum;
+static int table_len, sample_clock;
+static double tone_phase[NOTES];
+static double env_lut[ENV_LUT + 1];
+
+/*
+   While the same voices hold at sustain level the output repeats every
+   table_len frames. The mixed buffers are copied into steady_mix as they
+   are rendered, once it holds a whole table_len they are read from it
+   instead of being mixed again. steady_note and steady_shift are the
+   voices it was mixed from, steady_frames how much of it is filled.
+*/
+static short *steady_mix;
+static int steady_note[LS_SYNTH_VOICES], steady_shift[LS_SYNTH_VOICES];
+static int steady_frames;
+
+/* what every note did during the last render, for ls_verify */
+static unsigned char note_state[NOTES];
+
+static int gcd(int a, int b) {
+
+    int t;
+
+    while (b) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* notes below half the sample rate */
+static int tone_count() {
+
+    int tones;
+
+    for (tones = 0; tones < NOTES && (tones * freq_channel_width) + freq_start < (int) rate / 2; tones++);
+    return tones;
+}
+
+/*
+   The tables hold whole periods of every note and are all read at
+   sample_clock, so the phases set here stay put against each other however
+   notes come and go.
+*/
+static void set_phases() {
+
+    int i, tones;
+
+    tones = tone_count();
+    for (i = 0; i < NOTES; i++) {
+        tone_phase[i] = 0;
+        if (i >= tones) continue;
+        if (phase_mode == LS_PHASE_NEWMAN || phase_mode == LS_PHASE_OPT)
+            tone_phase[i] = M_PI * i * i / tones;
+        else if (phase_mode == LS_PHASE_SCHROEDER)
+            tone_phase[i] = -M_PI * i * (i + 1) / tones;
+    }
+}
+
+/*
+   With -P opt a starting note does not take its table phase as it is but is
+   shifted in time to where it adds the least to the peak of the notes that
+   already sound. The candidates are spread over the table, the search costs
+   table_len * poly per candidate once per note on.
+*/
+#define SHIFT_CANDIDATES 24
+
+static int pick_shift(int slot) {
+
+    int l1, n, k, shift, best_shift, peak, best_peak, c;
+
+    memset(shift_sum, 0, table_len * sizeof(int));
+    for (l1 = 0; l1 < poly; l1++) {
+        if (l1 == slot || !note_active[l1]) continue;
+        for (n = 0; n < table_len; n++) shift_sum[n] += sample[note[l1]][(n + note_shift[l1]) % table_len];
+    }
+    best_shift = 0;
+    best_peak = -1;
+    for (k = 0; k < SHIFT_CANDIDATES; k++) {
+        shift = k * table_len / SHIFT_CANDIDATES;
+        peak = 0;
+        for (n = 0; n < table_len; n++) {
+            c = abs(shift_sum[n] + sample[note[slot]][(n + shift) % table_len]);
+            if (c > peak) peak = c;
+        }
+        if (best_peak < 0 || peak < best_peak) {
+            best_peak = peak;
+            best_shift = shift;
+        }
+    }
+    return best_shift;
+}
+
+/* the steady state of the notes of pattern p summed into a table of its own */
+static int mix_pattern(int p) {
+
+    int *mix, i, n;
+
+    mix = (int *) realloc (sample[NOTES + p], table_len * sizeof(int));
+    if (!mix) return -1;
+    sample[NOTES + p] = mix;
+    memset(mix, 0, table_len * sizeof(int));
+    for (i = 0; i < NOTES; i++)
+        if (pattern_note[p][i]) for (n = 0; n < table_len; n++) mix[n] += sample[i][n];
+    return 0;
+}
+
+/* the tables changed, steady_mix has to be mixed anew */
+static void steady_reset() {
+
+    int l1;
+
+    for (l1 = 0; l1 < LS_SYNTH_VOICES; l1++) steady_note[l1] = -2;
+    steady_frames = 0;
+}
+
+static int generate_samples() {
+
+    double delta_phase;
+    int i, n;
+
+    /* the shortest length that holds a whole number of periods of every note */
+    table_len = rate / gcd(rate, gcd(freq_start, freq_channel_width));
+    shift_sum = (int *) realloc (shift_sum, table_len * sizeof(int));
+    if (!shift_sum) return -1;
+    steady_mix = (short *) realloc (steady_mix, table_len * sizeof(short));
+    if (!steady_mix) return -1;
+    steady_reset();
+    set_phases();
+    for (i = 0; i < NOTES; i++) {
+        sample[i] = (int *) realloc (sample[i], table_len * sizeof(int));
+        if (!sample[i]) return -1;
+        delta_phase = (M_PI * ((i * freq_channel_width) + freq_start) * 2) / rate;
+        for (n = 0; n < table_len; n++) sample[i][n] = sin(tone_phase[i] + n * delta_phase) * gain;
+    }
+    for (i = 0; i < LS_SYNTH_PATTERNS; i++)
+        if (sample[NOTES + i] && mix_pattern(i) < 0) return -1;
+    return 0;
+}
+
+/* rise from 0 to 1 over x = 0..1 that every envelope segment follows */
+static void make_env_lut() {
+
+    double x;
+    int i;
+
+    for (i = 0; i <= ENV_LUT; i++) {
+        x = (double) i / ENV_LUT;
+        switch (env_shape) {
+            case LS_ENV_COSINE:
+                env_lut[i] = 0.5 - 0.5 * cos(M_PI * x);
+                break;
+            case LS_ENV_BLACKMAN:
+                env_lut[i] = 0.42 - 0.5 * cos(M_PI * x) + 0.08 * cos(2 * M_PI * x);
+                break;
+            case LS_ENV_CURVE:
+                /* Env.asr(..., curve: -4) of SuperCollider/Sythdef */
+                env_lut[i] = (1 - exp(-4 * x)) / (1 - exp(-4));
+                break;
+            default:
+                env_lut[i] = x;
+        }
+    }
+}
+
+static double env_rise(double x) {
+
+    double f;
+    int i;
+
+    if (x >= 1) return 1;
+    f = x * ENV_LUT;
+    i = f;
+    return env_lut[i] + (env_lut[i + 1] - env_lut[i]) * (f - i);
+}
+
+static double envelope(int *note_active, int gate, double *env_level, double t) {
+
+    if (gate)  {
+        if (t > attack + decay) return(*env_level = sustain);
+        if (t > attack) return(*env_level = 1.0 - (1.0 - sustain) * env_rise((t - attack) / decay));
+        return(*env_level = env_rise(t / attack));
+    } else {
+        if (t > release) {
+            if (note_active) *note_active = 0;
+            return(*env_level = 0);
+        }
+        return(*env_level * (1.0 - env_rise(t / release)));
+    }
+}
+
+/* envelope of slot l2 for up to count frames into env, stops early when the note has ended */
+static int envelope_block(int l2, double *env, int count) {
+
+    int i;
+
+    if (gate[l2] && env_time[l2] > attack + decay) {
+        for (i = 0; i < count; i++) env[i] = sustain;
+        env_level[l2] = sustain;
+        env_time[l2] += (double) count / rate;
+        return count;
+    }
+    for (i = 0; i < count && note_active[l2]; i++) {
+        env[i] = envelope(&note_active[l2], gate[l2], &env_level[l2], env_time[l2]);
+        env_time[l2] += 1.0 / rate;
+    }
+    return i;
+}
+
+int ls_synth_init(const struct ls_synth_config *config) {
+
+    int l1;
+
+    if (config->poly < 1 || config->poly > LS_SYNTH_VOICES || config->rate == 0
+        || config->freq_start <= 0 || config->freq_channel_width <= 0) {
+        fprintf(stderr, "Error: bad synth settings\n");
+        return -1;
+    }
+    rate = config->rate;
+    poly = config->poly;
+    gain = config->gain;
+    freq_start = config->freq_start;
+    freq_channel_width = config->freq_channel_width;
+    attack = config->attack;
+    decay = config->decay;
+    sustain = config->sustain;
+    release = config->release;
+    phase_mode = config->phase_mode;
+    env_shape = config->env_shape;
+
+    for (l1 = 0; l1 < LS_SYNTH_VOICES; l1++) note_active[l1] = 0;
+    sample_clock = 0;
+    make_env_lut();
+    if (generate_samples() < 0) {
+        fprintf(stderr, "Error: no memory for the tone tables\n");
+        return -1;
+    }
+    return 0;
+}
+
+int ls_synth_phase_mode(const char *name) {
+
+    if (!strcmp(name, "zero")) return LS_PHASE_ZERO;
+    if (!strcmp(name, "newman")) return LS_PHASE_NEWMAN;
+    if (!strcmp(name, "schroeder")) return LS_PHASE_SCHROEDER;
+    if (!strcmp(name, "opt")) return LS_PHASE_OPT;
+    return -1;
+}
+
+int ls_synth_env_shape(const char *name) {
+
+    if (!strcmp(name, "linear")) return LS_ENV_LINEAR;
+    if (!strcmp(name, "cosine")) return LS_ENV_COSINE;
+    if (!strcmp(name, "blackman")) return LS_ENV_BLACKMAN;
+    if (!strcmp(name, "curve")) return LS_ENV_CURVE;
+    return -1;
+}
+
+/* peak / rms of the sum of all notes at unit level with the phases in tone_phase */
+double ls_synth_crest_factor(double *peak_out) {
+
+    double peak, x;
+    int i, n, tones;
+
+    peak = 0;
+    tones = tone_count();
+    for (n = 0; n < table_len; n++) {
+        x = 0;
+        for (i = 0; i < tones; i++)
+            x += sin(2 * M_PI * ((i * freq_channel_width) + freq_start) * n / rate + tone_phase[i]);
+        if (fabs(x) > peak) peak = fabs(x);
+    }
+    if (peak_out) *peak_out = peak;
+    return tones ? peak / sqrt(tones / 2.0) : 0;
+}
+
+/*
+   adds the table of a note or pattern to sum, table_len ints, for
+   ls_synth_peak(). A note that sounds is added with the shift of its
+   voice, as it is heard with -P opt, one that does not unshifted.
+*/
+void ls_synth_sum(int *sum, int slot) {
+
+    int l1, n, shift;
+
+    if (slot < 0 || slot >= SLOTS || !sample[slot]) return;
+    shift = 0;
+    for (l1 = 0; l1 < poly; l1++) if (note_active[l1] && note[l1] == slot) shift = note_shift[l1];
+    for (n = 0; n < table_len; n++) sum[n] += sample[slot][(n + shift) % table_len];
+}
+
+/* peak of the notes in sum with slot added, -1 for none, sounding together at sustain, in output units */
+double ls_synth_peak(const int *sum, int slot) {
+
+    int n, x, peak;
+
+    if (slot < 0 || slot >= SLOTS || !sample[slot]) {
+        for (n = peak = 0; n < table_len; n++) if (abs(sum[n]) > peak) peak = abs(sum[n]);
+        return peak * sustain;
+    }
+    for (n = peak = 0; n < table_len; n++) {
+        x = sum[n] + sample[slot][n];
+        if (abs(x) > peak) peak = abs(x);
+    }
+    return peak * sustain;
+}
+
+void ls_synth_note_state(unsigned char *state) {
+
+    memcpy(state, note_state, NOTES);
+}
+
+/* frames after which every note has gone through a whole number of periods */
+int ls_synth_table_len() {
+
+    return table_len;
+}
+
+/*
+   premixes pattern p from the notes marked in notes, or drops it when
+   there are none. The voices of a dropped pattern are released and read
+   its table until they have faded, the next definition mixes into it.
+*/
+int ls_synth_pattern(int p, const unsigned char *notes) {
+
+    int i, n;
+
+    if (p < 0 || p >= LS_SYNTH_PATTERNS) return -1;
+    steady_reset();
+    for (i = n = 0; i < NOTES; i++) n += notes[i] != 0;
+    if (n == 0) {
+        pattern_notes[p] = 0;
+        ls_synth_note_off(NOTES + p, 0);
+        return 0;
+    }
+    for (i = 0; i < NOTES; i++) pattern_note[p][i] = notes[i] != 0;
+    pattern_notes[p] = n;
+    return mix_pattern(p);
+}
+
+int ls_synth_frequency(int note) {
+
+    return (note * freq_channel_width) + freq_start;
+}
+
+/* the first free voice plays note, -1 when all poly voices are busy */
+int ls_synth_note_on(int note_number, long long start_ns) {
+
+    int l1;
+
+    if (note_number < 0 || note_number >= SLOTS || !sample[note_number]
+        || (note_number >= NOTES && !pattern_notes[note_number - NOTES])) return -1;
+    for (l1 = 0; l1 < poly; l1++) {
+        if (!note_active[l1]) {
+            note[l1] = note_number;
+            env_time[l1] = 0;
+            gate[l1] = 1;
+            note_shift[l1] = phase_mode == LS_PHASE_OPT ? pick_shift(l1) : 0;
+            note_active[l1] = 1;
+            start_time[l1] = start_ns;
+            stop_time[l1] = 0;
+            return l1;
+        }
+    }
+    return -1;
+}
+
+/* releases every voice that holds note, returns how many */
+int ls_synth_note_off(int note_number, long long stop_ns) {
+
+    int l1, n;
+
+    n = 0;
+    for (l1 = 0; l1 < poly; l1++) {
+        if (gate[l1] && note_active[l1] && (note[l1] == note_number)) {
+            if (stop_ns) {
+                stop_time[l1] = stop_ns;
+            } else {
+                env_time[l1] = 0;
+                gate[l1] = 0;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+/* voices sounding, releases included */
+int ls_synth_active() {
+
+    int l1, n;
+
+    n = 0;
+    for (l1 = 0; l1 < poly; l1++) n += note_active[l1];
+    return n;
+}
+
+/* a pattern marks all its notes */
+static void mark_state(int b, int steady) {
+
+    int i;
+
+    if (b >= NOTES) {
+        for (i = 0; i < NOTES; i++) if (pattern_note[b - NOTES][i]) mark_state(i, steady);
+        return;
+    }
+    if (!steady || note_state[b] == LS_NOTE_CHANGING) note_state[b] = LS_NOTE_CHANGING;
+    else note_state[b] = LS_NOTE_ON;
+}
+
+/* voice l2 is at sustain level from the first frame to the last */
+static int voice_steady(int l2, int nframes, long long t0) {
+
+    return !start_time[l2] && gate[l2] && env_time[l2] > attack + decay
+        && (!stop_time[l2] || (stop_time[l2] - t0) * rate / 1000000000LL >= nframes);
+}
+
+/*
+   1 when every sounding voice is steady over the buffer, the voices are
+   then recorded as those of steady_mix unless they already are, and the
+   buffer can come from steady_mix or be added to it.
+*/
+static int steady_set(int nframes, long long t0) {
+
+    int l2, voices, same;
+
+    voices = 0;
+    same = 1;
+    for (l2 = 0; l2 < poly; l2++) {
+        if (!note_active[l2]) {
+            if (steady_note[l2] != -1) same = 0;
+            continue;
+        }
+        if (!voice_steady(l2, nframes, t0)) {
+            /* a part filled steady_mix has to be filled without gaps */
+            if (steady_frames < table_len) steady_frames = 0;
+            return 0;
+        }
+        if (steady_note[l2] != note[l2] || steady_shift[l2] != note_shift[l2]) same = 0;
+        voices++;
+    }
+    if (!voices) return 0;
+    if (!same) {
+        for (l2 = 0; l2 < LS_SYNTH_VOICES; l2++) {
+            steady_note[l2] = l2 < poly && note_active[l2] ? note[l2] : -1;
+            steady_shift[l2] = l2 < poly && note_active[l2] ? note_shift[l2] : 0;
+        }
+        steady_frames = 0;
+    }
+    return 1;
+}
+
+void ls_synth_render(short *buf, int nframes, long long t0) {
+
+    int l1, l2, b ,c, first, last, stop, count, steady, steady_all;
+    double sound;
+    double env[nframes];
+
+    memset(note_state, LS_NOTE_OFF, sizeof(note_state));
+    steady_all = steady_set(nframes, t0);
+    if (steady_all && steady_frames >= table_len) {
+        for (l1 = 0; l1 < nframes; l1++)
+            buf[2 * l1] = buf[2 * l1 + 1] = steady_mix[(sample_clock + l1) % table_len];
+        for (l2 = 0; l2 < poly; l2++) {
+            if (!note_active[l2]) continue;
+            mark_state(note[l2], 1);
+            env_time[l2] += (double) nframes / rate;
+        }
+        sample_clock = (sample_clock + nframes) % table_len;
+        return;
+    }
+    memset(buf, 0, nframes * 4);
+    for (l2 = 0; l2 < poly; l2++) {
+        if (note_active[l2]) {
+            b = note[l2];
+            first = 0;
+            if (start_time[l2]) {
+                first = (start_time[l2] - t0) * rate / 1000000000LL;
+                if (first >= nframes) continue;
+                if (first < 0) first = 0;
+                start_time[l2] = 0;
+            }
+            steady = first == 0 && voice_steady(l2, nframes, t0);
+            mark_state(b, steady);
+            /* a synced note off splits the buffer in two blocks */
+            while (first < nframes) {
+                last = nframes;
+                if (stop_time[l2]) {
+                    stop = ((stop_time[l2] - t0) * rate + 999999999LL) / 1000000000LL;
+                    if (stop <= first) {
+                        env_time[l2] = 0;
+                        gate[l2] = 0;
+                        stop_time[l2] = 0;
+                    } else if (stop < nframes) {
+                        last = stop;
+                    }
+                }
+                count = envelope_block(l2, env, last - first);
+                for (l1 = 0; l1 < count; l1++) {
+                    c = (sample_clock + first + l1 + note_shift[l2]) % table_len;
+                    sound = sample[b][c] * env[l1];
+                    buf[2 * (first + l1)] += sound;
+                    buf[2 * (first + l1) + 1] += sound;
+                }
+                if (count < last - first) break;
+                first = last;
+            }
+        }
+    }
+    if (steady_all) {
+        for (l1 = 0; l1 < nframes && steady_frames < table_len; l1++, steady_frames++)
+            steady_mix[(sample_clock + l1) % table_len] = buf[2 * l1];
+    }
+    sample_clock = (sample_clock + nframes) % table_len;
+}
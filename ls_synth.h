@@ -0,0 +1,89 @@
+/*
+    LinzerSchnitte Synth - tone engine of the LinzerSchnitte sound server
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef LS_SYNTH_H
+#define LS_SYNTH_H
+
+#define LS_SYNTH_NOTES 128
+#define LS_SYNTH_VOICES 512
+#define LS_SYNTH_PATTERNS 32
+#define LS_SYNTH_SLOTS (LS_SYNTH_NOTES + LS_SYNTH_PATTERNS)    /* notes, then patterns */
+
+/* starting phase of every note table, -P */
+#define LS_PHASE_ZERO 0
+#define LS_PHASE_NEWMAN 1
+#define LS_PHASE_SCHROEDER 2
+#define LS_PHASE_OPT 3
+
+/* shape of attack, decay and release, -E */
+#define LS_ENV_LINEAR 0
+#define LS_ENV_COSINE 1
+#define LS_ENV_BLACKMAN 2
+#define LS_ENV_CURVE 3
+
+/* state of a note over the last render */
+#define LS_NOTE_OFF 0           /* silent throughout */
+#define LS_NOTE_ON 1            /* at sustain level throughout */
+#define LS_NOTE_CHANGING 2      /* starting, stopping or ramping */
+
+struct ls_synth_config {
+    unsigned int rate;
+    int poly;                   /* voices, at most LS_SYNTH_VOICES */
+    int gain;                   /* peak of one tone */
+    int freq_start;             /* Hz of note 0 */
+    int freq_channel_width;     /* Hz between notes */
+    double attack, decay, sustain, release;     /* s, sustain 0-1 */
+    int phase_mode;
+    int env_shape;
+};
+
+/*
+    Note n sounds at freq_start + n * freq_channel_width, from a table of
+    one period of all notes at once. Voices start and stop at a local
+    CLOCK_MONOTONIC time in ns, 0 is the next rendered frame.
+
+    A pattern is a fixed set of notes premixed into one table, voice
+    LS_SYNTH_NOTES + p plays pattern p with a single envelope at the cost
+    of a single note. Defining a pattern that sounds changes it at once.
+
+    ls_synth_render() mixes nframes interleaved stereo frames whose first
+    frame leaves the DAC at local time t0, it does not need a sound card
+    and runs as fast as the CPU allows when called in a loop.
+
+    While no voice starts, stops or ramps the output repeats every
+    ls_synth_table_len() frames. ls_synth_render() keeps what it mixed
+    over that length and copies later buffers from it until the voices
+    change, an idle show costs about a memcpy whatever the poly.
+*/
+
+int ls_synth_init(const struct ls_synth_config *config);
+int ls_synth_phase_mode(const char *name);
+int ls_synth_env_shape(const char *name);
+double ls_synth_crest_factor(double *peak);
+void ls_synth_sum(int *sum, int slot);
+double ls_synth_peak(const int *sum, int slot);
+int ls_synth_pattern(int p, const unsigned char *notes);
+int ls_synth_frequency(int note);
+int ls_synth_table_len(void);
+int ls_synth_note_on(int note, long long start_ns);
+int ls_synth_note_off(int note, long long stop_ns);
+int ls_synth_active(void);
+void ls_synth_render(short *buf, int nframes, long long t0);
+void ls_synth_note_state(unsigned char *state);
+
+#endif
@@ -0,0 +1,275 @@
+/*
+    LinzerSchnitte Verify - checks the tones LSMidi plays against its voices
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "ls_synth.h"
+#include "ls_verify.h"
+
+#define RING 64                 /* buffers between the audio thread and the verifier */
+#define MAX_FRAMES 4096         /* longer buffers are only verified up to here */
+#define FAULT_LINES 5           /* per second, the counters take the rest */
+
+struct chunk {
+    int nframes;
+    int gap;                    /* frames were lost before this buffer */
+    short mono[MAX_FRAMES];
+    unsigned char state[LS_SYNTH_NOTES];
+};
+
+static struct chunk *ring;
+static unsigned int ring_head, ring_tail;      /* written by push / by the thread only */
+static int lost;                                /* of push, the next buffer follows a gap */
+static sem_t ring_sem;
+static pthread_t thread;
+static int running;
+
+static unsigned int rate;
+static int block_len, notes;
+static double amplitude, min_snr;
+static const int *freq;
+
+/*
+   Goertzel state per note in arrays of their own, so that the update of
+   all notes for one sample is a plain loop over floats that the compiler
+   turns into SIMD instructions.
+*/
+static float *coef, *s1, *s2, *window;
+static unsigned char block_state[LS_SYNTH_NOTES];
+static int block_pos;
+
+/* written by one thread each and read by ls_verify_print() from another */
+static long blocks, missing, extra, low_snr, dropped;
+static long long frames_verified, cpu_ns;
+static int fault_lines;
+static long fault_second;
+
+static long long thread_cpu_ns() {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void count(long *counter) {
+
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static void fault(const char *what, int note, double snr) {
+
+    long second;
+
+    second = frames_verified / rate;
+    if (second != fault_second) {
+        fault_second = second;
+        fault_lines = 0;
+    }
+    if (fault_lines++ >= FAULT_LINES) return;
+    if (snr > -1000)
+        fprintf(stderr, "verify: %7.2f s note %3d %d Hz %s, snr %.1f dB\n",
+            (double) frames_verified / rate, note, freq[note], what, snr);
+    else
+        fprintf(stderr, "verify: %7.2f s note %3d %d Hz %s\n",
+            (double) frames_verified / rate, note, freq[note], what);
+}
+
+static void judge_block() {
+
+    double a[LS_SYNTH_NOTES], noise, snr;
+    int k, silent, heard;
+
+    /* amplitude of every note, a full scale sine of the note frequency gives 1 */
+    noise = 0;
+    silent = 0;
+    for (k = 0; k < notes; k++) {
+        a[k] = 4 * sqrt(fabs(s1[k] * s1[k] + s2[k] * s2[k] - coef[k] * s1[k] * s2[k])) / block_len;
+        if (block_state[k] == LS_NOTE_OFF) {
+            noise += a[k] * a[k];
+            silent++;
+        }
+    }
+    noise = silent ? sqrt(noise / silent) : 0;
+
+    for (k = 0; k < notes; k++) {
+        heard = a[k] > amplitude / 2;
+        if (block_state[k] == LS_NOTE_ON) {
+            if (!heard) {
+                count(&missing);
+                fault("missing", k, -1000);
+            } else if (noise > 0 && (snr = 20 * log10(a[k] / noise)) < min_snr) {
+                count(&low_snr);
+                fault("low snr", k, snr);
+            }
+        } else if (block_state[k] == LS_NOTE_OFF && heard) {
+            count(&extra);
+            fault("extra", k, -1000);
+        }
+    }
+    count(&blocks);
+}
+
+static void verify_chunk(struct chunk *c) {
+
+    float * restrict a1 = s1, * restrict a2 = s2;
+    const float * restrict c2 = coef;
+    float x, s0;
+    int i, k, pos;
+
+    /* a block over a gap would sum samples that do not follow each other, it is dropped */
+    if (c->gap) block_pos = 0;
+    pos = block_pos;
+    for (i = 0; i < c->nframes; i++, pos++) {
+        if (pos == block_len) {
+            judge_block();
+            pos = 0;
+        }
+        if (pos == 0) {
+            memcpy(block_state, c->state, notes);
+            memset(s1, 0, notes * sizeof(float));
+            memset(s2, 0, notes * sizeof(float));
+        } else if (i == 0) {
+            /* a note has to be in the same state in every buffer of the block */
+            for (k = 0; k < notes; k++)
+                if (block_state[k] != c->state[k]) block_state[k] = LS_NOTE_CHANGING;
+        }
+        x = c->mono[i] * window[pos];
+        for (k = 0; k < notes; k++) {
+            s0 = x + c2[k] * a1[k] - a2[k];
+            a2[k] = a1[k];
+            a1[k] = s0;
+        }
+    }
+    __atomic_store_n(&frames_verified, frames_verified + c->nframes, __ATOMIC_RELAXED);
+    if (pos == block_len) {
+        judge_block();
+        pos = 0;
+    }
+    block_pos = pos;
+}
+
+static void *verify_thread(void *arg) {
+
+    unsigned int head;
+    long long t;
+
+    while (1) {
+        sem_wait(&ring_sem);
+        if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) break;
+        head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        t = thread_cpu_ns();
+        while (ring_tail != head) {
+            verify_chunk(&ring[ring_tail % RING]);
+            __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&cpu_ns, cpu_ns + thread_cpu_ns() - t, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int ls_verify_open(unsigned int sample_rate, int block, const int *frequency, int note_count, double amp, double snr) {
+
+    int k;
+
+    rate = sample_rate;
+    block_len = block;
+    freq = frequency;
+    notes = note_count > LS_SYNTH_NOTES ? LS_SYNTH_NOTES : note_count;
+    amplitude = amp;
+    min_snr = snr;
+    ring = malloc(RING * sizeof(struct chunk));
+    coef = malloc(notes * sizeof(float));
+    window = malloc(block_len * sizeof(float));
+    s1 = calloc(notes, sizeof(float));
+    s2 = calloc(notes, sizeof(float));
+    if (!ring || !coef || !window || !s1 || !s2 || block_len < 1) {
+        fprintf(stderr, "Error: cannot set up the tone verifier\n");
+        return -1;
+    }
+    for (k = 0; k < notes; k++) coef[k] = 2 * cos(2 * M_PI * freq[k] / rate);
+    /* Hann, scaled to full scale, has its zeros on the neighbours when they are two bins away */
+    for (k = 0; k < block_len; k++) window[k] = (0.5 - 0.5 * cos(2 * M_PI * k / block_len)) / 32768;
+    ring_head = ring_tail = 0;
+    lost = block_pos = 0;
+    sem_init(&ring_sem, 0, 0);
+    running = 1;
+    if (pthread_create(&thread, NULL, verify_thread, NULL) != 0) {
+        fprintf(stderr, "Error: cannot start the tone verifier\n");
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void ls_verify_close() {
+
+    if (!running) return;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    sem_post(&ring_sem);
+    pthread_join(thread, NULL);
+    sem_destroy(&ring_sem);
+    free(ring);
+    free(coef);
+    free(window);
+    free(s1);
+    free(s2);
+}
+
+void ls_verify_push(const short *buf, int nframes, const unsigned char *state) {
+
+    struct chunk *c;
+    int i;
+
+    if (!running) return;
+    if (ring_head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= RING) {
+        count(&dropped);
+        lost = 1;
+        return;
+    }
+    c = &ring[ring_head % RING];
+    c->gap = lost;
+    lost = 0;
+    if (nframes > MAX_FRAMES) {
+        /* the frames cut off are a gap before the next buffer */
+        nframes = MAX_FRAMES;
+        lost = 1;
+    }
+    c->nframes = nframes;
+    for (i = 0; i < nframes; i++) c->mono[i] = buf[2 * i];
+    memcpy(c->state, state, LS_SYNTH_NOTES);
+    __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+    sem_post(&ring_sem);
+}
+
+void ls_verify_print(FILE *f) {
+
+    double seconds, cpu;
+
+    seconds = (double) __atomic_load_n(&frames_verified, __ATOMIC_RELAXED) / rate;
+    cpu = __atomic_load_n(&cpu_ns, __ATOMIC_RELAXED);
+    fprintf(f, "verify: %.1f s in %ld blocks, %ld missing, %ld extra, %ld low snr, %ld buffers dropped, %.2f %% of a core\n",
+        seconds, __atomic_load_n(&blocks, __ATOMIC_RELAXED), __atomic_load_n(&missing, __ATOMIC_RELAXED),
+        __atomic_load_n(&extra, __ATOMIC_RELAXED), __atomic_load_n(&low_snr, __ATOMIC_RELAXED),
+        __atomic_load_n(&dropped, __ATOMIC_RELAXED), seconds > 0 ? cpu / (seconds * 1e7) : 0);
+}
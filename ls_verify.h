@@ -0,0 +1,49 @@
+/*
+    LinzerSchnitte Verify - checks the tones LSMidi plays against its voices
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#ifndef LS_VERIFY_H
+#define LS_VERIFY_H
+
+#include <stdio.h>
+
+/*
+    Every rendered buffer is handed to ls_verify_push() together with the
+    note states of ls_synth_note_state(). A thread of its own runs a
+    Hann windowed Goertzel filter on every note frequency over blocks of
+    block_len frames and compares what it hears with what the engine
+    played:
+
+        missing   a note held at sustain the whole block is not heard
+        extra     a note that was silent the whole block is heard
+        low snr   a held note is less than min_snr dB over the silent notes
+
+    block_len should be twice ls_synth_table_len(), the notes are then
+    exactly two bins apart where the window has its zeros. Blocks in
+    which a note starts, stops or ramps are not judged for that note.
+    When the thread falls behind buffers are dropped and counted, the
+    audio thread never waits for it. The block in progress at a dropped
+    buffer, or at one cut to 4096 frames, is not judged and the next
+    block starts after the gap.
+*/
+
+int ls_verify_open(unsigned int rate, int block_len, const int *freq, int notes, double amplitude, double min_snr);
+void ls_verify_close(void);
+void ls_verify_push(const short *buf, int nframes, const unsigned char *state);
+void ls_verify_print(FILE *f);
+
+#endif
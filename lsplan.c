@@ -0,0 +1,389 @@
+/*
+    lsplan - measures how tightly a LinzerSchnitte frequency plan can pack channels
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+    Renders a random keying pattern on the first channels with the tone
+    engine of LSMidi, without a sound card, for every combination of the
+    rates, envelopes, ramp times and frequency steps given, and measures
+    with a Hann windowed FFT
+
+	bw99	bandwidth that holds 99 % of the power of one channel
+	aclr	power a channel leaks into the band of its neighbour,
+		relative to its own band, worst over all channels
+	snr	power of a channel in its band against the power all
+		other channels leak into it, lowest and median
+
+    A band is the step wide, centred on the tone. The densest step whose
+    lowest snr still meets the target (-T) is reported for every plan, eg.
+
+	$ ./lsplan -E linear,cosine -a 2,10 -w 100,50,25
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "ls_synth.h"
+
+#define MAX_LIST 16
+#define MAX_CHANNELS 64
+#define RENDER_FRAMES 256
+
+struct plan {
+    unsigned int rate;
+    int env_shape;
+    double ramp;                /* ms */
+    int step;                   /* Hz */
+    int fft_size;
+    double bw99, aclr, snr_min, snr_median;
+};
+
+static int channels = 12, poly = 4, burst_ms = 100, seconds = 5, gain = 1000, freq_start = 300;
+static int phase_mode = LS_PHASE_ZERO;
+static double target = 30;
+
+static const char *env_names[] = { "linear", "cosine", "blackman", "curve" };
+
+static int parse_list(char *arg, double *list) {
+
+    int n;
+    char *tok;
+
+    n = 0;
+    for (tok = strtok(arg, ","); tok && n < MAX_LIST; tok = strtok(NULL, ",")) list[n++] = atof(tok);
+    return n;
+}
+
+static int cmp_double(const void *a, const void *b) {
+
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* in place radix 2, n a power of 2 */
+static void fft(double *re, double *im, int n) {
+
+    int i, j, k, len;
+    double t, wr, wi, cr, ci, ur, ui, vr, vi;
+
+    for (i = 1, j = 0; i < n; i++) {
+        for (k = n >> 1; j & k; k >>= 1) j ^= k;
+        j |= k;
+        if (i < j) {
+            t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1) {
+        wr = cos(-2 * M_PI / len);
+        wi = sin(-2 * M_PI / len);
+        for (i = 0; i < n; i += len) {
+            cr = 1;
+            ci = 0;
+            for (j = 0; j < len / 2; j++) {
+                ur = re[i + j];
+                ui = im[i + j];
+                vr = re[i + j + len / 2] * cr - im[i + j + len / 2] * ci;
+                vi = re[i + j + len / 2] * ci + im[i + j + len / 2] * cr;
+                re[i + j] = ur + vr;
+                im[i + j] = ui + vi;
+                re[i + j + len / 2] = ur - vr;
+                im[i + j + len / 2] = ui - vi;
+                t = cr * wr - ci * wi;
+                ci = cr * wi + ci * wr;
+                cr = t;
+            }
+        }
+    }
+}
+
+/*
+   Every channel is rendered on its own with the same keying, the engine
+   mixes linearly so the sum of the solos is what LSMidi would play and
+   the interference in a band is the sum minus the channel of that band.
+*/
+static int render_solos(struct plan *p, int frames, short **solo) {
+
+    struct ls_synth_config config;
+    short buf[RENDER_FRAMES * 2];
+    unsigned char keyed[MAX_CHANNELS];
+    int slot_frames, ch, i, k, n, f, count;
+
+    config.rate = p->rate;
+    config.poly = 2 * poly;     /* room for the releases of the last burst */
+    config.gain = gain;
+    config.freq_start = freq_start;
+    config.freq_channel_width = p->step;
+    config.attack = config.decay = config.release = p->ramp / 1000;
+    config.sustain = 1;
+    config.phase_mode = phase_mode;
+    config.env_shape = p->env_shape;
+
+    slot_frames = (long long) burst_ms * p->rate / 1000;
+    for (ch = 0; ch < channels; ch++) {
+        if (ls_synth_init(&config) < 0) return -1;
+        srand(1);
+        memset(keyed, 0, sizeof(keyed));
+        for (f = 0; f < frames; f += count) {
+            if (f % slot_frames == 0) {
+                /* poly random channels for the next burst */
+                memset(keyed, 0, sizeof(keyed));
+                for (i = 0; i < poly && i < channels; i++) {
+                    do k = rand() % channels; while (keyed[k]);
+                    keyed[k] = 1;
+                }
+                ls_synth_note_off(ch, 0);
+                if (keyed[ch]) ls_synth_note_on(ch, 0);
+            }
+            count = slot_frames - f % slot_frames;
+            if (count > RENDER_FRAMES) count = RENDER_FRAMES;
+            if (count > frames - f) count = frames - f;
+            ls_synth_render(buf, count, 0);
+            for (n = 0; n < count; n++) solo[ch][f + n] = buf[2 * n];
+        }
+    }
+    return 0;
+}
+
+static double band_power(double *re, double *im, int lo, int hi) {
+
+    double p;
+    int i;
+
+    p = 0;
+    for (i = lo; i < hi; i++) p += re[i] * re[i] + im[i] * im[i];
+    return p;
+}
+
+static int measure(struct plan *p) {
+
+    short *solo[MAX_CHANNELS] = { NULL };
+    double *re[MAX_CHANNELS] = { NULL }, *im[MAX_CHANNELS] = { NULL }, *sum_re, *sum_im, *window, *spectrum;
+    double own[MAX_CHANNELS], leak[MAX_CHANNELS], interference[MAX_CHANNELS], snr[MAX_CHANNELS];
+    double bin_hz, total, acc, x;
+    int band_lo[MAX_CHANNELS], band_hi[MAX_CHANNELS];
+    int frames, ch, i, pos, lo, hi, centre, width, ret, heard, half;
+
+    frames = seconds * p->rate;
+    for (p->fft_size = 1024; p->fft_size < 16.0 * p->rate / p->step; p->fft_size <<= 1);
+    bin_hz = (double) p->rate / p->fft_size;
+    ret = -1;
+    window = malloc(p->fft_size * sizeof(double));
+    spectrum = calloc(p->fft_size / 2, sizeof(double));
+    sum_re = malloc(p->fft_size * sizeof(double));
+    sum_im = malloc(p->fft_size * sizeof(double));
+    for (ch = 0; ch < channels; ch++) {
+        solo[ch] = malloc(frames * sizeof(short));
+        re[ch] = malloc(p->fft_size * sizeof(double));
+        im[ch] = malloc(p->fft_size * sizeof(double));
+        if (!solo[ch] || !re[ch] || !im[ch]) goto out;
+        own[ch] = leak[ch] = interference[ch] = 0;
+    }
+    if (!window || !spectrum || !sum_re || !sum_im) goto out;
+    if (render_solos(p, frames, solo) < 0) goto out;
+
+    for (i = 0; i < p->fft_size; i++) window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / p->fft_size);
+    /* the band of every channel, clamped to the spectrum, none for channels at or above Nyquist */
+    half = p->fft_size / 2;
+    width = p->step / bin_hz;
+    for (ch = 0; ch < channels; ch++) {
+        centre = (freq_start + ch * p->step) / bin_hz;
+        band_lo[ch] = centre - width / 2 < 0 ? 0 : centre - width / 2;
+        band_hi[ch] = centre - width / 2 + width;
+        if (band_hi[ch] >= half) band_lo[ch] = band_hi[ch] = 0;
+    }
+    for (pos = 0; pos + p->fft_size <= frames; pos += p->fft_size / 2) {
+        memset(sum_re, 0, p->fft_size * sizeof(double));
+        memset(sum_im, 0, p->fft_size * sizeof(double));
+        for (ch = 0; ch < channels; ch++) {
+            for (i = 0; i < p->fft_size; i++) {
+                re[ch][i] = solo[ch][pos + i] * window[i];
+                im[ch][i] = 0;
+            }
+            fft(re[ch], im[ch], p->fft_size);
+            for (i = 0; i < p->fft_size / 2; i++) {
+                sum_re[i] += re[ch][i];
+                sum_im[i] += im[ch][i];
+            }
+        }
+        for (ch = 0; ch < channels; ch++) {
+            lo = band_lo[ch];
+            hi = band_hi[ch];
+            if (hi <= lo) continue;
+            own[ch] += band_power(re[ch], im[ch], lo, hi);
+            x = 0;
+            if (lo - width >= 0) x = band_power(re[ch], im[ch], lo - width, lo);
+            if (hi + width <= half && band_power(re[ch], im[ch], hi, hi + width) > x)
+                x = band_power(re[ch], im[ch], hi, hi + width);
+            leak[ch] += x;
+            /* everything in this band that is not this channel */
+            for (i = lo; i < hi; i++)
+                interference[ch] += (sum_re[i] - re[ch][i]) * (sum_re[i] - re[ch][i])
+                    + (sum_im[i] - im[ch][i]) * (sum_im[i] - im[ch][i]);
+        }
+        for (i = 0; i < p->fft_size / 2; i++)
+            spectrum[i] += re[channels / 2][i] * re[channels / 2][i] + im[channels / 2][i] * im[channels / 2][i];
+    }
+
+    /* channels that were not heard, above Nyquist or shorter than a window, are left out */
+    p->aclr = -1000;
+    heard = 0;
+    for (ch = 0; ch < channels; ch++) {
+        if (own[ch] <= 0) continue;
+        x = 10 * log10((leak[ch] + 1e-9) / own[ch]);
+        if (x > p->aclr) p->aclr = x;
+        snr[heard++] = 10 * log10(own[ch] / (interference[ch] + 1e-9));
+    }
+    qsort(snr, heard, sizeof(double), cmp_double);
+    p->snr_min = heard ? snr[0] : -1000;
+    p->snr_median = heard ? snr[heard / 2] : -1000;
+
+    /* widen around the middle channel until 99 % of its power is inside */
+    total = 0;
+    for (i = 0; i < p->fft_size / 2; i++) total += spectrum[i];
+    centre = (freq_start + channels / 2 * p->step) / bin_hz;
+    if (centre >= half) centre = half - 1;
+    acc = spectrum[centre];
+    for (width = 1; acc < 0.99 * total && width < p->fft_size / 2; width++) {
+        if (centre - width >= 0) acc += spectrum[centre - width];
+        if (centre + width < p->fft_size / 2) acc += spectrum[centre + width];
+    }
+    p->bw99 = (2 * width - 1) * bin_hz;
+    ret = 0;
+
+out:
+    for (ch = 0; ch < channels; ch++) {
+        free(solo[ch]);
+        free(re[ch]);
+        free(im[ch]);
+    }
+    free(window);
+    free(spectrum);
+    free(sum_re);
+    free(sum_im);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+
+    double rates[MAX_LIST] = { 48000 }, ramps[MAX_LIST] = { 2, 10 }, steps[MAX_LIST] = { 200, 100, 75, 50, 40, 30, 25 };
+    double envs[MAX_LIST] = { LS_ENV_LINEAR, LS_ENV_COSINE, LS_ENV_BLACKMAN, LS_ENV_CURVE };
+    int n_rates = 1, n_ramps = 2, n_steps = 7, n_envs = 4;
+    int r, e, a, w, c, densest;
+    char *tok;
+    struct plan p;
+
+    while ((c = getopt(argc, argv, "r:E:a:w:c:p:l:s:g:t:T:P:h")) != -1)
+        switch (c) {
+        case 'r':
+            n_rates = parse_list(optarg, rates);
+            break;
+        case 'E':
+            n_envs = 0;
+            for (tok = strtok(optarg, ","); tok && n_envs < MAX_LIST; tok = strtok(NULL, ",")) {
+                if (ls_synth_env_shape(tok) < 0) {
+                    fprintf(stderr, "Unknown envelope %s\n", tok);
+                    return 1;
+                }
+                envs[n_envs++] = ls_synth_env_shape(tok);
+            }
+            break;
+        case 'a':
+            n_ramps = parse_list(optarg, ramps);
+            break;
+        case 'w':
+            n_steps = parse_list(optarg, steps);
+            break;
+        case 'c':
+            channels = atoi(optarg);
+            break;
+        case 'p':
+            poly = atoi(optarg);
+            break;
+        case 'l':
+            burst_ms = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'g':
+            gain = atoi(optarg);
+            break;
+        case 't':
+            freq_start = atoi(optarg);
+            break;
+        case 'T':
+            target = atof(optarg);
+            break;
+        case 'P':
+            if ((phase_mode = ls_synth_phase_mode(optarg)) < 0) {
+                fprintf(stderr, "Unknown phases %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            printf("Usage: lsplan [options], lists are comma separated\n");
+            printf("-r Sample rates in Hz             Default= 48000\n");
+            printf("-E Envelopes                      Default= linear,cosine,blackman,curve\n");
+            printf("-a Attack/decay/release in ms     Default= 2,10\n");
+            printf("-w Frequency steps in Hz          Default= 200,100,75,50,40,30,25\n");
+            printf("-c Channels keyed                 Default= %d\n", channels);
+            printf("-p Channels on at once            Default= %d\n", poly);
+            printf("-l Burst length in ms             Default= %d\n", burst_ms);
+            printf("-s Seconds rendered per plan      Default= %d\n", seconds);
+            printf("-g Gain level                     Default= %d\n", gain);
+            printf("-t Base frequency in Hz           Default= %d\n", freq_start);
+            printf("-T Target snr in dB               Default= %.0f\n", target);
+            printf("-P Note phases zero, newman, schroeder or opt  Default= zero\n");
+            return 1;
+        }
+    if (channels < 2 || channels > MAX_CHANNELS || poly < 1 || burst_ms < 1 || seconds < 1) {
+        fprintf(stderr, "Need 2 to %d channels, poly, burst length and seconds at least 1\n", MAX_CHANNELS);
+        return 1;
+    }
+    /* densest first, the first step that meets the target is the answer */
+    qsort(steps, n_steps, sizeof(double), cmp_double);
+
+    printf("%d channels from %d Hz, %d at once, %d ms bursts, %d s per plan\n\n",
+        channels, freq_start, poly, burst_ms, seconds);
+    printf("  rate  envelope  ramp  step   fft   bw99   aclr  snr min  snr med\n");
+    for (r = 0; r < n_rates; r++)
+        for (e = 0; e < n_envs; e++)
+            for (a = 0; a < n_ramps; a++) {
+                densest = 0;
+                for (w = 0; w < n_steps; w++) {
+                    p.rate = rates[r];
+                    p.env_shape = envs[e];
+                    p.ramp = ramps[a];
+                    p.step = steps[w];
+                    if (measure(&p) < 0) {
+                        fprintf(stderr, "Error: cannot render %d Hz step\n", p.step);
+                        return 1;
+                    }
+                    printf("%6u  %-8s %5.1f %5d %5d %6.0f %6.1f %8.1f %8.1f%s\n",
+                        p.rate, env_names[p.env_shape], p.ramp, p.step, p.fft_size,
+                        p.bw99, p.aclr, p.snr_min, p.snr_median, p.snr_min >= target ? "" : "  < target");
+                    if (!densest && p.snr_min >= target) densest = p.step;
+                    fflush(stdout);
+                }
+                if (densest)
+                    printf("  densest step for %.0f dB: %d Hz\n\n", target, densest);
+                else
+                    printf("  no step meets %.0f dB\n\n", target);
+            }
+    return 0;
+}
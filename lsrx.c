@@ -0,0 +1,802 @@
+/*
+    lsrx - simulates a crowd of LinzerSchnitte receivers listening to LSMidi
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+    Every simulated receiver listens to one channel (note): it adds its
+    own white noise, runs a Goertzel filter on its channel frequency,
+    slightly detuned by its clock error, over blocks of -B ms and calls
+    the tone on or off after -m blocks in a row above or below -T times
+    the tone level. An on/off pair it decodes is a command.
+
+    Without -i lsrx renders test patterns with the LSMidi tone engine,
+    taking the MIDI in at every LSMidi period (-b) as LSMidi does, for
+    every attack and release (-a -o), gap (-G), tone duration (-l) and
+    number of tones at once (-p) given. It compares what the receivers
+    decode with what was sent and prints the commands per second
+    received and the latency percentiles, and the test that received
+    the most within the error rate allowed with -e:
+
+	$ ./lsrx -n 500 -N 10,30 -l 20,50,100 -G 10,20 -p 1,4,8
+
+    With -M the same tests go as timed MIDI to a running LSMidi and its
+    output is captured with -i, through snd-aloop without a sound card:
+
+	$ ./LSMidi -D hw:Loopback,0 &
+	$ ./lsrx -M LSMidi:0 -i hw:Loopback,1 -l 20,50 -p 1,8
+
+    With -i it listens to LSMidi itself, from a file written with
+    -D wav:<file> or raw:<file>, from a pipe (-i - with LSMidi -D -) or
+    from an ALSA capture device. What is sent is then taken from a
+    receiver without noise and clock error on every channel:
+
+	$ ./LSMidi -D - | ./lsrx -i - -n 500 -N 10,30
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <math.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+#include "ls_synth.h"
+
+#define MAX_LIST 16
+#define CHUNK_SECONDS 1
+
+/* a command, as sent or as decoded, in frames */
+struct command {
+    int channel;
+    long long on, off;
+    long long heard;            /* decoded: when the receiver switched on */
+    int poly;                   /* sent: tones on when it started */
+    int matched;
+};
+
+struct commands {
+    struct command *c;
+    int n, size;
+};
+
+struct receiver {
+    int channel;
+    double coef, noise;
+    unsigned int seed;
+    int on, run;
+    long long edge;
+    struct commands decoded;
+};
+
+/* settings */
+static unsigned int rate = 48000;
+static int receivers = 200, channels = 16, gain = 1000, freq_start = 300, freq_channel_width = 100;
+static int threads, debounce = 2, seconds = 10, env_shape = LS_ENV_LINEAR, period = 512;
+static double block_ms, threshold = 0.5, snr_lo = 20, snr_hi = 20, ppm = 0, attack = 2, release = 2;
+static double live_latency;     /* ms, allowed for the LSMidi buffer and the capture */
+
+static struct receiver *rx;
+static int block_len;
+static short *chunk;            /* mono, shared by all threads, a whole number of blocks */
+static int chunk_len, chunk_frames;
+static long long chunk_start;
+
+static void add_command(struct commands *list, int channel, long long on, long long off, int poly) {
+
+    if (list->n == list->size) {
+        list->size = list->size ? 2 * list->size : 64;
+        list->c = realloc(list->c, list->size * sizeof(struct command));
+        if (!list->c) {
+            fprintf(stderr, "Error: out of memory\n");
+            exit(1);
+        }
+    }
+    list->c[list->n].channel = channel;
+    list->c[list->n].on = on;
+    list->c[list->n].off = off;
+    list->c[list->n].heard = on;
+    list->c[list->n].poly = poly;
+    list->c[list->n].matched = 0;
+    list->n++;
+}
+
+/* standard normal, Box-Muller on a per receiver generator */
+static double gauss(unsigned int *seed) {
+
+    double u, v;
+
+    u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    v = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static void setup_receivers(int noiseless) {
+
+    double f, snr;
+    int r;
+
+    rx = calloc(receivers, sizeof(struct receiver));
+    if (!rx) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(1);
+    }
+    for (r = 0; r < receivers; r++) {
+        rx[r].channel = r % channels;
+        rx[r].seed = r + 1;
+        f = freq_start + rx[r].channel * freq_channel_width;
+        if (!(noiseless && r < channels)) {
+            f *= 1 + ppm * 1e-6 * (2.0 * rand_r(&rx[r].seed) / RAND_MAX - 1);
+            /* snr of one tone against the noise over the whole audio band */
+            snr = snr_lo + (snr_hi - snr_lo) * rand_r(&rx[r].seed) / RAND_MAX;
+            rx[r].noise = gain / sqrt(2) / pow(10, snr / 20);
+        }
+        rx[r].coef = 2 * cos(2 * M_PI * f / rate);
+    }
+}
+
+/*
+   White noise of a given rms in the samples adds a complex Gaussian of
+   rms * sqrt(block_len / 2) per component to the filter output of a
+   block, which is what is added here instead of noise to every sample.
+*/
+static void receive(struct receiver *r, const short *x, int frames, long long start) {
+
+    double s0, s1, s2, re, im, a;
+    int i, pos, above;
+
+    pos = 0;
+    s1 = s2 = 0;
+    for (i = 0; i < frames; i++) {
+        s0 = x[i] + r->coef * s1 - s2;
+        s2 = s1;
+        s1 = s0;
+        if (++pos < block_len) continue;
+        pos = 0;
+        re = s1 - s2 * r->coef / 2;
+        im = s2 * sqrt(1 - r->coef * r->coef / 4);
+        if (r->noise > 0) {
+            re += r->noise * sqrt(block_len / 2.0) * gauss(&r->seed);
+            im += r->noise * sqrt(block_len / 2.0) * gauss(&r->seed);
+        }
+        a = 2 * sqrt(re * re + im * im) / block_len;
+        s1 = s2 = 0;
+
+        above = a > threshold * gain;
+        if (above == r->on) {
+            r->run = 0;
+            continue;
+        }
+        /* the edge is where the first block of the run began */
+        if (r->run++ == 0) r->edge = start + i + 1 - block_len;
+        if (r->run < debounce) continue;
+        r->run = 0;
+        r->on = above;
+        if (above) {
+            add_command(&r->decoded, r->channel, r->edge, -1, 0);
+            r->decoded.c[r->decoded.n - 1].heard = start + i + 1;
+        }
+        else if (r->decoded.n > 0) r->decoded.c[r->decoded.n - 1].off = r->edge;
+    }
+}
+
+static void *receive_thread(void *arg) {
+
+    int t, r;
+
+    t = (long) arg;
+    for (r = t; r < receivers; r += threads) receive(&rx[r], chunk, chunk_frames, chunk_start);
+    return NULL;
+}
+
+/* hands the chunk to all threads, each takes every threads'th receiver */
+static void receive_chunk(int frames) {
+
+    pthread_t tid[64];
+    long t;
+
+    chunk_frames = frames - frames % block_len;
+    if (chunk_frames == 0) return;
+    for (t = 0; t < threads; t++) pthread_create(&tid[t], NULL, receive_thread, (void *) t);
+    for (t = 0; t < threads; t++) pthread_join(tid[t], NULL);
+    chunk_start += chunk_frames;
+}
+
+static int cmp_double(const void *a, const void *b) {
+
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* what a test or a listen scored */
+struct result {
+    double sent_rate;           /* commands per second, over all channels */
+    double success, false_rate; /* per 100 sent */
+    double goodput;             /* received commands per second */
+    double latency[3];          /* percentiles, ms */
+};
+
+static const double percentiles[3] = { 0.50, 0.95, 0.99 };
+
+/* how far a decoded edge may be behind the sent one */
+static long long tolerance() {
+
+    return (debounce + 1) * block_len + (attack + release) * rate / 1000 + period + live_latency * rate / 1000;
+}
+
+/*
+   A sent command is received when a receiver on its channel decoded one
+   whose on and off edges are within the tolerance of it, each decoded
+   command counts once. Decoded commands that match nothing are false.
+   The latency is from the sent on edge to the receiver switching on.
+*/
+static void score(struct commands *sent, int first_rx, struct result *res) {
+
+    long long tol, on_lo, on_hi, horizon, first, last;
+    double *lat;
+    long hits, tries, falses, n_lat;
+    int r, i, j;
+    struct receiver *p;
+
+    tol = tolerance();
+    hits = tries = falses = n_lat = 0;
+    horizon = last = 0;
+    first = sent->n ? sent->c[0].on : 0;
+    for (i = 0; i < sent->n; i++) {
+        if (sent->c[i].on + tol > horizon) horizon = sent->c[i].on + tol;
+        if (sent->c[i].on < first) first = sent->c[i].on;
+        if (sent->c[i].off > last) last = sent->c[i].off;
+    }
+    lat = malloc((sent->n * (long) receivers + 1) * sizeof(double));
+    for (r = first_rx; r < receivers; r++) {
+        p = &rx[r];
+        for (j = 0; j < p->decoded.n; j++) p->decoded.c[j].matched = 0;
+        for (i = 0; i < sent->n; i++) {
+            if (sent->c[i].channel != p->channel) continue;
+            tries++;
+            on_lo = sent->c[i].on - block_len;
+            on_hi = sent->c[i].on + tol;
+            for (j = 0; j < p->decoded.n; j++) {
+                if (p->decoded.c[j].matched || p->decoded.c[j].on < on_lo || p->decoded.c[j].on > on_hi) continue;
+                if (p->decoded.c[j].off < sent->c[i].off - block_len || p->decoded.c[j].off > sent->c[i].off + tol) continue;
+                p->decoded.c[j].matched = 1;
+                lat[n_lat++] = (p->decoded.c[j].heard - sent->c[i].on) * 1000.0 / rate;
+                hits++;
+                break;
+            }
+        }
+        /* a tone still on at the end, or heard after the last command scored, is not false */
+        for (j = 0; j < p->decoded.n; j++)
+            falses += !p->decoded.c[j].matched && p->decoded.c[j].off >= 0 && p->decoded.c[j].on <= horizon;
+    }
+    res->success = tries ? 100.0 * hits / tries : 0;
+    res->false_rate = tries ? 100.0 * falses / tries : 0;
+    res->sent_rate = last > first ? (double) sent->n * rate / (last - first) : 0;
+    res->goodput = res->sent_rate * res->success / 100;
+    for (i = 0; i < 3; i++) res->latency[i] = 0;
+    if (n_lat) {
+        qsort(lat, n_lat, sizeof(double), cmp_double);
+        for (i = 0; i < 3; i++) res->latency[i] = lat[(long) (percentiles[i] * (n_lat - 1))];
+    }
+    free(lat);
+}
+
+static void free_receivers() {
+
+    int r;
+
+    for (r = 0; r < receivers; r++) free(rx[r].decoded.c);
+    free(rx);
+}
+
+/* reads frames of mono from a wav or raw file, a pipe or an ALSA capture device */
+static FILE *in_file;
+static snd_pcm_t *in_pcm;
+
+static int open_input(const char *name) {
+
+    unsigned char h[44];
+
+    if (!strncmp(name, "wav:", 4) || !strncmp(name, "raw:", 4) || !strcmp(name, "-")) {
+        in_file = strcmp(name, "-") ? fopen(name + 4, "rb") : stdin;
+        if (!in_file) {
+            fprintf(stderr, "Error: cannot open %s\n", name + 4);
+            return -1;
+        }
+        if (!strncmp(name, "wav:", 4)) {
+            if (fread(h, 1, 44, in_file) != 44 || memcmp(h, "RIFF", 4) || h[22] != 2 || h[34] != 16) {
+                fprintf(stderr, "Error: %s is not 16 bit stereo as written by LSMidi\n", name + 4);
+                return -1;
+            }
+            rate = h[24] | h[25] << 8 | h[26] << 16 | (unsigned int) h[27] << 24;
+        }
+        return 0;
+    }
+    if (snd_pcm_open(&in_pcm, name, SND_PCM_STREAM_CAPTURE, 0) < 0
+        || snd_pcm_set_params(in_pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, 2, rate, 1, 500000) < 0) {
+        fprintf(stderr, "Error: cannot capture from %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static int read_input(short *mono, int frames) {
+
+    short buf[2 * 1024];
+    int n, got, i;
+
+    for (n = 0; n < frames; n += got) {
+        got = frames - n > 1024 ? 1024 : frames - n;
+        if (in_file) {
+            got = fread(buf, 4, got, in_file);
+        } else if ((got = snd_pcm_readi(in_pcm, buf, got)) < 0) {
+            fprintf(stderr, "overrun, capture restarted\n");
+            if (snd_pcm_recover(in_pcm, got, 0) < 0) break;
+            got = 0;
+            continue;
+        }
+        if (got <= 0) break;
+        for (i = 0; i < got; i++) mono[n + i] = buf[2 * i];
+    }
+    return n;
+}
+
+/*
+   A test pattern: every slot poly random channels sound for duration ms,
+   then all are quiet for gap ms. The events go to the tone engine here
+   or as MIDI to LSMidi, what they start is recorded as sent.
+*/
+static long long tone_len, slot_len;
+static int pattern_poly;
+static unsigned char keyed[LS_SYNTH_NOTES];
+static struct commands sent;
+
+/* plays the events at from <= t < to in order, an off before an on at the same time */
+static void pattern_events(long long from, long long to, void (*play)(int channel, int on, long long t)) {
+
+    long long slot, off;
+    int i, k;
+
+    slot = from > tone_len ? (from - tone_len) / slot_len * slot_len : 0;
+    for (; slot < to; slot += slot_len) {
+        if (slot >= from) {
+            for (i = 0; i < pattern_poly; i++) {
+                do k = rand() % channels; while (keyed[k]);
+                keyed[k] = 1;
+                play(k, 1, slot);
+                add_command(&sent, k, slot, slot + tone_len, pattern_poly);
+            }
+        }
+        off = slot + tone_len;
+        if (off >= from && off < to) {
+            for (k = 0; k < channels; k++) {
+                if (!keyed[k]) continue;
+                keyed[k] = 0;
+                play(k, 0, off);
+            }
+        }
+    }
+}
+
+static void synth_play(int channel, int on, long long t) {
+
+    if (on) ls_synth_note_on(channel, 0);
+    else ls_synth_note_off(channel, 0);
+}
+
+/* LSMidi takes in the MIDI that came during a period before it renders the next one */
+static void render_test(long long end) {
+
+    short buf[2 * 256];
+    long long f;
+    int n, i, count;
+
+    for (f = 0; f < end; ) {
+        for (n = 0; n < chunk_len && f < end; n += count, f += count) {
+            if (f % period == 0) pattern_events(f - period + 1, f + 1, synth_play);
+            count = period - f % period;
+            if (count > 256) count = 256;
+            if (count > chunk_len - n) count = chunk_len - n;
+            ls_synth_render(buf, count, 0);
+            for (i = 0; i < count; i++) chunk[n + i] = buf[2 * i];
+        }
+        receive_chunk(n);
+    }
+}
+
+/*
+   Through LSMidi itself: the pattern goes out as MIDI on an ALSA queue
+   to the port given with -M, what LSMidi plays comes back through a
+   capture device, with snd-aloop for a loopback without a sound card.
+   Frame 0 of the pattern is LIVE_LEAD seconds after the queue start,
+   the capture is put on the same time line by its status time stamp.
+*/
+#define LIVE_LEAD 0.2
+
+static snd_seq_t *seq;
+static int seq_port, seq_queue;
+
+static int open_midi(const char *name) {
+
+    snd_seq_addr_t addr;
+
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0) < 0) {
+        fprintf(stderr, "Error: cannot open the ALSA sequencer\n");
+        return -1;
+    }
+    snd_seq_set_client_name(seq, "lsrx");
+    seq_port = snd_seq_create_simple_port(seq, "lsrx", SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    seq_queue = snd_seq_alloc_named_queue(seq, "lsrx");
+    if (seq_port < 0 || seq_queue < 0 || snd_seq_parse_address(seq, &addr, name) < 0
+        || snd_seq_connect_to(seq, seq_port, addr.client, addr.port) < 0) {
+        fprintf(stderr, "Error: cannot connect to LSMidi at %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static void seq_play(int channel, int on, long long t) {
+
+    snd_seq_event_t ev;
+    snd_seq_real_time_t when;
+    double s;
+
+    s = LIVE_LEAD + (double) t / rate;
+    when.tv_sec = s;
+    when.tv_nsec = (s - when.tv_sec) * 1e9;
+    snd_seq_ev_clear(&ev);
+    snd_seq_ev_set_source(&ev, seq_port);
+    snd_seq_ev_set_subs(&ev);
+    snd_seq_ev_schedule_real(&ev, seq_queue, 0, &when);
+    if (on) snd_seq_ev_set_noteon(&ev, 0, channel, 127);
+    else snd_seq_ev_set_noteoff(&ev, 0, channel, 0);
+    snd_seq_event_output(seq, &ev);
+}
+
+static void live_test(long long end) {
+
+    snd_pcm_status_t *status;
+    snd_timestamp_t ts;
+    struct timeval start;
+    long long scheduled, upto, tail;
+    int n, k, piece;
+
+    snd_pcm_status_alloca(&status);
+    snd_pcm_drop(in_pcm);
+    snd_pcm_prepare(in_pcm);
+    /* a tenth of a second at a time, the MIDI goes out a few pieces ahead */
+    piece = rate / 10 / block_len * block_len;
+    if (piece < block_len) piece = block_len;
+
+    snd_seq_start_queue(seq, seq_queue, NULL);
+    snd_seq_drain_output(seq);
+    gettimeofday(&start, NULL);
+    n = read_input(chunk, block_len);
+    snd_pcm_status(in_pcm, status);
+    snd_pcm_status_get_tstamp(status, &ts);
+    /* frames captured by ts, less those since the queue start, is where the queue started */
+    chunk_start = -(n + (long long) snd_pcm_status_get_avail(status)
+        - ((ts.tv_sec - start.tv_sec) + (ts.tv_usec - start.tv_usec) * 1e-6 - LIVE_LEAD) * rate);
+    receive_chunk(n);
+
+    scheduled = 0;
+    tail = end + (tolerance() > rate / 2 ? tolerance() : rate / 2);
+    while (chunk_start < tail) {
+        if (scheduled < end) {
+            upto = chunk_start + 3 * piece < end ? chunk_start + 3 * piece : end;
+            if (upto > scheduled) {
+                pattern_events(scheduled, upto, seq_play);
+                scheduled = upto;
+            }
+            if (scheduled == end)
+                for (k = 0; k < channels; k++) if (keyed[k]) seq_play(k, 0, end);
+            snd_seq_drain_output(seq);
+        }
+        if ((n = read_input(chunk, piece)) < block_len) break;
+        receive_chunk(n);
+    }
+    snd_seq_stop_queue(seq, seq_queue, NULL);
+    snd_seq_drain_output(seq);
+}
+
+/* one test of the sweep, on the tone engine or through LSMidi */
+static void sweep(double duration, double gap, int poly, struct result *res) {
+
+    struct ls_synth_config config;
+    long long end;
+
+    config.rate = rate;
+    config.poly = 2 * poly;
+    config.gain = gain;
+    config.freq_start = freq_start;
+    config.freq_channel_width = freq_channel_width;
+    config.attack = attack / 1000;
+    config.decay = attack / 1000;
+    config.sustain = 1;
+    config.release = release / 1000;
+    config.phase_mode = LS_PHASE_ZERO;
+    config.env_shape = env_shape;
+    if (!seq && ls_synth_init(&config) < 0) exit(1);
+
+    setup_receivers(0);
+    tone_len = duration * rate / 1000;
+    slot_len = tone_len + (long long) (gap * rate / 1000);
+    if (slot_len <= tone_len) slot_len = tone_len + 1;
+    pattern_poly = poly < channels ? poly : channels;
+    end = (long long) seconds * rate;
+    chunk_start = 0;
+    sent.n = 0;
+    srand(1);
+    memset(keyed, 0, sizeof(keyed));
+    if (seq) live_test(end);
+    else render_test(end);
+
+    /* commands cut off by the end of the pattern are not scored */
+    while (sent.n > 0 && sent.c[sent.n - 1].off + tolerance() > chunk_start) sent.n--;
+    score(&sent, 0, res);
+    printf("%6.1f %7.1f %5.0f %9.0f %5d %8.0f %8.1f %8.1f %8.0f %6.1f %6.1f %6.1f\n",
+        attack, release, gap, duration, poly, res->sent_rate, res->success, res->false_rate,
+        res->goodput, res->latency[0], res->latency[1], res->latency[2]);
+    fflush(stdout);
+    free_receivers();
+}
+
+/* receivers 0 .. channels-1 hear without noise, what they decode is taken as sent */
+static void listen(const char *name) {
+
+    struct commands part = { NULL, 0, 0 };
+    struct result res;
+    long long end;
+    int r, i, j, n, p;
+
+    if (open_input(name) < 0) exit(1);
+    receivers += channels;
+    setup_receivers(1);
+    end = in_pcm ? (long long) seconds * rate : -1;
+    while ((end < 0 || chunk_start < end) && (n = read_input(chunk, chunk_len)) >= block_len)
+        receive_chunk(n);
+
+    for (r = 0; r < channels; r++)
+        for (i = 0; i < rx[r].decoded.n; i++)
+            if (rx[r].decoded.c[i].off >= 0) add_command(&sent, r, rx[r].decoded.c[i].on, rx[r].decoded.c[i].off, 0);
+    /* tones on at once, from the reference receivers */
+    for (i = 0; i < sent.n; i++)
+        for (j = 0; j < sent.n; j++)
+            sent.c[i].poly += sent.c[j].on <= sent.c[i].on && sent.c[j].off > sent.c[i].on;
+    score(&sent, channels, &res);
+    printf("%.1f s heard, %d commands sent on %d channels, %.0f per second, %d receivers\n",
+        (double) chunk_start / rate, sent.n, channels, res.sent_rate, receivers - channels);
+    printf("received %.1f %%, false %.1f per 100 sent, on latency %.1f %.1f %.1f ms at 50 95 99 %%\n\n",
+        res.success, res.false_rate, res.latency[0], res.latency[1], res.latency[2]);
+
+    /* by the number of tones on when the command started */
+    printf("poly  commands  rx ok %%\n");
+    for (p = 1; p <= channels; p++) {
+        part.n = 0;
+        for (i = 0; i < sent.n; i++)
+            if (sent.c[i].poly == p) add_command(&part, sent.c[i].channel, sent.c[i].on, sent.c[i].off, p);
+        if (part.n == 0) continue;
+        score(&part, channels, &res);
+        printf("%4d %9d %8.1f\n", p, part.n, res.success);
+    }
+    free(part.c);
+    free_receivers();
+}
+
+static int parse_list(char *arg, double *list) {
+
+    int n;
+    char *tok;
+
+    n = 0;
+    for (tok = strtok(arg, ","); tok && n < MAX_LIST; tok = strtok(NULL, ",")) list[n++] = atof(tok);
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+
+    double durations[MAX_LIST] = { 20, 50, 100, 200 }, polys[MAX_LIST] = { 1, 4, 8 }, gaps[MAX_LIST];
+    double attacks[MAX_LIST] = { 2 }, releases[MAX_LIST] = { 2 };
+    int n_durations = 4, n_polys = 3, n_gaps = 0, n_attacks = 1, n_releases = 1, a, o, g, d, p, c;
+    double max_errors = 1, best_errors = 0, best_test[5] = { 0 };
+    struct result res, best;
+    char *input = NULL, *midi = NULL;
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    live_latency = 100;
+    while ((c = getopt(argc, argv, "i:M:W:n:c:N:f:B:T:m:l:G:p:b:e:s:j:r:g:t:w:a:o:E:h")) != -1)
+        switch (c) {
+        case 'i':
+            input = optarg;
+            break;
+        case 'M':
+            midi = optarg;
+            break;
+        case 'W':
+            live_latency = atof(optarg);
+            break;
+        case 'n':
+            receivers = atoi(optarg);
+            break;
+        case 'c':
+            channels = atoi(optarg);
+            break;
+        case 'N':
+            if (sscanf(optarg, "%lf,%lf", &snr_lo, &snr_hi) < 2) snr_hi = snr_lo;
+            break;
+        case 'f':
+            ppm = atof(optarg);
+            break;
+        case 'B':
+            block_ms = atof(optarg);
+            break;
+        case 'T':
+            threshold = atof(optarg);
+            break;
+        case 'm':
+            debounce = atoi(optarg);
+            break;
+        case 'l':
+            n_durations = parse_list(optarg, durations);
+            break;
+        case 'G':
+            n_gaps = parse_list(optarg, gaps);
+            break;
+        case 'p':
+            n_polys = parse_list(optarg, polys);
+            break;
+        case 'b':
+            period = atoi(optarg);
+            break;
+        case 'e':
+            max_errors = atof(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'g':
+            gain = atoi(optarg);
+            break;
+        case 't':
+            freq_start = atoi(optarg);
+            break;
+        case 'w':
+            freq_channel_width = atoi(optarg);
+            break;
+        case 'a':
+            n_attacks = parse_list(optarg, attacks);
+            break;
+        case 'o':
+            n_releases = parse_list(optarg, releases);
+            break;
+        case 'E':
+            if ((env_shape = ls_synth_env_shape(optarg)) < 0) {
+                fprintf(stderr, "Unknown envelope %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            printf("Usage: lsrx [options], lists are comma separated\n");
+            printf("-i Listen to wav:<file>, raw:<file>, - or a capture device, else render tests\n");
+            printf("-M Send the tests as MIDI to LSMidi at this port, hear it with -i\n");
+            printf("-W Latency allowed with -M, in ms     Default= %.0f\n", live_latency);
+            printf("-n Receivers                          Default= %d\n", receivers);
+            printf("-c Channels (notes from 0)            Default= %d\n", channels);
+            printf("-N Receiver snr in dB, or lo,hi       Default= %.0f\n", snr_lo);
+            printf("-f Receiver clock error in ppm, +-    Default= %.0f\n", ppm);
+            printf("-B Detection block in ms              Default= one period of all notes\n");
+            printf("-T Threshold, times the tone level    Default= %.2f\n", threshold);
+            printf("-m Blocks in a row to switch          Default= %d\n", debounce);
+            printf("-l Tone durations in ms               Default= 20,50,100,200\n");
+            printf("-G Gaps after the tones in ms         Default= the duration\n");
+            printf("-p Tones at once                      Default= 1,4,8\n");
+            printf("-a -o Attacks and releases in ms      Default= %.0f %.0f\n", attack, release);
+            printf("-b LSMidi period in frames            Default= %d\n", period);
+            printf("-e Errors allowed for the best test   Default= %.0f %%\n", max_errors);
+            printf("-s Seconds per test, or to capture    Default= %d\n", seconds);
+            printf("-j Threads                            Default= %d\n", threads);
+            printf("-r Sample rate for raw and capture    Default= %d\n", rate);
+            printf("-g Gain level of a tone               Default= %d\n", gain);
+            printf("-t Base frequency in Hz               Default= %d\n", freq_start);
+            printf("-w Frequency step in Hz               Default= %d\n", freq_channel_width);
+            printf("-E Envelope linear, cosine, blackman or curve  Default= linear\n");
+            return 1;
+        }
+    if (threads < 1) threads = 1;
+    if (threads > 64) threads = 64;
+    if (channels < 1 || channels > 128 || receivers < 1 || period < 1) {
+        fprintf(stderr, "Need 1 to 128 channels, at least one receiver and a period\n");
+        return 1;
+    }
+    if (midi && (!input || !strncmp(input, "wav:", 4) || !strncmp(input, "raw:", 4) || !strcmp(input, "-"))) {
+        fprintf(stderr, "-M needs a capture device with -i\n");
+        return 1;
+    }
+
+    if (input && strcmp(input, "-") && strncmp(input, "raw:", 4) && !midi) {
+        /* the wav header may change the rate, so the block is worked out after it */
+        if (open_input(input) < 0) return 1;
+        if (in_file && in_file != stdin) fclose(in_file);
+        if (in_pcm) snd_pcm_close(in_pcm);
+        in_file = NULL;
+        in_pcm = NULL;
+    }
+    if (block_ms > 0) {
+        block_len = block_ms * rate / 1000;
+    } else {
+        /* rectangular blocks that hold whole periods of every note leave the neighbours out */
+        for (block_len = rate / freq_channel_width; block_len < (int) rate / 100
+            || (long long) block_len * freq_start % rate || (long long) block_len * freq_channel_width % rate; block_len++);
+    }
+
+    chunk_len = CHUNK_SECONDS * rate / block_len * block_len;
+    if (chunk_len < block_len) chunk_len = block_len;
+    chunk = malloc(chunk_len * sizeof(short));
+    if (!chunk) return 1;
+    if (input && !midi) {
+        live_latency = 0;
+        listen(input);
+        return 0;
+    }
+    if (midi) {
+        if (open_input(input) < 0 || open_midi(midi) < 0) return 1;
+        /* LSMidi plays with the envelope it was started with */
+        n_attacks = n_releases = 1;
+    } else {
+        live_latency = 0;
+    }
+
+    printf("%d receivers on %d channels, snr %.0f to %.0f dB, %.1f ms blocks, %d threads\n\n",
+        receivers, channels, snr_lo, snr_hi, 1000.0 * block_len / rate, threads);
+    printf("attack release   gap  duration  poly  sent/s  rx ok %%  false %%  recv/s  latency ms 50 95 99 %%\n");
+    memset(&best, 0, sizeof(best));
+    best.goodput = -1;
+    for (a = 0; a < n_attacks; a++)
+        for (o = 0; o < n_releases; o++)
+            for (g = 0; g < (n_gaps ? n_gaps : 1); g++)
+                for (d = 0; d < n_durations; d++)
+                    for (p = 0; p < n_polys; p++) {
+                        attack = attacks[a];
+                        release = releases[o];
+                        sweep(durations[d], n_gaps ? gaps[g] : durations[d], polys[p], &res);
+                        if (100 - res.success + res.false_rate <= max_errors && res.goodput > best.goodput) {
+                            best = res;
+                            best_errors = 100 - res.success + res.false_rate;
+                            best_test[0] = attack;
+                            best_test[1] = release;
+                            best_test[2] = n_gaps ? gaps[g] : durations[d];
+                            best_test[3] = durations[d];
+                            best_test[4] = polys[p];
+                        }
+                    }
+    if (best.goodput < 0)
+        printf("\nno test stays within %.1f %% errors\n", max_errors);
+    else
+        printf("\nbest within %.1f %% errors: %.0f commands/s received, %.1f %% errors, latency %.1f ms at 99 %%,\n"
+            "attack %g release %g gap %g duration %g ms, poly %g\n", max_errors, best.goodput, best_errors, best.latency[2],
+            best_test[0], best_test[1], best_test[2], best_test[3], best_test[4]);
+    if (seq) snd_seq_close(seq);
+    if (in_pcm) snd_pcm_close(in_pcm);
+    free(sent.c);
+    free(chunk);
+    return 0;
+}
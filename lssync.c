@@ -0,0 +1,96 @@
+/*
+    lssync - runs a LinzerSchnitte clock sync node and prints its estimate
+    Copyright (C) 2014  Josh Gardiner
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>
+
+    Several instances on one host test the sync over loopback, eg.
+
+	$ ./lssync -n 1 &
+	$ ./lssync -n 2 -k 37,80
+
+    The second node runs 37 ms ahead and 80 ppm fast, the error column
+    shows how far its shared time is from the master clock.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include "ls_sync.h"
+
+static long long mono_ns() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+
+    struct pollfd pfd;
+    char *interface_name = NULL;
+    unsigned int node_id = 0;
+    long long skew_offset = 0, next_print, now, error;
+    double skew_drift = 0, skew_ms;
+    int interval = 1000, timeout, c;
+
+    while ((c = getopt(argc, argv, "n:k:I:i:h")) != -1)
+        switch (c) {
+        case 'n':
+            node_id = strtoul(optarg, NULL, 0);
+            break;
+        case 'k':
+            skew_ms = 0;
+            sscanf(optarg, "%lf,%lf", &skew_ms, &skew_drift);
+            skew_offset = skew_ms * 1000000;
+            break;
+        case 'I':
+            interface_name = optarg;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        default:
+            printf("Usage: lssync [-n node id] [-k offset ms,drift ppm] [-I interface] [-i print interval ms]\n");
+            printf("The node with the lowest id is master, without -n the id is random.\n");
+            printf("-k skews the clock of this node to test the sync on one host.\n");
+            return 1;
+        }
+
+    if (ls_sync_open(interface_name, node_id) < 0) return 1;
+    if (skew_offset || skew_drift) ls_sync_set_skew(skew_offset, skew_drift);
+
+    pfd.fd = ls_sync_fd();
+    pfd.events = POLLIN;
+    next_print = ls_sync_local_ns() + interval * 1000000LL;
+    while (1) {
+        timeout = ls_sync_poll();
+        if (poll(&pfd, 1, timeout) > 0) ls_sync_receive();
+        now = ls_sync_local_ns();
+        if (now >= next_print) {
+            /* without skew the local clock of every node on this host is the master clock */
+            error = ls_sync_shared_ns(now) - mono_ns();
+            ls_sync_print(stdout);
+            if (skew_offset || skew_drift)
+                printf("sync: error against the unskewed clock %+.3f ms\n", error / 1e6);
+            fflush(stdout);
+            next_print = now + interval * 1000000LL;
+        }
+    }
+    ls_sync_close();
+    return 0;
+}
@@ -34,7 +34,10 @@ freely, subject to the following restrictions:
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <time.h>
+#include <signal.h>
 #include <vector>
+#include <map>
 #include <alsa/asoundlib.h>
 
 bool QUIET=false;
@@ -42,9 +45,155 @@ bool QUIET=false;
 const int portnum = 1;
 unsigned midi_bufsize = 250000;
 const int multicast_maxsize = 1280; // maximum size of multicast packet WinXP will accept
+const int legacy_maxsize = 1024; // receive buffer of multimidicast <= 1.3, it cuts longer datagrams
+
+unsigned coalesce_usec = 0; // how long an outgoing datagram may wait for more MIDI messages
+unsigned heartbeat_msec = 200; // interval of journal-only datagrams after the last MIDI message
+bool RAW=false; // send datagrams without header and journal, like multimidicast <= 1.3
+unsigned playout_msec = 5; // fixed latency of the RTP-MIDI receive jitter buffer
+const int playout_slots = 1024; // messages the jitter buffer of a port holds
+const int playout_msgsize = 16; // bytes per slot, longer SysEx takes several slots
+
+/*
+  Datagram layout, all numbers in network byte order:
+
+    0  packet_magic
+    1  packet_version
+    2  flags
+    3  reserved, 0
+    4  sequence number, 16 bit
+    6  length of the MIDI payload, 16 bit
+    8  fragment header, if PACKET_FRAGMENT is set in flags:
+       length of the whole MIDI message, 32 bit,
+       offset of this fragment in the message, 32 bit
+       MIDI payload
+       recovery journal, if PACKET_JOURNAL is set in flags
+
+  A MIDI message which does not fit into one datagram, usually a large
+  SysEx, is split into fragments sent with consecutive sequence
+  numbers. The receiver collects them and plays the message once it
+  is complete, a message with a lost fragment is dropped.
+
+  Datagrams with PACKET_SYNC set belong to the clock sync of the
+  LinzerSchnitte sound servers (ls_sync.c). It has a port of its own,
+  LS_SYNC_PORT, but LSMidi nodes from before the move still send it to
+  the first channel, so such datagrams are ignored.
+
+  The recovery journal describes which notes are sounding on the
+  sender after the payload has been played:
+
+    0  number of channel entries
+    1  per channel entry: channel, velocity of its latest NOTEON,
+       16 bytes bitmap of sounding notes (note n is bit n&7 of byte n>>3)
+
+  packet_magic is the undefined MIDI real time status 0xFD, so a
+  datagram of a multimidicast <= 1.3 sender, which carries raw MIDI
+  bytes, can never be mistaken for a framed one.
+ */
+const unsigned char packet_magic = 0xFD;
+const unsigned char packet_version = 1;
+const unsigned char PACKET_JOURNAL = 0x01;
+const unsigned char PACKET_SYNC = 0x02;
+const unsigned char PACKET_FRAGMENT = 0x04;
+const int packet_headersize = 8;
+const int fragment_headersize = 8;
+const int journal_entrysize = 18;
+const int journal_maxsize = 1 + 16*journal_entrysize;
+const int heartbeat_count = 3; // number of journal-only datagrams sent after the last MIDI message
+
+/*
+  Ports selected with -t use RTP-MIDI (RFC 6295) instead: an RTP
+  header, a MIDI command section with delta times and a recovery
+  journal with chapter N (notes) for every channel with note activity.
+  The journal of a packet describes the notes before the packet, as
+  required by the RFC. Timestamps count rtp_clockrate ticks, like
+  AppleMIDI.
+ */
+const int rtp_headersize = 12;
+const unsigned char rtp_payload_type = 97;
+const int rtp_clockrate = 10000;
+const int rtp_journal_maxsize = 320;
+const int rtp_generation = 128; // NOTEOFFs are kept in the journal for at least this many packets
+
+/// notes sounding on the 16 MIDI channels of a MIDI byte stream
+struct notestate
+{
+  unsigned char on[16][16];	///< bitmap of sounding notes per channel
+  unsigned char off[16][16];	///< bitmap of notes switched off since the bitmap was last cleared
+  unsigned char velocity[16];	///< velocity of the latest NOTEON per channel
+  unsigned char notevel[16][128]; ///< velocity of every sounding note
+  unsigned char status;		///< running status of the parsed byte stream
+  unsigned char data[2];	///< data bytes of the channel message being parsed
+  int ndata;
+};
+
+/// loss and repair counters of a port
+struct portstats
+{
+  unsigned long sent, received, lost, late, repaired, delayed, truncated;
+};
+
+/// state of a remote sender, as seen by the receiver
+struct peerstate
+{
+  unsigned short next_seq;	///< sequence number expected next
+  notestate delivered;		///< notes which were sent into Alsa for this peer
+  std::vector<unsigned char> frag; ///< fragmented message being reassembled, keeps its capacity
+  unsigned long frag_len;	///< bytes of frag received so far, 0 if none is being reassembled
+  // RTP-MIDI peers only
+  unsigned long last_ts;	///< RTP timestamp of the latest packet
+  long long ts;			///< last_ts extended to 64 bit
+  long long offset;		///< local time in microseconds minus sender time, lower envelope
+  unsigned char status;		///< running status at the end of the latest packet
+};
 
 snd_seq_t *alsa_seq=0;
 int alsa_port[portnum];
+snd_midi_event_t* midi_event_parser[portnum];
+snd_midi_event_t* alsa_decoder;	///< decodes events from Alsa, only fixed length events
+
+notestate sentstate[portnum];
+unsigned short sent_seq[portnum];
+portstats stats[portnum];
+std::map<unsigned long long, peerstate> peers[portnum];
+volatile sig_atomic_t show_stats=0;
+
+bool rtp_port[portnum];
+unsigned long rtp_ssrc[portnum];
+unsigned long rtp_tsbase[portnum];
+long long rtp_epoch;
+notestate journalstate[portnum];	///< notes before the pending packet, for the RTP-MIDI journal
+unsigned char rtp_prevoff[portnum][16][16]; ///< NOTEOFFs of the previous journal generation
+unsigned short rtp_genstart[portnum];
+unsigned short rtp_checkpoint[portnum];
+
+/// a piece of a MIDI message waiting in the jitter buffer
+struct playslot
+{
+  long long due;		///< monotonic time in microseconds when it is played
+  unsigned char len;
+  unsigned char msg[playout_msgsize];
+};
+
+/// jitter buffers, rings sorted by due time, allocated once
+playslot playout[portnum][playout_slots];
+unsigned playout_head[portnum], playout_count[portnum];
+
+int sockout[portnum];
+struct sockaddr_in addressout[portnum];
+
+/// an outgoing datagram which collects MIDI messages until it is full or its deadline passed
+struct outpacket
+{
+  unsigned char buf[multicast_maxsize];
+  int len;
+  unsigned char status;	///< running status of the datagram, 0 if none
+  long long deadline;	///< monotonic time in microseconds when the datagram has to be sent
+  long long heartbeat;	///< monotonic time in microseconds of the next journal-only datagram
+  int heartbeats_left;
+  unsigned long first_tick, last_tick; ///< RTP-MIDI times of the first and last command
+};
+outpacket outpkt[portnum];
 
 void connect2MidiThroughPort(snd_seq_t *seq_handle) {
         snd_seq_addr_t sender, dest;
@@ -113,13 +262,1143 @@ bool get_address(int s, struct in_addr *in_address, const char *ifname)
   return true;
 }
 
+/// @return the monotonic clock in microseconds
+long long now_usec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+
+/// clear a note state, no notes are sounding afterwards
+void notestate_clear(notestate &n)
+{
+  memset(&n, 0, sizeof(n));
+}
+
+/**
+   update a note state with one byte of a MIDI byte stream.
+
+   NOTEON, NOTEOFF and the "all sound off" and "all notes off"
+   controllers change the state, everything else is skipped.
+
+   @param n the note state
+   @param b the next byte of the MIDI stream
+ */
+void notestate_byte(notestate &n, unsigned char b)
+{
+  if(b >= 0xF8)
+    return;			// real time messages may appear anywhere
+  if(b & 0x80)
+    {
+      n.status=b;
+      n.ndata=0;
+      return;
+    }
+  if(n.status < 0x80 || n.status >= 0xF0)
+    return;			// SysEx and system common data
+
+  n.data[n.ndata++]=b;
+  const unsigned char type=n.status & 0xF0;
+  if(n.ndata < ((type==0xC0 || type==0xD0)?1:2))
+    return;
+  n.ndata=0;
+
+  const int ch=n.status & 0x0F;
+  const unsigned char note=n.data[0], bit=1<<(note&7);
+  switch(type)
+    {
+    case 0x90:
+      if(n.data[1])
+	{
+	  n.on[ch][note>>3]|=bit;
+	  n.off[ch][note>>3]&=~bit;
+	  n.velocity[ch]=n.data[1];
+	  n.notevel[ch][note]=n.data[1];
+	  break;
+	}
+      // fall through, NOTEON with velocity 0 is a NOTEOFF
+    case 0x80:
+      if(n.on[ch][note>>3] & bit)
+	n.off[ch][note>>3]|=bit;
+      n.on[ch][note>>3]&=~bit;
+      break;
+    case 0xB0:
+      if(n.data[0]==120 || n.data[0]==123)
+	for(int i=0; i<16; ++i)
+	  {
+	    n.off[ch][i]|=n.on[ch][i];
+	    n.on[ch][i]=0;
+	  }
+      break;
+    }
+}
+
+/// update a note state with a MIDI byte stream
+void notestate_bytes(notestate &n, const unsigned char *buf, long s)
+{
+  for(long i=0; i<s; ++i)
+    notestate_byte(n, buf[i]);
+}
+
+/// @return true if any note is sounding on channel ch
+bool notestate_channel_on(const notestate &n, int ch)
+{
+  for(int i=0; i<16; ++i)
+    if(n.on[ch][i])
+      return true;
+  return false;
+}
+
+/**
+   write the recovery journal of a note state.
+
+   @param n the note state
+   @param buf (out) receives the journal, must hold journal_maxsize bytes
+
+   @return the size of the journal in bytes
+ */
+int journal_encode(const notestate &n, unsigned char *buf)
+{
+  int len=1;
+  buf[0]=0;
+  for(int ch=0; ch<16; ++ch)
+    if(notestate_channel_on(n, ch))
+      {
+	buf[len]=ch;
+	buf[len+1]=n.velocity[ch];
+	memcpy(buf+len+2, n.on[ch], 16);
+	len+=journal_entrysize;
+	buf[0]++;
+      }
+  return len;
+}
+
+/**
+   parse a recovery journal.
+
+   @param buf the journal
+   @param s size of buf
+   @param n (out) receives the note state described by the journal
+
+   @return true on success, false if the journal is malformed
+ */
+bool journal_decode(const unsigned char *buf, long s, notestate &n)
+{
+  notestate_clear(n);
+  if(s < 1 || s != 1+buf[0]*journal_entrysize)
+    return false;
+  for(int i=0; i<buf[0]; ++i)
+    {
+      const unsigned char *e=buf+1+i*journal_entrysize;
+      if(e[0] > 15)
+	return false;
+      n.velocity[e[0]]=e[1];
+      memcpy(n.on[e[0]], e+2, 16);
+    }
+  return true;
+}
+
+/// @return the number of MIDI payload bytes which fit into one datagram of port p
+int payload_maxsize(int p)
+{
+  if(rtp_port[p])
+    return multicast_maxsize-rtp_headersize-2-rtp_journal_maxsize;
+  return RAW ? legacy_maxsize : multicast_maxsize-packet_headersize-journal_maxsize;
+}
+
+/// @return the RTP-MIDI clock of the monotonic time usec
+unsigned long rtp_ticks(long long usec)
+{
+  return (unsigned long)((usec-rtp_epoch)/(1000000/rtp_clockrate));
+}
+
+/// @return the bits of b in reverse order
+unsigned char reverse_bits(unsigned char b)
+{
+  unsigned char r=0;
+  for(int i=0; i<8; ++i, b>>=1)
+    r=(r<<1)|(b&1);
+  return r;
+}
+
+/**
+   write the RTP-MIDI recovery journal of port p. It holds one channel
+   journal with chapter N for every channel with sounding notes or
+   NOTEOFFs since the checkpoint packet. Channels which don't fit into
+   rtp_journal_maxsize are left out.
+
+   @param p port number
+   @param buf (out) receives the journal, must hold rtp_journal_maxsize bytes
+
+   @return the size of the journal in bytes, 0 if there is nothing to journal
+ */
+int rtp_journal_encode(int p, unsigned char *buf)
+{
+  const notestate &n=journalstate[p];
+  int len=3, nchan=0;
+  for(int ch=0; ch<16; ++ch)
+    {
+      unsigned char off[16];
+      int logs=0, low=16, high=-1;
+      for(int i=0; i<16; ++i)
+	{
+	  off[i]=(n.off[ch][i] | rtp_prevoff[p][ch][i]) & ~n.on[ch][i];
+	  logs+=__builtin_popcount(n.on[ch][i]);
+	  if(off[i])
+	    {
+	      if(low > i) low=i;
+	      high=i;
+	    }
+	}
+      if(logs == 128)
+	low=16;		// all notes on, LOW=15 HIGH=0 is reserved for this case
+      if(logs == 0 && low > high)
+	continue;
+
+      const int chanlen=3 + 2 + 2*logs + (low<=high ? high-low+1 : 0);
+      if(len+chanlen > rtp_journal_maxsize)
+	break;
+
+      unsigned char *c=buf+len;
+      c[0]=(ch<<3) | ((chanlen>>8)&0x03);	// S=0, H=0
+      c[1]=chanlen&0xFF;
+      c[2]=0x08;				// table of contents: chapter N only
+      c[3]=(logs==128) ? 127 : logs;		// B=0
+      c[4]=(logs==128) ? 0xF0 : (low<=high ? (low<<4)|high : 0x10);
+      c+=5;
+      for(int note=0; note<128; ++note)
+	if(n.on[ch][note>>3] & (1<<(note&7)))
+	  {
+	    *c++=note;				// S=0
+	    *c++=0x80 | n.notevel[ch][note];	// Y=1, play the note when recovering
+	  }
+      for(int i=low; i<=high; ++i)
+	*c++=reverse_bits(off[i]);		// OFFBITS are MSB first
+      len+=chanlen;
+      nchan++;
+    }
+  if(nchan == 0)
+    return 0;
+
+  buf[0]=0x20 | (nchan-1);			// S=0, Y=0, A=1, H=0, TOTCHAN
+  buf[1]=rtp_checkpoint[p]>>8;
+  buf[2]=rtp_checkpoint[p]&0xFF;
+  return len;
+}
+
+/**
+   send one RTP-MIDI packet.
+
+   The MIDI command list is not copied, it is sent from where it is
+   between the header and the journal.
+
+   @param p port number
+   @param s length of the MIDI command list, at most payload_maxsize(p), may be 0 for a journal-only packet
+   @param tick RTP-MIDI time of the first command
+   @param pkt (out) RTP header and command section header, must hold rtp_headersize+2 bytes
+   @param journal (out) recovery journal, must hold rtp_journal_maxsize bytes
+   @param jlen (out) size of the journal
+
+   @return the size of the header in pkt
+ */
+long rtp_packet(int p, long s, unsigned long tick, unsigned char *pkt, unsigned char *journal, int &jlen)
+{
+  const unsigned short seq=sent_seq[p]++;
+
+  // start a new journal generation, NOTEOFFs of the previous one are still reported
+  if((unsigned short)(seq-rtp_genstart[p]) >= rtp_generation)
+    {
+      rtp_checkpoint[p]=rtp_genstart[p];
+      rtp_genstart[p]=seq;
+      memcpy(rtp_prevoff[p], journalstate[p].off, sizeof(rtp_prevoff[p]));
+      for(int ch=0; ch<16; ++ch)
+	for(int i=0; i<16; ++i)
+	  sentstate[p].off[ch][i]&=~journalstate[p].off[ch][i];
+      memset(journalstate[p].off, 0, sizeof(journalstate[p].off));
+    }
+
+  const unsigned long ts=(tick+rtp_tsbase[p]) & 0xFFFFFFFFUL;
+  const unsigned long ssrc=rtp_ssrc[p];
+  pkt[0]=0x80;					// V=2, P=0, X=0, CC=0
+  pkt[1]=(s ? 0x80 : 0) | rtp_payload_type;	// M is set if the command section is not empty
+  pkt[2]=seq>>8;
+  pkt[3]=seq&0xFF;
+  pkt[4]=ts>>24; pkt[5]=ts>>16; pkt[6]=ts>>8; pkt[7]=ts;
+  pkt[8]=ssrc>>24; pkt[9]=ssrc>>16; pkt[10]=ssrc>>8; pkt[11]=ssrc;
+
+  jlen=rtp_journal_encode(p, journal);
+  const unsigned char J=jlen ? 0x40 : 0;		// Z=0, P=0
+  long len=rtp_headersize;
+  if(s > 15)
+    {
+      pkt[len++]=0x80 | J | (s>>8);			// B=1, 12 bit LEN
+      pkt[len++]=s&0xFF;
+    }
+  else
+    pkt[len++]=J | s;
+
+  // the next journal has to describe the notes after this packet
+  memcpy(&journalstate[p], &sentstate[p], sizeof(journalstate[p]));
+  return len;
+}
+
+/**
+   send one datagram. Unless in raw mode the MIDI bytes are preceded
+   by a header and followed by the recovery journal of the port. The
+   parts are gathered by sendmsg(), the MIDI bytes are never copied.
+
+   @param p port number
+   @param buf MIDI bytes, at most payload_maxsize(p), or payload_maxsize(p)-fragment_headersize for a fragment
+   @param s length of buf, may be 0 for a journal-only datagram
+   @param total if not 0, buf is a fragment of a message of this length
+   @param offset offset of the fragment in its message
+ */
+void send_datagram(int p, const unsigned char *buf, long s, unsigned long total=0, unsigned long offset=0)
+{
+  static unsigned char hdr[packet_headersize+fragment_headersize];
+  static unsigned char journal[rtp_journal_maxsize > journal_maxsize ? rtp_journal_maxsize : journal_maxsize];
+  struct iovec iov[3];
+  int niov=0;
+  long hlen=0;
+  int jlen=0;
+
+  if(rtp_port[p])
+    hlen=rtp_packet(p, s, s ? outpkt[p].first_tick : rtp_ticks(now_usec()), hdr, journal, jlen);
+  else if(!RAW)
+    {
+      const unsigned short seq=sent_seq[p]++;
+      hdr[0]=packet_magic;
+      hdr[1]=packet_version;
+      hdr[2]=PACKET_JOURNAL | (total ? PACKET_FRAGMENT : 0);
+      hdr[3]=0;
+      hdr[4]=seq>>8;
+      hdr[5]=seq&0xFF;
+      hdr[6]=s>>8;
+      hdr[7]=s&0xFF;
+      hlen=packet_headersize;
+      if(total)
+	{
+	  hdr[8]=total>>24; hdr[9]=total>>16; hdr[10]=total>>8; hdr[11]=total;
+	  hdr[12]=offset>>24; hdr[13]=offset>>16; hdr[14]=offset>>8; hdr[15]=offset;
+	  hlen+=fragment_headersize;
+	}
+      jlen=journal_encode(sentstate[p], journal);
+    }
+
+  if(hlen)
+    {
+      iov[niov].iov_base=hdr;
+      iov[niov++].iov_len=hlen;
+    }
+  if(s)
+    {
+      iov[niov].iov_base=const_cast<unsigned char*>(buf);
+      iov[niov++].iov_len=s;
+    }
+  if(jlen)
+    {
+      iov[niov].iov_base=journal;
+      iov[niov++].iov_len=jlen;
+    }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name=&addressout[p];
+  msg.msg_namelen=sizeof(addressout[p]);
+  msg.msg_iov=iov;
+  msg.msg_iovlen=niov;
+  if(sendmsg(sockout[p], &msg, 0) < 0)
+    perror("sendmsg()");
+  stats[p].sent++;
+}
+
+/**
+   send bytes to the network. In framed mode a message longer than
+   payload_maxsize(p) is sent as fragments, otherwise the bytes are
+   split into datagrams of at most payload_maxsize(p).
+ */
+void send_datagrams(int p, const unsigned char *buf, long s)
+{
+  const int maxsize=payload_maxsize(p);
+  if(s > maxsize && !RAW && !rtp_port[p])
+    {
+      const int fragsize=maxsize-fragment_headersize;
+      for(long offset=0; offset<s; offset+=fragsize)
+	send_datagram(p, buf+offset, (s-offset>fragsize)?fragsize:s-offset, s, offset);
+    }
+  else
+    while(s)
+      {
+	int ss=(s>maxsize)?maxsize:s;
+	send_datagram(p, buf, ss);
+	s-=ss;
+	buf+=ss;
+      }
+
+  // repeat the journal a few times, in case the last datagram gets lost
+  outpkt[p].heartbeat=now_usec()+heartbeat_msec*1000LL;
+  outpkt[p].heartbeats_left=((RAW && !rtp_port[p]) || heartbeat_msec==0)?0:heartbeat_count;
+}
+
+/// send a journal-only datagram of port p, if one is due
+void send_heartbeat(int p, long long now)
+{
+  outpacket &o=outpkt[p];
+  if(o.heartbeats_left <= 0 || o.heartbeat > now || o.len > 0)
+    return;
+  send_datagram(p, NULL, 0);
+  o.heartbeats_left--;
+  o.heartbeat=now+heartbeat_msec*1000LL;
+}
+
+/// send the pending datagram of port p, if it contains any bytes
+void flush_packet(int p)
+{
+  outpacket &o=outpkt[p];
+  if(o.len > 0)
+    send_datagrams(p, o.buf, o.len);
+  o.len=0;
+  o.status=0;
+}
+
+/**
+   append one MIDI command to the pending RTP-MIDI packet of a port,
+   preceded by its delta time unless it is the first command.
+
+   @param p port number
+   @param cmd one MIDI command or SysEx segment with status byte
+   @param s length of cmd, at most payload_maxsize(p)-4
+   @param now time of the command
+ */
+void rtp_queue_command(int p, const unsigned char *cmd, long s, long long now)
+{
+  outpacket &o=outpkt[p];
+  const unsigned long tick=rtp_ticks(now);
+  const unsigned char status=cmd[0];
+  const bool channel_msg=(status>=0x80 && status<0xF0);
+
+  unsigned char delta[4];
+  int dlen=0;
+  if(o.len > 0)
+    {
+      // variable length delta time, most significant group first
+      unsigned long d=tick-o.last_tick;
+      if(d > 0x0FFFFFFFUL)
+	d=0x0FFFFFFFUL;
+      int groups=1;
+      while(groups < 4 && (d >> (7*groups)))
+	groups++;
+      for(int i=groups-1; i>=0; --i)
+	delta[dlen++]=((d>>(7*i))&0x7F) | (i ? 0x80 : 0);
+    }
+  long skip=(channel_msg && status==o.status)?1:0;
+  if(o.len+dlen+s-skip > payload_maxsize(p))
+    {
+      flush_packet(p);
+      dlen=0;
+      skip=0;
+    }
+
+  if(o.len == 0)
+    {
+      o.deadline=now+coalesce_usec;
+      o.first_tick=tick;
+    }
+  memcpy(o.buf+o.len, delta, dlen);
+  memcpy(o.buf+o.len+dlen, cmd+skip, s-skip);
+  o.len+=dlen+s-skip;
+  o.last_tick=tick;
+
+  if(channel_msg)
+    o.status=status;
+  else if(status < 0xF8)
+    o.status=0;
+}
+
+/**
+   append a piece of a SysEx message to the pending RTP-MIDI packet of
+   a port, split into segments which fit into a packet. Segments are
+   framed as in RFC 6295: F0..F7 complete, F0..F0 first, F7..F0 middle
+   and F7..F7 last segment.
+
+   @param p port number
+   @param buf the SysEx bytes, starting with F0 if this is the start of the message
+   @param s length of buf
+   @param now time of the message
+ */
+void rtp_queue_sysex(int p, const unsigned char *buf, long s, long long now)
+{
+  static unsigned char seg[multicast_maxsize];
+  bool start=(buf[0]==0xF0);
+  const bool end=(buf[s-1]==0xF7);
+  const unsigned char *data=buf+(start?1:0);
+  long n=s-(start?1:0)-(end?1:0);
+  const long maxdata=payload_maxsize(p)-4-2;
+
+  do
+    {
+      const long nn=(n>maxdata)?maxdata:n;
+      seg[0]=start ? 0xF0 : 0xF7;
+      memcpy(seg+1, data, nn);
+      seg[nn+1]=(end && nn==n) ? 0xF7 : 0xF0;
+      rtp_queue_command(p, seg, nn+2, now);
+      start=false;
+      data+=nn;
+      n-=nn;
+    }
+  while(n > 0);
+}
+
+/**
+   split decoded MIDI bytes into commands for the pending RTP-MIDI
+   packet of a port.
+
+   @param p port number
+   @param buf MIDI bytes as decoded by Alsa, possibly with running status
+   @param s length of buf
+ */
+void rtp_queue(int p, const unsigned char *buf, long s)
+{
+  const long long now=now_usec();
+
+  // sentstate follows each command once it is queued, after a flush it may cause,
+  // so the journal of the flushed packet does not announce it already
+  unsigned char rs=0;
+  while(s > 0)
+    {
+      const unsigned char b=buf[0];
+      if(b==0xF0 || b==0xF7 || (b<0x80 && rs==0))
+	{
+	  // SysEx, or the continuation of a SysEx Alsa split into several events
+	  long n=1;
+	  while(n<s && buf[n-1]!=0xF7)
+	    ++n;
+	  rtp_queue_sysex(p, buf, n, now);
+	  notestate_bytes(sentstate[p], buf, n);
+	  buf+=n;
+	  s-=n;
+	  continue;
+	}
+
+      unsigned char cmd[3];
+      long n;
+      if(b >= 0xF8)
+	n=1;
+      else if(b >= 0xF1)
+	{
+	  n=(b==0xF2)?3:(b==0xF1 || b==0xF3)?2:1;
+	  rs=0;
+	}
+      else
+	{
+	  if(b & 0x80)
+	    rs=b;
+	  const unsigned char type=rs & 0xF0;
+	  n=(type==0xC0 || type==0xD0)?2:3;
+	}
+
+      // expand running status, rtp_queue_command() compacts it again
+      long nbuf=(b & 0x80)?n:n-1;
+      if(nbuf > s)
+	break;
+      cmd[0]=(b & 0x80)?b:rs;
+      memcpy(cmd+1, buf+((b & 0x80)?1:0), n-1);
+      rtp_queue_command(p, cmd, n, now);
+      notestate_bytes(sentstate[p], cmd, n);
+      buf+=nbuf;
+      s-=nbuf;
+    }
+}
+
+/**
+   append one decoded MIDI message to the pending datagram of a port.
+
+   Channel messages with the same status byte as the previous channel
+   message in the datagram are stored with running status. Every
+   datagram starts with a full status byte, so a lost datagram never
+   leaves the receiver with a wrong running status.
+
+   @param p port number
+   @param buf one complete MIDI message
+   @param s length of buf
+ */
+void queue_message(int p, const unsigned char *buf, long s)
+{
+  outpacket &o=outpkt[p];
+  if(rtp_port[p])
+    {
+      rtp_queue(p, buf, s);
+      return;
+    }
+
+  const int maxsize=payload_maxsize(p);
+
+  // messages which can never share a datagram are sent on their own
+  if(s > maxsize)
+    {
+      flush_packet(p);
+      notestate_bytes(sentstate[p], buf, s);
+      send_datagrams(p, buf, s);
+      return;
+    }
+
+  const unsigned char status=buf[0];
+  const bool channel_msg=(status>=0x80 && status<0xF0);
+  long skip=(channel_msg && status==o.status)?1:0;
+  if(o.len+s-skip > maxsize)
+    {
+      flush_packet(p);
+      skip=0;
+    }
+
+  // the journal of the datagram has to include this message
+  notestate_bytes(sentstate[p], buf, s);
+
+  if(o.len == 0)
+    o.deadline=now_usec()+coalesce_usec;
+  memcpy(o.buf+o.len, buf+skip, s-skip);
+  o.len+=s-skip;
+
+  if(channel_msg)
+    o.status=status;
+  else if(status < 0xF8)
+    o.status=0;		// system common messages cancel running status, real time messages don't
+
+  if(o.len == maxsize)
+    flush_packet(p);
+}
+
+/**
+   encode MIDI bytes into Alsa events and send them from a port.
+
+   @param p port number
+   @param b MIDI bytes
+   @param r length of b
+ */
+void deliver_bytes(int p, const unsigned char *b, long r)
+{
+  while(r>0)
+    {
+      snd_seq_event_t ev;
+      snd_seq_ev_clear(&ev);
+      snd_seq_ev_set_source(&ev, alsa_port[p]);
+      snd_seq_ev_set_subs(&ev);
+      snd_seq_ev_set_direct(&ev);
+      long rr=snd_midi_event_encode(midi_event_parser[p], b, r, &ev);
+      if(rr<0)
+	{
+	  fprintf(stderr, "midi_event_parser encode error: %s\n", snd_strerror(rr));
+	  break;
+	}
+      else if(rr==0)
+	break;
+
+      snd_seq_event_output(alsa_seq, &ev);
+      r-=rr;
+      b+=rr;
+    }
+}
+
+/**
+   put a MIDI message into the jitter buffer of a port.
+
+   @param p port number
+   @param msg MIDI bytes
+   @param s length of msg
+   @param due monotonic time in microseconds when the message is played
+ */
+void schedule_message(int p, const unsigned char *msg, long s, long long due)
+{
+  while(s > 0)
+    {
+      // a full buffer plays its earliest message now rather than losing one
+      if(playout_count[p] == playout_slots)
+	{
+	  const playslot &first=playout[p][playout_head[p]];
+	  deliver_bytes(p, first.msg, first.len);
+	  playout_head[p]=(playout_head[p]+1)%playout_slots;
+	  playout_count[p]--;
+	}
+      // messages mostly arrive in order, so the insertion walks few slots from the back
+      unsigned i=playout_count[p];
+      while(i > 0 && playout[p][(playout_head[p]+i-1)%playout_slots].due > due)
+	{
+	  playout[p][(playout_head[p]+i)%playout_slots]=playout[p][(playout_head[p]+i-1)%playout_slots];
+	  --i;
+	}
+      playslot &slot=playout[p][(playout_head[p]+i)%playout_slots];
+      slot.due=due;
+      slot.len=(s < playout_msgsize)?s:playout_msgsize;
+      memcpy(slot.msg, msg, slot.len);
+      playout_count[p]++;
+      msg+=slot.len;
+      s-=slot.len;
+    }
+}
+
+/// send all messages of the jitter buffers into Alsa which are due at time now
+void play_due(long long now)
+{
+  for(int i=0; i<portnum; ++i)
+    while(playout_count[i] > 0 && playout[i][playout_head[i]].due <= now)
+      {
+	const playslot &first=playout[i][playout_head[i]];
+	deliver_bytes(i, first.msg, first.len);
+	playout_head[i]=(playout_head[i]+1)%playout_slots;
+	playout_count[i]--;
+      }
+}
+
+/**
+   bring the notes a peer has sounding in Alsa in line with its
+   recovery journal, by sending the NOTEON and NOTEOFF events which
+   got lost on the network.
+
+   @param p port number
+   @param peer the sending peer
+   @param journal note state described by the journal
+   @param due if not negative, the repairs are put into the jitter buffer for this time
+ */
+void repair_notes(int p, peerstate &peer, const notestate &journal, long long due=-1)
+{
+  for(int ch=0; ch<16; ++ch)
+    for(int i=0; i<16; ++i)
+      {
+	unsigned char diff=peer.delivered.on[ch][i] ^ journal.on[ch][i];
+	for(int bit=0; diff; ++bit, diff>>=1)
+	  {
+	    if(!(diff&1))
+	      continue;
+	    const int note=i*8+bit;
+	    stats[p].repaired++;
+	    if(!QUIET)
+	      fprintf(stderr, "REPAIR: Port %02i channel %i note %i %s\n", p+1, ch+1, note, (journal.on[ch][i] & (1<<bit))?"on":"off");
+	    if(due >= 0)
+	      {
+		unsigned char msg[3];
+		msg[0]=((journal.on[ch][i] & (1<<bit))?0x90:0x80) | ch;
+		msg[1]=note;
+		msg[2]=(journal.on[ch][i] & (1<<bit))?journal.notevel[ch][note]:0;
+		schedule_message(p, msg, 3, due);
+		continue;
+	      }
+	    snd_seq_event_t ev;
+	    snd_seq_ev_clear(&ev);
+	    snd_seq_ev_set_source(&ev, alsa_port[p]);
+	    snd_seq_ev_set_subs(&ev);
+	    snd_seq_ev_set_direct(&ev);
+	    if(journal.on[ch][i] & (1<<bit))
+	      snd_seq_ev_set_noteon(&ev, ch, note, journal.velocity[ch]);
+	    else
+	      snd_seq_ev_set_noteoff(&ev, ch, note, 0);
+	    snd_seq_event_output(alsa_seq, &ev);
+	  }
+	peer.delivered.on[ch][i]=journal.on[ch][i];
+      }
+}
+
+/**
+   handle a datagram received from the network.
+
+   Datagrams without header are played as they are. Framed datagrams
+   are checked for their sequence number, datagrams arriving out of
+   order are dropped. If datagrams got lost, the recovery journal of
+   the next datagram is used to repair the notes sounding in Alsa.
+   Fragments are collected until their message is complete.
+
+   @param p port number
+   @param sender address of the sending peer
+   @param buf the datagram
+   @param r length of buf
+ */
+void receive_datagram(int p, const struct sockaddr_in &sender, const unsigned char *buf, long r)
+{
+  if(r >= packet_headersize && buf[0] == packet_magic && (buf[2] & PACKET_SYNC))
+    return;
+  stats[p].received++;
+  if(r < packet_headersize || buf[0] != packet_magic)
+    {
+      deliver_bytes(p, buf, r);
+      return;
+    }
+  if(buf[1] != packet_version)
+    {
+      fprintf(stderr, "Port %02i %s: unsupported packet version %i\n", p+1, inet_ntoa(sender.sin_addr), buf[1]);
+      return;
+    }
+  const unsigned short seq=(buf[4]<<8)|buf[5];
+  const long len=(buf[6]<<8)|buf[7];
+  const long hlen=packet_headersize+((buf[2] & PACKET_FRAGMENT)?fragment_headersize:0);
+  if(hlen+len > r)
+    {
+      fprintf(stderr, "Port %02i %s: truncated packet\n", p+1, inet_ntoa(sender.sin_addr));
+      return;
+    }
+  if((buf[2] & PACKET_FRAGMENT) && (len == 0 || !(buf[8] | buf[9] | buf[10] | buf[11])))
+    {
+      fprintf(stderr, "Port %02i %s: empty fragment\n", p+1, inet_ntoa(sender.sin_addr));
+      return;
+    }
+
+  const unsigned long long key=((unsigned long long)ntohl(sender.sin_addr.s_addr)<<16) | ntohs(sender.sin_port);
+  std::map<unsigned long long, peerstate>::iterator it=peers[p].find(key);
+  unsigned short gap=0;
+  if(it == peers[p].end())
+    {
+      peerstate ps;
+      ps.next_seq=seq;
+      ps.frag_len=0;
+      notestate_clear(ps.delivered);
+      it=peers[p].insert(std::make_pair(key, ps)).first;
+    }
+  peerstate &peer=it->second;
+  gap=seq-peer.next_seq;
+  if(gap >= 0x8000)
+    {
+      stats[p].late++;		// an older datagram, its journal is outdated as well
+      return;
+    }
+  stats[p].lost+=gap;
+  peer.next_seq=seq+1;
+
+  const unsigned char *payload=buf+hlen;
+  if(gap && peer.frag_len)
+    {
+      fprintf(stderr, "Port %02i %s: dropped fragmented message of %lu bytes, a fragment got lost\n", p+1, inet_ntoa(sender.sin_addr), (unsigned long)peer.frag.size());
+      peer.frag_len=0;
+    }
+  if(buf[2] & PACKET_FRAGMENT)
+    {
+      const unsigned long total=((unsigned long)buf[8]<<24)|(buf[9]<<16)|(buf[10]<<8)|buf[11];
+      const unsigned long offset=((unsigned long)buf[12]<<24)|(buf[13]<<16)|(buf[14]<<8)|buf[15];
+      if(offset == 0)
+	{
+	  peer.frag_len=0;
+	  if(total > midi_bufsize)
+	    fprintf(stderr, "Port %02i %s: fragmented message of %lu bytes exceeds MIDI buffer size\n", p+1, inet_ntoa(sender.sin_addr), total);
+	  else
+	    peer.frag.resize(total);	// only allocates for a message larger than all before
+	}
+      if(offset == peer.frag_len && (offset > 0 || total <= midi_bufsize) && total == peer.frag.size() && offset+len <= total)
+	{
+	  memcpy(&peer.frag[offset], payload, len);
+	  peer.frag_len+=len;
+	  if(peer.frag_len == total)
+	    {
+	      deliver_bytes(p, &peer.frag[0], total);
+	      notestate_bytes(peer.delivered, &peer.frag[0], total);
+	      peer.frag_len=0;
+	    }
+	}
+      else
+	peer.frag_len=0;	// the start of the message got lost
+    }
+  else
+    {
+      deliver_bytes(p, payload, len);
+      notestate_bytes(peer.delivered, payload, len);
+    }
+
+  if(gap && (buf[2] & PACKET_JOURNAL))
+    {
+      notestate journal;
+      if(journal_decode(payload+len, r-hlen-len, journal))
+	repair_notes(p, peer, journal);
+      else
+	fprintf(stderr, "Port %02i %s: malformed journal\n", p+1, inet_ntoa(sender.sin_addr));
+    }
+}
+
+/**
+   apply the chapter N journals of an RTP-MIDI recovery journal to the
+   notes a peer has sounding. Notes in the note log are switched on,
+   notes in OFFBITS are switched off, all other notes are left alone.
+
+   @param buf the recovery journal
+   @param s size of buf
+   @param n (in/out) notes sounding on the peer
+
+   @return true on success, false if the journal is malformed
+ */
+bool rtp_journal_decode(const unsigned char *buf, long s, notestate &n)
+{
+  if(s < 3)
+    return false;
+  long off=3;
+  if(buf[0] & 0x40)
+    {
+      // skip the system journal
+      if(off+2 > s)
+	return false;
+      off+=((buf[off]&0x03)<<8) | buf[off+1];
+    }
+  if(!(buf[0] & 0x20))
+    return off <= s;
+
+  const int totchan=(buf[0]&0x0F)+1;
+  for(int c=0; c<totchan; ++c)
+    {
+      if(off+3 > s)
+	return false;
+      const unsigned char *j=buf+off;
+      const int ch=(j[0]>>3)&0x0F;
+      const long chanlen=((j[0]&0x03)<<8) | j[1];
+      const unsigned char toc=j[2];
+      if(chanlen < 3 || off+chanlen > s)
+	return false;
+      off+=chanlen;
+      if(!(toc & 0x08))
+	continue;
+
+      // find chapter N behind chapters P, C, M and W
+      const unsigned char *end=j+chanlen;
+      j+=3;
+      if(toc & 0x80)
+	j+=3;
+      if((toc & 0x40) && j < end)
+	j+=1+2*((j[0]&0x7F)+1);
+      if((toc & 0x20) && j+2 <= end)
+	j+=((j[0]&0x03)<<8) | j[1];
+      if(toc & 0x10)
+	j+=2;
+      if(j+2 > end)
+	continue;
+
+      const int low=j[1]>>4, high=j[1]&0x0F;
+      int logs=j[0]&0x7F;
+      const bool all=(logs==127 && low==15 && high==0);
+      if(all)
+	logs=128;
+      j+=2;
+      if(j+2*logs > end)
+	continue;
+      for(int i=0; i<logs; ++i, j+=2)
+	{
+	  const int note=j[0]&0x7F, vel=j[1]&0x7F;
+	  if(vel && (j[1]&0x80))
+	    {
+	      n.on[ch][note>>3]|=1<<(note&7);
+	      n.notevel[ch][note]=vel;
+	    }
+	}
+      if(!all)
+	for(int i=low; i<=high && j<end; ++i, ++j)
+	  n.on[ch][i]&=~reverse_bits(*j);
+    }
+  return true;
+}
+
+/**
+   handle an RTP-MIDI packet received from the network.
+
+   The commands are put into the jitter buffer at their timestamp plus
+   the fixed playout latency. The sender clock is mapped to the local
+   clock by following the lower envelope of local arrival time minus
+   sender time, which is where packets with the least network delay
+   lie. If packets got lost, the recovery journal, which describes the
+   notes before this packet, is applied first.
+
+   @param p port number
+   @param sender address of the sending peer
+   @param buf the packet
+   @param r length of buf
+ */
+void rtp_receive(int p, const struct sockaddr_in &sender, const unsigned char *buf, long r)
+{
+  if(r >= packet_headersize && buf[0] == packet_magic && (buf[2] & PACKET_SYNC))
+    return;
+  stats[p].received++;
+  if(r < rtp_headersize+1 || (buf[0]>>6) != 2)
+    {
+      fprintf(stderr, "Port %02i %s: not an RTP packet\n", p+1, inet_ntoa(sender.sin_addr));
+      return;
+    }
+  const unsigned short seq=(buf[2]<<8)|buf[3];
+  const unsigned long ts=((unsigned long)buf[4]<<24)|(buf[5]<<16)|(buf[6]<<8)|buf[7];
+  const unsigned long ssrc=((unsigned long)buf[8]<<24)|(buf[9]<<16)|(buf[10]<<8)|buf[11];
+  long off=rtp_headersize+4*(buf[0]&0x0F);
+  if((buf[0] & 0x10) && off+4 <= r)
+    off+=4+4*((buf[off+2]<<8)|buf[off+3]);	// header extension
+  if(buf[0] & 0x20)
+    r-=buf[r-1];				// padding
+  if(off >= r)
+    {
+      fprintf(stderr, "Port %02i %s: truncated RTP packet\n", p+1, inet_ntoa(sender.sin_addr));
+      return;
+    }
+
+  // MIDI command section header
+  const unsigned char h=buf[off];
+  long len=h&0x0F;
+  if(h & 0x80)
+    len=(len<<8) | buf[++off];
+  ++off;
+  if(off+len > r)
+    {
+      fprintf(stderr, "Port %02i %s: truncated RTP packet\n", p+1, inet_ntoa(sender.sin_addr));
+      return;
+    }
+
+  const long long now=now_usec();
+  const long long usec_per_tick=1000000/rtp_clockrate;
+  std::map<unsigned long long, peerstate>::iterator it=peers[p].find(ssrc);
+  if(it == peers[p].end())
+    {
+      peerstate ps;
+      ps.next_seq=seq;
+      notestate_clear(ps.delivered);
+      ps.last_ts=ts;
+      ps.ts=ts;
+      ps.offset=now-ps.ts*usec_per_tick;
+      ps.status=0;
+      it=peers[p].insert(std::make_pair((unsigned long long)ssrc, ps)).first;
+    }
+  peerstate &peer=it->second;
+  const unsigned short gap=seq-peer.next_seq;
+  if(gap >= 0x8000)
+    {
+      stats[p].late++;
+      return;
+    }
+  stats[p].lost+=gap;
+  peer.next_seq=seq+1;
+
+  peer.ts+=(int)(ts-peer.last_ts);
+  peer.last_ts=ts;
+  const long long observed=now-peer.ts*usec_per_tick;
+  if(observed < peer.offset)
+    peer.offset=observed;
+  else
+    peer.offset+=(observed-peer.offset)/256;	// follow clock drift slowly
+  const long long base=peer.offset+playout_msec*1000LL;
+
+  if(gap && (h & 0x40))
+    {
+      notestate journal=peer.delivered;
+      if(rtp_journal_decode(buf+off+len, r-off-len, journal))
+	repair_notes(p, peer, journal, peer.ts*usec_per_tick+base);
+      else
+	fprintf(stderr, "Port %02i %s: malformed RTP-MIDI journal\n", p+1, inet_ntoa(sender.sin_addr));
+    }
+
+  // MIDI list: commands with delta times, the first delta time is only present if Z is set
+  const unsigned char *c=buf+off, *end=c+len;
+  long long tick=peer.ts;
+  unsigned char rs=(h & 0x10)?peer.status:0;
+  bool first=true;
+  while(c < end)
+    {
+      if(!first || (h & 0x20))
+	{
+	  unsigned long d=0;
+	  for(int i=0; i<4 && c<end; ++i)
+	    {
+	      d=(d<<7) | (*c & 0x7F);
+	      if(!(*c++ & 0x80))
+		break;
+	    }
+	  tick+=d;
+	}
+      first=false;
+      if(c >= end)
+	break;
+
+      unsigned char msg[multicast_maxsize];
+      long n=0;
+      const unsigned char b=*c;
+      if(b==0xF0 || b==0xF7)
+	{
+	  // SysEx segment, played as the raw bytes of the SysEx message
+	  const unsigned char *e=c+1;
+	  while(e<end && *e!=0xF0 && *e!=0xF7 && *e!=0xF4)
+	    ++e;
+	  if(e >= end)
+	    break;
+	  if(b == 0xF0)
+	    msg[n++]=0xF0;
+	  memcpy(msg+n, c+1, e-c-1);
+	  n+=e-c-1;
+	  if(*e != 0xF0)
+	    msg[n++]=0xF7;	// last segment, or cancelled SysEx
+	  c=e+1;
+	  rs=0;
+	}
+      else
+	{
+	  long nn;
+	  if(b >= 0xF8)
+	    nn=1;
+	  else if(b >= 0xF1)
+	    {
+	      nn=(b==0xF2)?3:(b==0xF1 || b==0xF3)?2:1;
+	      rs=0;
+	    }
+	  else
+	    {
+	      if(b & 0x80)
+		rs=b;
+	      if(!rs)
+		break;		// data bytes without status
+	      nn=((rs&0xF0)==0xC0 || (rs&0xF0)==0xD0)?2:3;
+	    }
+	  msg[0]=(b & 0x80)?b:rs;
+	  const long nbuf=(b & 0x80)?nn:nn-1;
+	  if(c+nbuf > end)
+	    break;
+	  memcpy(msg+1, c+((b & 0x80)?1:0), nn-1);
+	  n=nn;
+	  c+=nbuf;
+	}
+
+      const long long due=tick*usec_per_tick+base;
+      if(due < now)
+	stats[p].delayed++;
+      schedule_message(p, msg, n, due);
+      notestate_bytes(peer.delivered, msg, n);
+    }
+  peer.status=rs;
+}
+
+/// print the SDP description of the RTP-MIDI stream of port p, for use with other RTP-MIDI tools
+void print_sdp(int p)
+{
+  fprintf(stderr, "SDP of Port %02i:\n", p+1);
+  fprintf(stderr, "v=0\n");
+  fprintf(stderr, "o=- %lu 0 IN IP4 0.0.0.0\n", rtp_ssrc[p]);
+  fprintf(stderr, "s=multimidicast Port %02i\n", p+1);
+  fprintf(stderr, "c=IN IP4 225.0.0.37/32\n");
+  fprintf(stderr, "t=0 0\n");
+  fprintf(stderr, "m=audio %i RTP/AVP %i\n", 21928+p, rtp_payload_type);
+  fprintf(stderr, "a=rtpmap:%i rtp-midi/%i\n", rtp_payload_type, rtp_clockrate);
+  fprintf(stderr, "a=fmtp:%i j_sec=recj; j_update=anchor\n", rtp_payload_type);
+}
+
+/// print the loss and repair counters of all ports
+void print_stats()
+{
+  for(int i=0; i<portnum; ++i)
+    fprintf(stderr, "Port %02i: %lu sent, %lu received, %lu lost, %lu out of order, %lu notes repaired, %lu events played late, %lu truncated\n",
+	    i+1, stats[i].sent, stats[i].received, stats[i].lost, stats[i].late, stats[i].repaired, stats[i].delayed, stats[i].truncated);
+}
+
+void sigusr1(int)
+{
+  show_stats=1;
+}
+
 /// print help text and exit application
 void help()
 {
   fprintf(stderr, "options: -i <interface> - use specific network interface\n");
   fprintf(stderr, "         -h - display this text\n");
   fprintf(stderr, "         -q - quiet, don't show MIDI and network events\n");
-  fprintf(stderr, "         -b <bytes> - set MIDI buffer size, default: %i bytes\n", midi_bufsize);
+  fprintf(stderr, "         -b <bytes> - set MIDI buffer size, also the largest fragmented message accepted, default: %i bytes\n", midi_bufsize);
+  fprintf(stderr, "         -l <usec> - collect MIDI messages for up to usec before sending a datagram, default: %u\n", coalesce_usec);
+  fprintf(stderr, "         -j <msec> - interval of journal-only datagrams after the last MIDI message, 0 to disable, default: %u\n", heartbeat_msec);
+  fprintf(stderr, "         -r - raw, send datagrams without header and journal, for multimidicast <= 1.3\n");
+  fprintf(stderr, "         -t <port> - use RTP-MIDI (RFC 6295) on port, may be given several times\n");
+  fprintf(stderr, "         -d <msec> - playout latency of the RTP-MIDI jitter buffer, default: %u\n", playout_msec);
+  fprintf(stderr, "send SIGUSR1 to print packet loss and repair counters\n");
   exit(EXIT_FAILURE);
 }
 
@@ -131,18 +1410,36 @@ int main(int argc, char **argv)
 
   // parse command line
   int c;
-  while((c=getopt(argc, argv, "b:hi:q")) != EOF)
+  while((c=getopt(argc, argv, "b:d:hi:j:l:qrt:")) != EOF)
     switch(c)
       {
       default:
       case 'h': help();
       case 'b': midi_bufsize=strtoul(optarg, NULL, 0); break;
+      case 'd': playout_msec=strtoul(optarg, NULL, 0); break;
       case 'i': interface_name=optarg; break;
+      case 'j': heartbeat_msec=strtoul(optarg, NULL, 0); break;
+      case 'l': coalesce_usec=strtoul(optarg, NULL, 0); break;
       case 'q': QUIET=true; break;
+      case 'r': RAW=true; break;
+      case 't':
+	{
+	  int port=atoi(optarg);
+	  if(port < 1 || port > portnum)
+	    {
+	      fprintf(stderr, "port must be between 1 and %i\n", portnum);
+	      help();
+	    }
+	  rtp_port[port-1]=true;
+	}
+	break;
       }
 
   // Setup Network
 
+  srand(time(NULL) ^ getpid());
+  rtp_epoch=now_usec();
+
   int protonum=0;
   struct protoent *p=getprotobyname("IP");
   if(p)
@@ -166,6 +1463,9 @@ int main(int argc, char **argv)
       sockaddr.sin_addr.s_addr=htonl(INADDR_ANY);
       sockaddr.sin_port=htons(21928+i);
 
+      // several receivers on one host can join the group on the same port
+      int on=1;
+      setsockopt(sockin[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
       if(bind(sockin[i], reinterpret_cast<struct sockaddr*>(&sockaddr), sizeof(sockaddr)) < 0)
 	{
 	  perror("bind");
@@ -207,10 +1507,24 @@ int main(int argc, char **argv)
 
   //////////////////////////////////
 
-  int sockout[portnum];
-  struct sockaddr_in addressout[portnum];
   for(int i=0; i<portnum; ++i)
     {
+      outpkt[i].len=0;
+      outpkt[i].status=0;
+      outpkt[i].heartbeats_left=0;
+      notestate_clear(sentstate[i]);
+      notestate_clear(journalstate[i]);
+      memset(&stats[i], 0, sizeof(stats[i]));
+
+      // RTP wants random sequence numbers, timestamps and SSRC
+      sent_seq[i]=rand();
+      rtp_genstart[i]=rtp_checkpoint[i]=sent_seq[i];
+      rtp_tsbase[i]=((unsigned long)rand()<<16) ^ rand();
+      rtp_ssrc[i]=(((unsigned long)rand()<<16) ^ rand()) & 0xFFFFFFFFUL;
+      memset(rtp_prevoff[i], 0, sizeof(rtp_prevoff[i]));
+      if(rtp_port[i] && !QUIET)
+	print_sdp(i);
+
       sockout[i] = socket(AF_INET, SOCK_DGRAM, protonum);
       if(sockout[i] < 0)
 	{
@@ -301,18 +1615,30 @@ int main(int argc, char **argv)
   }
   connect2MidiThroughPort(alsa_seq);
   // Setup MIDI event parsers for all ports
-  snd_midi_event_t* midi_event_parser[portnum];
   for(int i=0; i<portnum; ++i)
     if((alsa_err=snd_midi_event_new(midi_bufsize, &midi_event_parser[i])) < 0)
       {
 	fprintf(stderr, "could not create midi_event_parser: %s\n", snd_strerror(alsa_err));
 	return 1;
       }
+  if((alsa_err=snd_midi_event_new(16, &alsa_decoder)) < 0)
+    {
+      fprintf(stderr, "could not create midi_event_parser: %s\n", snd_strerror(alsa_err));
+      return 1;
+    }
+
+  signal(SIGUSR1, sigusr1);
 
   ////////////////////////////////////
 
   while(true)
     {
+      if(show_stats)
+	{
+	  show_stats=0;
+	  print_stats();
+	}
+
       // Wait for an event
       fd_set rfds;
       FD_ZERO(&rfds);
@@ -323,27 +1649,60 @@ int main(int argc, char **argv)
 	  FD_SET(sockin[i], &rfds); if(sockin[i]>fd_max) fd_max=sockin[i];
 	}
 
-      int s=select(fd_max+1, &rfds, NULL, NULL, NULL);
+      // wake up in time for the earliest pending datagram or journal
+      long long deadline=-1;
+      for(int i=0; i<portnum; ++i)
+	{
+	  if(outpkt[i].len > 0 && (deadline < 0 || outpkt[i].deadline < deadline))
+	    deadline=outpkt[i].deadline;
+	  if(outpkt[i].heartbeats_left > 0 && (deadline < 0 || outpkt[i].heartbeat < deadline))
+	    deadline=outpkt[i].heartbeat;
+	  if(playout_count[i] > 0 && (deadline < 0 || playout[i][playout_head[i]].due < deadline))
+	    deadline=playout[i][playout_head[i]].due;
+	}
+      struct timeval tv, *tvp=NULL;
+      if(deadline >= 0)
+	{
+	  long long wait=deadline-now_usec();
+	  if(wait < 0)
+	    wait=0;
+	  tv.tv_sec=wait/1000000;
+	  tv.tv_usec=wait%1000000;
+	  tvp=&tv;
+	}
+
+      int s=select(fd_max+1, &rfds, NULL, NULL, tvp);
       if(s < 0)
 	{
+	  if(errno == EINTR)
+	    continue;
 	  perror("select");
 	  break;
 	}
-      if(s==0)
-	{
-	  puts("timeout");
-	  continue;
-	}
 
       // A Network event
       for(int i=0; i<portnum; ++i)
 	if(FD_ISSET(sockin[i], &rfds))
 	  {
-	    // read from network
-	    unsigned char buf[1024];
+	    // read from network, datagrams larger than any sender should produce are dropped
+	    static unsigned char buf[multicast_maxsize];
 	    struct sockaddr_in sender;
-	    unsigned senderLen=sizeof(sender);
-	    int r=recvfrom(sockin[i], buf, sizeof(buf), 0, reinterpret_cast<struct sockaddr*>(&sender), &senderLen);
+	    struct iovec iov;
+	    iov.iov_base=buf;
+	    iov.iov_len=sizeof(buf);
+	    struct msghdr msg;
+	    memset(&msg, 0, sizeof(msg));
+	    msg.msg_name=&sender;
+	    msg.msg_namelen=sizeof(sender);
+	    msg.msg_iov=&iov;
+	    msg.msg_iovlen=1;
+	    int r=recvmsg(sockin[i], &msg, 0);
+	    if(r>0 && (msg.msg_flags & MSG_TRUNC))
+	      {
+		fprintf(stderr, "Port %02i %s: datagram larger than %i bytes dropped\n", i+1, inet_ntoa(sender.sin_addr), multicast_maxsize);
+		stats[i].truncated++;
+		continue;
+	      }
 	    if(r>0)
 	      {
 		if(!QUIET)
@@ -354,30 +1713,13 @@ int main(int argc, char **argv)
 		    fprintf(stderr, "\n");
 		  }
 		// encode network bytes into alsa events
-		unsigned char *b=buf;
-		while(r>0)
-		  {
-		    snd_seq_event_t ev;
-		    snd_seq_ev_clear(&ev);
-		    snd_seq_ev_set_source(&ev, alsa_port[i]);
-		    snd_seq_ev_set_subs(&ev);
-		    snd_seq_ev_set_direct(&ev);
-		    long rr=snd_midi_event_encode(midi_event_parser[i], b, r, &ev);
-		    if(rr<0)
-		      {
-			fprintf(stderr, "midi_event_parser encode error: %s\n", snd_strerror(rr));
-			break;
-		      }
-		    else if(rr==0)
-		      break;
-
-		    snd_seq_event_output(alsa_seq, &ev);
-		    r-=rr;
-		    b+=rr;
-		  }
+		if(rtp_port[i])
+		  rtp_receive(i, sender, buf, r);
+		else
+		  receive_datagram(i, sender, buf, r);
 	      }
 	    if(r<0)
-	      perror("recvfrom()");
+	      perror("recvmsg()");
 	  }
 
       // An Alsa Event
@@ -422,17 +1764,18 @@ int main(int argc, char **argv)
 		continue;
 	      }
 
-	    unsigned char buf_[midi_bufsize];
-	    unsigned char *buf=buf_;
-	    static snd_midi_event_t *dev=0;
-	    if(!dev && (alsa_err=snd_midi_event_new(midi_bufsize, &dev)) < 0)
+	    // Decode Alsa event into raw bytes. SysEx events already carry
+	    // MIDI bytes and are sent straight from the event.
+	    static unsigned char decoded[16];
+	    const unsigned char *buf=decoded;
+	    long s;
+	    if(ev->type == SND_SEQ_EVENT_SYSEX)
 	      {
-		fprintf(stderr, "could not create midi_event_parser: %s\n", snd_strerror(alsa_err));
-		return 1;
+		buf=static_cast<const unsigned char*>(ev->data.ext.ptr);
+		s=ev->data.ext.len;
 	      }
-
-	    // Decode Alsa event into raw bytes
-	    long s=snd_midi_event_decode(dev, buf, midi_bufsize, ev);
+	    else
+	      s=snd_midi_event_decode(alsa_decoder, decoded, sizeof(decoded), ev);
 	    if(s>0)
 	      {
 		// Send bytes to network
@@ -444,31 +1787,28 @@ int main(int argc, char **argv)
 		      fprintf(stderr, "%02X ", buf[j]);
 		    fprintf(stderr, "\n");
 		  }
-		// split multicast datagrams into multicast_maxsize
-		while(s)
-		  {
-		    int ss=(s>multicast_maxsize)?multicast_maxsize:s;
-		    if(sendto(sockout[p], buf, ss, 0, reinterpret_cast<struct sockaddr*>(&addressout[p]), sizeof(addressout[p])) < 0)
-		      perror("sendto()");
-		    s-=ss;
-		    buf+=ss;
-		  }
-	      }
-	    else if(s<0) {
-	      fprintf(stderr, "could not decode midi event: %li, %s, midi_bufsize=%u\n", s, snd_strerror(s), midi_bufsize);
-	      if(s == -ENOMEM) {
-		snd_midi_event_free(dev);
-		dev = 0;
-		midi_bufsize *= 2;
-		fprintf(stderr, "increased midi_bufsize to %u bytes...\n", midi_bufsize);
+		queue_message(p, buf, s);
 	      }
-	    }
+	    else if(s<0)
+	      fprintf(stderr, "could not decode midi event: %li, %s\n", s, snd_strerror(s));
 
-	    if(dev)
-	      snd_midi_event_reset_decode(dev);
+	    // the decoder state is reset after every event, running status is handled by queue_message()
+	    snd_midi_event_reset_decode(alsa_decoder);
 	  }
 	while (snd_seq_event_input_pending(alsa_seq, 0) > 0);
 
+      play_due(now_usec());
+
+      // send datagrams whose deadline passed,
+      // without a deadline everything read in one go from Alsa shares the datagrams
+      long long now=now_usec();
+      for(int i=0; i<portnum; ++i)
+	{
+	  if(outpkt[i].len > 0 && (coalesce_usec == 0 || outpkt[i].deadline <= now))
+	    flush_packet(i);
+	  send_heartbeat(i, now);
+	}
+
       snd_seq_drain_output(alsa_seq);
     }
 
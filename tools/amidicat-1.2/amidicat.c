@@ -55,6 +55,7 @@
 #include <alsa/asoundlib.h>
 #include <errno.h>
 #include <time.h>
+#include <poll.h>
 
 
 /* Constants */
@@ -70,6 +71,25 @@
 #define MAX_DELAY		(1000)
 #define FILE_STDIN		("-")
 #define MAX_HEX_DIGITS		(2)
+#define MAX_BATCH		(65536)
+#define TIMED_MARK		(0xF9)
+#define TIMED_RECSIZE		(5)
+#define TIMED_LEAD_US		(100000)
+#define TIMED_BATCH		(256)
+#define CAPTURE_MARK		(0xFD)
+#define CAPTURE_RECSIZE		(21)
+#define MAX_RATE		(100000)
+#define DEFAULT_DURATION	(10)
+#define LOADGEN_WINDOW		(1024)
+#define LOADGEN_WORST_HOLD	(16)
+#define SYSEX_START		(0xF0)
+#define SYSEX_END		(0xF7)
+#define SYSEX_CHUNK		(256)
+#define SYSEX_ARENA		(4096)
+#define MAX_SYSEX_ARENA		(1048576)
+#define ENCODE_BUFSIZE		(16)
+#define MAX_DESTS		(64)
+#define FANOUT_BUFSIZE		(262144)
 
 /* This is here for convenience only, it should be in the Makefile */
 #ifndef VERSION_STR
@@ -81,6 +101,17 @@
 pthread_mutex_t	g_mutex;
 pthread_cond_t	g_cond;
 int		g_is_endinput;
+int		g_input_fd = -1;
+
+/* Load generator, written by input thread and matched by output thread, under g_mutex */
+struct sent_t *	g_sent = NULL;
+long		g_ct_sent = 0;
+long		g_ct_matched = 0;
+long		g_ct_dropped = 0;
+long		g_ct_unexpected = 0;
+long long *	g_latency_ns = NULL;
+long long	g_first_echo_ns = 0;
+long long	g_last_echo_ns = 0;
 
 
 /* Structures */
@@ -95,11 +126,45 @@ struct in_args_t {
 	int		spacing_us;
 	int		wait_sec;
 	int		is_read;
+	int		batch;
+	int		is_timed;
+	int		rate;
+	int		duration;
+	int		is_worst;
+	int		queue;
+	struct dest_t *	dests;
+	int		ct_dests;
 };
 
 struct out_args_t {
 	snd_seq_t *	handle;
 	int		is_hex;
+	int		is_stamp;
+	int		is_loadgen;
+};
+
+struct dest_t {
+	snd_seq_t *	handle;	/* Our own ALSA client for this destination */
+	int		port_ID;
+	int		target_cli;
+	int		target_port;
+	long		ct_events;
+	long		ct_dropped;
+	int		ct_congested;
+};
+
+struct arena_t {
+	unsigned char *	buf;
+	long		size;
+	long		len;	/* Bytes in use */
+	long		sent;	/* Bytes that events in the ALSA output buffer point to */
+};
+
+struct sent_t {
+	long long	time_us;
+	unsigned char	type;
+	unsigned char	channel;
+	unsigned char	note;
 };
 
 
@@ -471,6 +536,64 @@ seq_setup(snd_seq_t *handle, char *cli_name, int target_cli, int target_port, in
 }
 
 
+/*
+ * Makes ALSA stamp every event arriving at our port with the real time
+ * of a new queue, which is started here
+ * Returns the queue, or -1 if error, prints message if error
+ */
+int
+seq_timestamp(snd_seq_t *handle, int port_ID)
+{
+	snd_seq_port_info_t *	info;
+	int			queue;
+	int			r;
+
+	queue = snd_seq_alloc_named_queue(handle, DEFAULT_CLI_NAME);
+	if (queue < 0) {
+		fprintf(stderr, "Unable to allocate ALSA queue: %s\n", strerror(-queue));
+		return -1;
+	}
+	snd_seq_start_queue(handle, queue, NULL);
+	snd_seq_drain_output(handle);
+
+	snd_seq_port_info_alloca(&info);
+	r = snd_seq_get_port_info(handle, port_ID, info);
+	if (r >= 0) {
+		snd_seq_port_info_set_timestamping(info, 1);
+		snd_seq_port_info_set_timestamp_real(info, 1);
+		snd_seq_port_info_set_timestamp_queue(info, queue);
+		r = snd_seq_set_port_info(handle, port_ID, info);
+	}
+	if (r < 0) {
+		fprintf(stderr, "Unable to enable time stamps on ALSA port: %s\n", strerror(-r));
+		return -1;
+	}
+	return queue;
+}
+
+
+/*
+ * Fills in source and destination of an event
+ * port_ID = Our port ID
+ * target_cli, target_port = The target's client and port ID,
+ * or -1 to just send to "subscribers"
+ */
+void
+address_event(snd_seq_event_t *ev, int port_ID, int target_cli, int target_port)
+{
+	/* These are macros and never fail */
+	snd_seq_ev_set_source(ev, port_ID);
+	if (target_cli < 0 || target_port < 0) {
+		/* Send to all subscribers, possibly playing to an empty house */
+		snd_seq_ev_set_subs(ev);
+	}
+	else {
+		snd_seq_ev_set_dest(ev, target_cli, target_port);
+	}
+	snd_seq_ev_set_direct(ev);
+}
+
+
 /*
  * Writes an event into ALSA
  * Blocks/retries until ALSA has received and delivered the event (as best as we can verify)
@@ -495,16 +618,8 @@ write_event(snd_seq_t *handle, snd_seq_event_t *ev, int port_ID, int target_cli,
 	int	is_syncgood;
 	int	total;
 	
-	/* Fill in event data structure, these are macros and never fail */
-	snd_seq_ev_set_source(ev, port_ID);
-	if (target_cli < 0 || target_port < 0) {
-		/* Send to all subscribers, possibly playing to an empty house */
-		snd_seq_ev_set_subs(ev);
-	}
-	else {
-		snd_seq_ev_set_dest(ev, target_cli, target_port);
-	}
-	snd_seq_ev_set_direct(ev);
+	/* Fill in event data structure */
+	address_event(ev, port_ID, target_cli, target_port);
 
 	/* Fire event */
 	for(;;) {
@@ -591,145 +706,407 @@ write_event(snd_seq_t *handle, snd_seq_event_t *ev, int port_ID, int target_cli,
 	
 	return total;
 }
- 
+
 
 /*
- * Writes a buffer to stdout
- * Returns 0 if successful or nonzero if error
- * Writes either as binary bytes or hex digits
+ * Pushes all events collected by queue_event() into ALSA at once
+ * Whenever ALSA has no room for more events, blocks on POLLOUT
+ * of the sequencer instead of busywaiting
+ * Returns negative error code if error,
+ * or the number of times it had to wait for room if successful
  */
 int
-write_stdout(unsigned char *buf, long bufsize, int is_hex)
+flush_events(snd_seq_t *handle)
+{
+	struct pollfd	pfd;
+	int		r;
+	int		ct_wait = 0;
+
+	r = snd_seq_poll_descriptors(handle, &pfd, 1, POLLOUT);
+	if (1 != r) {
+		return -EINVAL;
+	}
+
+	while(snd_seq_event_output_pending(handle) > 0) {
+		/* Check for room without blocking first, so congestion can be counted */
+		r = poll(&pfd, 1, 0);
+		if (0 == r) {
+			ct_wait ++;
+			r = poll(&pfd, 1, -1);
+		}
+		if (r < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -errno;
+		}
+
+		r = snd_seq_drain_output(handle);
+		if (r < 0 && -EAGAIN != r) {
+			return r;
+		}
+	}
+
+	if (ct_wait > 0) {
+		fprintf(stderr, "Incoming congestion, %d waits for room\n", ct_wait);
+	}
+	return ct_wait;
+}
+
+
+/*
+ * Adds an event to the output buffer, without writing it into ALSA yet
+ * If the buffer is full, it is flushed first
+ * ev = The event to be sent into ALSA
+ * port_ID, target_cli, target_port = As for write_event()
+ * queue = ALSA queue to schedule the event on, at time_us after the
+ * queue was started, or -1 to deliver it directly
+ * Returns negative error code if error,
+ * or the number of waits for room if a flush was needed
+ */
+int
+queue_event(snd_seq_t *handle, snd_seq_event_t *ev, int port_ID, int target_cli, int target_port, int queue, long long time_us)
 {
-	unsigned char *		bufptr;
-	long			size_left;
-	long			size_written;
-	unsigned int		ui;
+	snd_seq_real_time_t	rtime;
 	int			r;
-	unsigned char		uc;
+	int			ret = 0;
 
-	bufptr = buf;
-	size_left = bufsize;
-	if (is_hex) {
-		/* Print hex bytes, e.g. 90 3C 7F */
-		while(size_left > 0) {
-			uc = *bufptr;
-			ui = uc;
-			
-			/* Separate by spaces, unless it's the last one which gets newline */
-			r = printf("%02X%s", ui, ((size_left > 1) ? " " : "\n"));
-			if (r < 0) {
-				return -1;
+	address_event(ev, port_ID, target_cli, target_port);
+	if (queue >= 0) {
+		rtime.tv_sec = time_us / 1000000;
+		rtime.tv_nsec = (time_us % 1000000) * 1000;
+		snd_seq_ev_schedule_real(ev, queue, 0, &rtime);
+	}
+	for(;;) {
+		r = snd_seq_event_output_buffer(handle, ev);
+		if (r >= 0) {
+			return ret;
+		}
+		if (-EAGAIN != r) {
+			return r;
+		}
+
+		/* Buffer full, make room */
+		r = flush_events(handle);
+		if (r < 0) {
+			return r;
+		}
+		ret += r;
+		if (0 == snd_seq_event_output_pending(handle)) {
+			/* Still does not fit into an empty buffer, give up on batching this one */
+			r = snd_seq_event_output_direct(handle, ev);
+			return (r < 0) ? r : ret;
+		}
+	}
+}
+
+
+/*
+ * Returns 1 if the next read of input would not block, 0 if it would
+ */
+int
+input_ready(void)
+{
+	struct pollfd	pfd;
+
+	if (-1 == g_input_fd) {
+		return 1;
+	}
+	pfd.fd = g_input_fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) != 0;
+}
+
+ 
+/*
+ * Writes all of a buffer to stdout
+ * Returns 0 if successful or nonzero if error
+ */
+int
+write_all(const unsigned char *buf, long bufsize)
+{
+	long	size_written;
+
+	while(bufsize > 0) {
+		size_written = write(STDOUT_FILENO, buf, bufsize);
+		if (size_written < 0) {
+			if (EINTR == errno) {
+				continue;
 			}
+			return -1;
+		}
+			
+		buf += size_written;
+		bufsize -= size_written;
+	}
+	return 0;
+}
+
+
+/*
+ * Collects output in a buffer, and writes it to stdout when full,
+ * so stdout sees few large writes instead of one per event
+ * Pass in NULL to write out whatever is in the buffer
+ * Returns 0 if successful or nonzero if error
+ */
+int
+buffer_stdout(const unsigned char *buf, long bufsize)
+{
+	static unsigned char	outbuf[DEFAULT_BUFSIZE];
+	static long		used = 0;
+
+	/* Write out the buffer if asked to, or if the new data does not fit */
+	if (NULL == buf || used + bufsize > DEFAULT_BUFSIZE) {
+		if (0 != write_all(outbuf, used)) {
+			return -1;
+		}
+		used = 0;
+		if (NULL == buf) {
+			return 0;
+		}
 
-			bufptr ++;
-			size_left --;
+		/* Data larger than the whole buffer goes out directly */
+		if (bufsize > DEFAULT_BUFSIZE) {
+			return write_all(buf, bufsize);
 		}
 	}
-	else {
-		/* Full write to stdout */
-		while(size_left > 0) {
-			size_written = write(STDOUT_FILENO, bufptr, size_left);
-			if (size_written < 0) {
+
+	memcpy(outbuf + used, buf, bufsize);
+	used += bufsize;
+	return 0;
+}
+
+
+/*
+ * Writes a buffer to stdout, through buffer_stdout()
+ * Returns 0 if successful or nonzero if error
+ * Writes either as binary bytes or hex digits
+ */
+int
+write_stdout(unsigned char *buf, long bufsize, int is_hex)
+{
+	static const char	digits[] = "0123456789ABCDEF";
+	unsigned char		text[3 * 64];
+	long			size_text;
+	long			i;
+
+	if (!is_hex) {
+		return buffer_stdout(buf, bufsize);
+	}
+
+	/* Print hex bytes, e.g. 90 3C 7F */
+	size_text = 0;
+	for (i = 0; i < bufsize; i ++) {
+		text[size_text ++] = digits[buf[i] >> 4];
+		text[size_text ++] = digits[buf[i] & 0x0F];
+		
+		/* Separate by spaces, unless it's the last one which gets newline */
+		text[size_text ++] = (i < bufsize - 1) ? ' ' : '\n';
+		if (size_text == sizeof(text)) {
+			if (0 != buffer_stdout(text, size_text)) {
 				return -1;
 			}
-				
-			bufptr += size_written;
-			size_left -= size_written;
+			size_text = 0;
 		}
 	}
 	
-	return 0;
+	return buffer_stdout(text, size_text);
 }
 
 
 /*
- * Parses an incoming unsigned byte of ASCII text, representing a
- * hex digit, eventually building up and returning complete hex numbers
- * Uses static variables to keep state across calls
+ * Writes the capture record that precedes a received MIDI message
+ * mono_ns = CLOCK_MONOTONIC time at which the event was read
+ * seq_ns = Real time stamp given to the event by ALSA, 0 if none
+ * size = Number of MIDI bytes that will follow
+ * In hex, the record is a prefix to the line of hex bytes,
+ * both times as seconds with 9 decimals
+ * In binary, it is CAPTURE_MARK, the two times in nanoseconds,
+ * 8 bytes each, and the size, 4 bytes, all most significant first
+ * Returns 0 if successful or nonzero if error
+ */
+int
+write_stamp(long long mono_ns, long long seq_ns, long size, int is_hex)
+{
+	unsigned char	rec[64];
+	int		i;
+	int		r;
+
+	if (is_hex) {
+		r = snprintf((char *)rec, sizeof(rec), "%lld.%09lld %lld.%09lld ",
+			mono_ns / 1000000000, mono_ns % 1000000000,
+			seq_ns / 1000000000, seq_ns % 1000000000);
+		return buffer_stdout(rec, r);
+	}
+
+	rec[0] = CAPTURE_MARK;
+	for (i = 0; i < 8; i ++) {
+		rec[1 + i] = (mono_ns >> (56 - 8 * i)) & 0xFF;
+		rec[9 + i] = (seq_ns >> (56 - 8 * i)) & 0xFF;
+	}
+	for (i = 0; i < 4; i ++) {
+		rec[17 + i] = (size >> (24 - 8 * i)) & 0xFF;
+	}
+	return buffer_stdout(rec, CAPTURE_RECSIZE);
+}
+
+
+/*
+ * Writes a timing record for a delay in microseconds
+ * Returns its size, TIMED_RECSIZE
+ */
+int
+write_delay(unsigned char *out, unsigned long delay)
+{
+	out[0] = TIMED_MARK;
+	out[1] = (delay >> 24) & 0xFF;
+	out[2] = (delay >> 16) & 0xFF;
+	out[3] = (delay >> 8) & 0xFF;
+	out[4] = delay & 0xFF;
+	return TIMED_RECSIZE;
+}
+
+
+/*
+ * Decodes a block of ASCII text, representing hex digits, into bytes
+ * Uses a lookup table, built on first use, instead of comparing characters
+ * Uses static variables to keep a number in progress across calls
  * Hex digits are separated by whitespace, or if enough hex digits
  * have been read and maximum size has been reached, no separator
  * is necessary (so digits can all be ran together)
  * If not whitespace, each byte of text must be in range [0-9A-Fa-f]
- * Returns unsigned hex number if successful
- * Returns -1 if error (unrecognized byte of ASCII text)
- * Returns -2 if the complete hex number is not available yet (still good)
- * As a special case, pass in a value of -2 when at an input boundary,
- * this will reset the state and return the hex number that was in
+ * If is_timed is true, "+" followed by decimal digits gives the delay
+ * in microseconds before the next message, it is written to out as a
+ * timing record: TIMED_MARK and the delay, 4 bytes, most significant first
+ * in = The text, out = Receives the bytes, at most size of them,
+ * or 2 * size + TIMED_RECSIZE if is_timed
+ * As a special case, pass in NULL when at an input boundary,
+ * this will reset the state and write the hex number that was in
  * progress (if any)
+ * Returns the number of bytes written to out
+ * Returns -1 if error, and sets badPtr to the unrecognized byte of text
  */
 int
-parse_hex_byte(int ch)
+parse_hex_block(const unsigned char *in, int size, unsigned char *out, int is_timed, int *badPtr)
 {
-	static int	hex_value = 0;
-	static int	read_nybbles = 0;
-
-	int		ret;
+	/* Table values: 0-15 for digits, -2 for whitespace, -3 for "+", -1 for anything else */
+	static signed char	table[256];
+	static int		is_inited = 0;
+	static int		hex_value = 0;
+	static int		read_nybbles = 0;
+	static int		is_delay = 0;
+	static int		delay_digits = 0;
+	static unsigned long	delay = 0;
+
+	int		ct_out = 0;
 	int		nybble;
-		
-	/* Parse human-readable digit into nybble value */
-	nybble = -1;
-	if (ch >= '0' && ch <= '9') {
-		nybble = ch - '0';
-	}
-	if (ch >= 'A' && ch <= 'F') {
-		nybble = 10 + (ch - 'A');
+	int		i;
+
+	if (!is_inited) {
+		for (i = 0; i < 256; i ++) {
+			table[i] = -1;
+		}
+		for (i = 0; i < 10; i ++) {
+			table['0' + i] = i;
+		}
+		for (i = 0; i < 6; i ++) {
+			table['A' + i] = 10 + i;
+			table['a' + i] = 10 + i;
+		}
+		/* Standard C whitespace */
+		/* Avoid usage of isspace() because that would introduce locale variations */
+		table[' '] = -2;
+		table['\f'] = -2;
+		table['\n'] = -2;
+		table['\r'] = -2;
+		table['\t'] = -2;
+		table['\v'] = -2;
+		table['+'] = -3;
+		is_inited = 1;
 	}
-	if (ch >= 'a' && ch <= 'f') {
-		nybble = 10 + (ch - 'a');
+
+	/* Input boundary, finish the number in progress */
+	if (NULL == in) {
+		if (read_nybbles > 0) {
+			out[ct_out ++] = hex_value;
+		}
+		if (is_delay) {
+			ct_out += write_delay(out + ct_out, delay);
+		}
+		hex_value = 0;
+		read_nybbles = 0;
+		is_delay = 0;
+		return ct_out;
 	}
 
-	if (-1 == nybble) {
-		switch(ch) {
-			/* Special case accept -2 as a zero-length reset request */
-			case -2:
-				/* Fall through */
-				
-			/* Standard C whitespace */
-			/* Avoid usage of isspace() because that would introduce locale variations */
-			case ' ':
-			case '\f':
-			case '\n':
-			case '\r':
-			case '\t':
-			case '\v':
-				/* Clear state, and return -2 if there was nothing to begin with */
-				ret = -2;
-				if (read_nybbles > 0) {
-					ret = hex_value;
+	for (i = 0; i < size; i ++) {
+		nybble = table[in[i]];
+		if (is_delay) {
+			/* Decimal delay, up to the next whitespace */
+			if (nybble >= 0 && nybble <= 9) {
+				/* Saturate at the largest delay a timing record can hold */
+				if (delay > (0xFFFFFFFFUL - nybble) / 10) {
+					delay = 0xFFFFFFFFUL;
 				}
-				hex_value = 0;
-				read_nybbles = 0;
-				return ret;
+				else {
+					delay = delay * 10 + nybble;
+				}
+				delay_digits ++;
+				continue;
+			}
+			/* A "+" needs at least one digit, so a record takes 3 characters or more */
+			if (-2 != nybble || 0 == delay_digits) {
+				*badPtr = in[i];
+				return -1;
+			}
+			ct_out += write_delay(out + ct_out, delay);
+			is_delay = 0;
+			continue;
+		}
+		if (-3 == nybble && is_timed) {
+			/* Finish the number in progress, the delay comes after it */
+			if (read_nybbles > 0) {
+				out[ct_out ++] = hex_value;
+			}
+			hex_value = 0;
+			read_nybbles = 0;
+			is_delay = 1;
+			delay_digits = 0;
+			delay = 0;
+			continue;
+		}
+		if (nybble >= 0) {
+			/* Digit is valid, build up a number with it */
+			hex_value = (hex_value << 4) | nybble;
+			read_nybbles ++;
 
-			/* No default */
+			/* Force number to be finished, if maximum digit count reached */
+			if (read_nybbles < MAX_HEX_DIGITS) {
+				continue;
+			}
+		}
+		else if (-2 != nybble) {
+			/* Unrecognized character */
+			*badPtr = in[i];
+			return -1;
+		}
+		else if (0 == read_nybbles) {
+			/* Whitespace with nothing to finish */
+			continue;
 		}
-		
-		/* Unrecognized character */
-		return -1;
-	}
 
-	/* Digit is valid, build up a number with it */
-	hex_value <<= 4;
-	hex_value += nybble;
-	read_nybbles ++;
-	
-	/* Force number to be finished, if maximum digit count reached */
-	if (read_nybbles >= MAX_HEX_DIGITS) {
-		ret = hex_value;
+		out[ct_out ++] = hex_value;
 		hex_value = 0;
 		read_nybbles = 0;
-		return ret;
 	}
-
-	/* Successfully stored digit, but nothing to return yet */
-	return -2;
+	
+	return ct_out;
 }
 
 
 /*
- * Reads a byte of input from various sources
- * Fills in bytePtr with the byte that was read
+ * Reads a block of input from various sources
+ * Fills in buf with up to bufsize bytes that were read
  * Uses static variables to keep state across calls
  * Pass in the argc array from the command line,
  * after all options have been removed.
@@ -739,13 +1116,16 @@ parse_hex_byte(int ch)
  * Passing in a pointer that is valid but points to NULL,
  * indicating an empty command line,
  * is also special, and means standard input.
+ * Reads as much as is available, up to bufsize, with one read(),
+ * so large inputs need few system calls.
  * If is_hex is true, will read human-readable hex digits,
  * assemble them into bytes, and return the bytes.
- * Returns 1 if successful, -1 if error,
+ * If is_timed is also true, delays given as text become timing records.
+ * Returns the number of bytes in buf if successful, -1 if error,
  * or 0 if clean EOF after finishing all files.
  */
 int
-input_byte(char** args_ptr, int is_hex, char *bytePtr)
+input_block(char** args_ptr, int is_hex, int is_timed, unsigned char *buf, int bufsize)
 {
 	/* Static variables for holding state */
 	static char **	args_iter = NULL;
@@ -753,12 +1133,14 @@ input_byte(char** args_ptr, int is_hex, char *bytePtr)
 	static int	file_fd = -1;
 	static int	need_open = 0;
 	static int	is_inited = 0;
-	static int	is_delayedEOF = 0;
+	static unsigned char *	text = NULL;
+	static int	text_size = 0;
+	static int	is_finished = 0;
 
-	unsigned char	byteBuf;
 	int		ret;
-	int		val;
+	int		bad;
 	int		r;
+	int		readsize;
 
 	/* Only do initialization once */
 	if (!is_inited) {
@@ -768,6 +1150,29 @@ input_byte(char** args_ptr, int is_hex, char *bytePtr)
 		is_inited = 1;
 	}
 
+	/* Clean EOF was held back, to return the final byte of the last file first */
+	if (is_finished) {
+		return 0;
+	}
+
+	/* Timing records take more room than their text, up to 5 bytes for the 3 characters of "+1 " */
+	readsize = bufsize;
+	if (is_hex && is_timed) {
+		readsize = (bufsize - TIMED_RECSIZE) / 2;
+	}
+
+	/* Hex text is read into its own buffer, then decoded into buf */
+	if (is_hex && text_size < bufsize) {
+		free(text);
+		text = malloc(bufsize);
+		if (NULL == text) {
+			text_size = 0;
+			fprintf(stderr, "Unable to allocate input buffer\n");
+			return -1;
+		}
+		text_size = bufsize;
+	}
+
 	/* Keep looping around, opening next files as necessary, until we have something to return */
 	for(;;) {
 		/* This gets set if previous file reached EOF, or during init */
@@ -799,29 +1204,14 @@ input_byte(char** args_ptr, int is_hex, char *bytePtr)
 				file_name = "standard input";
 				file_fd = STDIN_FILENO;
 			}
-			
-			/* Successfully at beginning of next file */
-			if (is_hex) {
-				/* Init hex state, better already be empty from previous file */
-				val = parse_hex_byte(-2);
-				if (-2 != val) {
-					fprintf(stderr, "Internal error, failed to clear hex state across files\n");
-					return -1;
-				}
-			}
 			need_open = 0;
 		}
 
 		/* Should have a valid file_fd at this point */
-		if (is_delayedEOF) {
-			/* No new reading of data during this pass, just held over EOF from last time */
-			ret = 0;
-			is_delayedEOF = 0;
-		}
-		else {
-			/* Read a byte of raw input (might be a hex digit) */
-			ret = read(file_fd, &byteBuf, 1);
-		}
+		g_input_fd = file_fd;
+
+		/* Read a block of raw input (might be hex digits) */
+		ret = read(file_fd, (is_hex ? text : buf), readsize);
 		
 		if (-1 == ret) {
 			/* Ignore harmless errors and retry */
@@ -835,17 +1225,10 @@ input_byte(char** args_ptr, int is_hex, char *bytePtr)
 		
 		/* Advance to next file, if EOF detected in this file */
 		if (0 == ret) {
-			/* The file might have ended in the middle of a hex digit */
+			/* The file might have ended in the middle of a hex digit, numbers never span files */
+			ret = 0;
 			if (is_hex) {
-				val = parse_hex_byte(-2);
-				if (-2 != val) {
-					/* Poor man's coroutine: delay EOF by one pass, insert this final byte */
-					is_delayedEOF = 1;
-
-					/* Return final byte */					
-					*bytePtr = (char)val;
-					return 1;
-				}
+				ret = parse_hex_block(NULL, 0, buf, is_timed, NULL);
 			}
 
 			if (-1 != file_fd) {
@@ -870,50 +1253,285 @@ input_byte(char** args_ptr, int is_hex, char *bytePtr)
 				if (NULL != file_name) {
 					/* Next file will be opened after we loop around */
 					need_open = 1;
-					continue;
-				}
-				else {
-					/* Finished with all files on command line */
-					return 0;
 				}
 			}
-			else {
-				/* No files at all on command line, EOF means end of stdin */
-				return 0;
+
+			/* Finished with all files on command line, or EOF of stdin */
+			if (!need_open) {
+				g_input_fd = -1;
+				is_finished = 1;
 			}
-		}
 
-		/* Successfully read a byte of data */
-		if (1 == ret) {
-			/* Piece hex number together */
-			if (is_hex) {
-				val = parse_hex_byte(byteBuf);
-				if (-2 == val) {
-					/* Successfully read a byte, but hex number not complete yet */
-					continue;
-				}
-				if (-1 == val) {
-					fprintf(stderr, "Unrecognizable hex digit text in file %s: %c (%d)\n", file_name, (int)byteBuf, (int)byteBuf);
-					return -1;
-				}
-				
-				/* Successfully assembled hex number */
-				*bytePtr = (char)val;
+			/* Return the final byte of the file, if any */
+			if (ret > 0) {
 				return ret;
 			}
-			
-			/* Hex not used, return byte exactly as it was read */
-			*bytePtr = (char)byteBuf;
+			if (need_open) {
+				continue;
+			}
+			return 0;
+		}
+
+		/* Hex not used, return bytes exactly as they were read */
+		if (!is_hex) {
 			return ret;
 		}
 
-		/* Should never get here */
-		break;
-	}
-	
-	/* Should never get here */
-	fprintf(stderr, "Internal error in file reading: %d\n", ret);
-	return -1;
+		/* Piece hex numbers together, the text may not have finished any yet */
+		ret = parse_hex_block(text, ret, buf, is_timed, &bad);
+		if (-1 == ret) {
+			fprintf(stderr, "Unrecognizable hex digit text in file %s: %c (%d)\n", file_name, bad, bad);
+			return -1;
+		}
+		if (ret > 0) {
+			return ret;
+		}
+	}
+}
+
+
+/*
+ * Opens an ALSA client of our own for each fan-out destination,
+ * so each gets its own output buffer and never blocks the others
+ * Returns 0 if all went well, or -1 if error, prints message if error
+ */
+int
+fanout_open(struct dest_t *dests, int ct_dests, char *cli_name, int batch)
+{
+	struct dest_t *	dest;
+	int		cli_ID;
+	int		size;
+	int		i;
+	int		r;
+
+	size = FANOUT_BUFSIZE;
+	if ((batch + 1) * (int)sizeof(snd_seq_event_t) > size) {
+		size = (batch + 1) * sizeof(snd_seq_event_t);
+	}
+	for (i = 0; i < ct_dests; i ++) {
+		dest = &dests[i];
+		dest->handle = seq_open(0, 1);
+		if (NULL == dest->handle) {
+			return -1;
+		}
+		r = seq_setup(dest->handle, cli_name, dest->target_cli, dest->target_port, 0, 1, &cli_ID, &dest->port_ID);
+		if (r < 0) {
+			return -1;
+		}
+		snd_seq_nonblock(dest->handle, 1);
+		snd_seq_set_output_buffer_size(dest->handle, size);
+	}
+	return 0;
+}
+
+
+/*
+ * Checks if an event ends a note, as a note off or a note on with velocity 0
+ * Returns 1 if so, otherwise 0
+ */
+int
+is_note_off(const snd_seq_event_t *ev)
+{
+	if (SND_SEQ_EVENT_NOTEOFF == ev->type) {
+		return 1;
+	}
+	return SND_SEQ_EVENT_NOTEON == ev->type && 0 == ev->data.note.velocity;
+}
+
+
+/*
+ * Puts an event into the output buffer of one fan-out destination,
+ * waiting for as long as it takes the destination to make room
+ * Returns 0 if successful or negative error code
+ */
+int
+fanout_wait(struct dest_t *dest, snd_seq_event_t *ev)
+{
+	struct pollfd	pfd;
+	int		r;
+
+	for(;;) {
+		if (1 == snd_seq_poll_descriptors(dest->handle, &pfd, 1, POLLOUT)) {
+			r = poll(&pfd, 1, -1);
+			if (r < 0 && EINTR != errno) {
+				return -errno;
+			}
+		}
+		r = snd_seq_drain_output(dest->handle);
+		if (r < 0 && -EAGAIN != r) {
+			return r;
+		}
+		r = snd_seq_event_output_buffer(dest->handle, ev);
+		if (-EAGAIN != r) {
+			return r;
+		}
+	}
+}
+
+
+/*
+ * Puts an event into the output buffer of every fan-out destination
+ * A destination whose buffer stays full has the event dropped, instead of holding up the others,
+ * except for note offs, which wait until that destination makes room
+ * queue, time_us = As for queue_event()
+ * Returns 0 if successful or negative error code
+ */
+int
+fanout_event(struct dest_t *dests, int ct_dests, snd_seq_event_t *ev, int queue, long long time_us)
+{
+	struct dest_t *		dest;
+	snd_seq_event_t		copy;
+	snd_seq_real_time_t	rtime;
+	int			i;
+	int			r;
+
+	for (i = 0; i < ct_dests; i ++) {
+		dest = &dests[i];
+		copy = *ev;
+		address_event(&copy, dest->port_ID, dest->target_cli, dest->target_port);
+		if (queue >= 0) {
+			rtime.tv_sec = time_us / 1000000;
+			rtime.tv_nsec = (time_us % 1000000) * 1000;
+			snd_seq_ev_schedule_real(&copy, queue, 0, &rtime);
+		}
+
+		/* Each buffer keeps its own copy of SysEx, so the arena is free again right away */
+		if (SND_SEQ_EVENT_LENGTH_VARUSR == (copy.flags & SND_SEQ_EVENT_LENGTH_MASK)) {
+			copy.flags &= ~SND_SEQ_EVENT_LENGTH_MASK;
+			copy.flags |= SND_SEQ_EVENT_LENGTH_VARIABLE;
+		}
+
+		r = snd_seq_event_output_buffer(dest->handle, &copy);
+		if (-EAGAIN == r) {
+			/* Buffer full, hand over whatever the destination can take right now */
+			dest->ct_congested ++;
+			r = snd_seq_drain_output(dest->handle);
+			if (r >= 0 || -EAGAIN == r) {
+				r = snd_seq_event_output_buffer(dest->handle, &copy);
+			}
+		}
+		if (-EAGAIN == r && is_note_off(&copy)) {
+			/* Never lose a note off, it would leave the note hanging: wait for room */
+			r = fanout_wait(dest, &copy);
+		}
+		if (-EAGAIN == r) {
+			dest->ct_dropped ++;
+			continue;
+		}
+		if (r < 0) {
+			return r;
+		}
+		dest->ct_events ++;
+	}
+	return 0;
+}
+
+
+/*
+ * Pushes buffered events out to every fan-out destination
+ * is_wait = Wait until all destinations took everything, or more input is ready,
+ * otherwise only hand over what they can take right now
+ * Returns 0 if successful or negative error code
+ */
+int
+fanout_flush(struct dest_t *dests, int ct_dests, int is_wait)
+{
+	struct pollfd	pfd[MAX_DESTS + 1];
+	struct dest_t *	dest;
+	int		ct_busy;
+	int		i;
+	int		r;
+
+	for(;;) {
+		ct_busy = 0;
+		for (i = 0; i < ct_dests; i ++) {
+			dest = &dests[i];
+			if (0 == snd_seq_event_output_pending(dest->handle)) {
+				continue;
+			}
+			r = snd_seq_drain_output(dest->handle);
+			if (r < 0 && -EAGAIN != r) {
+				return r;
+			}
+			if (0 != r && 1 == snd_seq_poll_descriptors(dest->handle, &pfd[ct_busy], 1, POLLOUT)) {
+				ct_busy ++;
+			}
+		}
+		if (!is_wait || 0 == ct_busy) {
+			return 0;
+		}
+
+		/* Give up waiting as soon as there is input to pass on */
+		if (g_input_fd >= 0) {
+			pfd[ct_busy].fd = g_input_fd;
+			pfd[ct_busy].events = POLLIN;
+			pfd[ct_busy].revents = 0;
+		}
+		r = poll(pfd, ct_busy + (g_input_fd >= 0), -1);
+		if (r < 0 && EINTR != errno) {
+			return -errno;
+		}
+		if (g_input_fd >= 0 && 0 != pfd[ct_busy].revents) {
+			return 0;
+		}
+	}
+}
+
+
+/*
+ * Makes room for size more bytes at the end of arena
+ * Memory can only be moved while no events in the ALSA output buffer
+ * point into it, returns -EBUSY if they have to be flushed first
+ * Returns 0 if successful or negative error code
+ */
+int
+arena_reserve(struct arena_t *arena, long size)
+{
+	unsigned char *	buf;
+	long		new_size;
+
+	if (arena->len + size <= arena->size) {
+		return 0;
+	}
+	if (arena->sent > 0) {
+		return -EBUSY;
+	}
+	new_size = (arena->size > 0) ? arena->size : SYSEX_ARENA;
+	while (new_size < arena->len + size) {
+		new_size *= 2;
+	}
+	buf = realloc(arena->buf, new_size);
+	if (NULL == buf) {
+		return -ENOMEM;
+	}
+	arena->buf = buf;
+	arena->size = new_size;
+	return 0;
+}
+
+
+/*
+ * Forgets about bytes that ALSA has taken, after the events pointing to them were flushed
+ * Keeps the unfinished chunk, moving it to the start
+ * is_grow = Arena filled up before the batch did, so make it bigger for next time
+ */
+void
+arena_release(struct arena_t *arena, int is_grow)
+{
+	unsigned char *	buf;
+
+	if (arena->sent > 0) {
+		memmove(arena->buf, arena->buf + arena->sent, arena->len - arena->sent);
+		arena->len -= arena->sent;
+		arena->sent = 0;
+	}
+	if (is_grow && arena->size < MAX_SYSEX_ARENA) {
+		buf = realloc(arena->buf, arena->size * 2);
+		if (NULL != buf) {
+			arena->buf = buf;
+			arena->size *= 2;
+		}
+	}
 }
 
 
@@ -925,7 +1543,30 @@ stdin_loop(void *args)
 	snd_midi_event_t *	parser;
 	snd_seq_t *		handle;
 	snd_seq_event_t		ev;
+	unsigned char *		buffer;
+	struct arena_t		arena = { NULL, 0, 0, 0 };
+	struct timespec		sysex_begin;
+	struct timespec		sysex_end;
+	double			sysex_secs = 0;
 	long			ct_bytes = 0;
+	long			ct_sysex_bytes = 0;
+	long			size_in;
+	long			size;
+	long			pos;
+	long			end;
+	long long		time_us = TIMED_LEAD_US;
+	unsigned long		delay = 0;
+	unsigned char *		mark;
+	int			mark_left = 0;
+	int			queue = -1;
+	int			is_timed;
+	int			is_sysex = 0;
+	int			is_chunk;
+	int			ct_sysex = 0;
+	int			ct_sysex_broken = 0;
+	struct dest_t *		dests;
+	int			ct_dests;
+	int			i;
 	int			cli_ID;
 	int			port_ID;
 	int			target_cli;
@@ -934,12 +1575,12 @@ stdin_loop(void *args)
 	int			wait_sec;
 	int			is_read;
 	int			is_hex;
+	int			batch;
 	int			r;
-	int			i;
 	int			is_active = 1;
 	int			ct_events = 0;
 	int			ct_congested = 0;
-	char			bytein;
+	int			ct_pending = 0;
 
 	/* Recover arguments */
 	in_args = (struct in_args_t *)args;
@@ -953,8 +1594,34 @@ stdin_loop(void *args)
 	spacing_us  = in_args->spacing_us;
 	wait_sec    = in_args->wait_sec;
 	is_read     = in_args->is_read;
+	batch       = in_args->batch;
+	is_timed    = in_args->is_timed;
+	dests       = in_args->dests;
+	ct_dests    = in_args->ct_dests;
+
+	/* Timed input is scheduled on a queue of our own, ahead of time */
+	if (is_timed) {
+		if (0 == batch) {
+			batch = TIMED_BATCH;
+		}
+		queue = snd_seq_alloc_named_queue(handle, DEFAULT_CLI_NAME);
+		if (queue < 0) {
+			fprintf(stderr, "Unable to allocate ALSA queue: %s\n", strerror(-queue));
+			is_active = 0;
+		}
+		else {
+			snd_seq_start_queue(handle, queue, NULL);
+			snd_seq_drain_output(handle);
+		}
+	}
+
+	/* Make room for a whole batch in our output buffer, ALSA needs one spare event */
+	if (batch > 0 && (batch + 1) * sizeof(snd_seq_event_t) > snd_seq_get_output_buffer_size(handle)) {
+		snd_seq_set_output_buffer_size(handle, (batch + 1) * sizeof(snd_seq_event_t));
+	}
 		
-	snd_midi_event_new(DEFAULT_BUFSIZE, &parser);
+	/* SysEx goes around the parser, so it only ever holds short messages */
+	snd_midi_event_new(ENCODE_BUFSIZE, &parser);
 	snd_midi_event_init(parser);
 	snd_midi_event_reset_decode(parser);
 
@@ -963,69 +1630,278 @@ stdin_loop(void *args)
 	/* Reset event */
 	snd_seq_ev_clear(&ev);
 
-	/* FUTURE: Might need to maintain our own buffer, to overcome ALSA SysEx size limitation */
+	/* Allocate buffer */
+	buffer = malloc(DEFAULT_BUFSIZE);
+	if (NULL == buffer || arena_reserve(&arena, SYSEX_CHUNK) < 0) {
+		fprintf(stderr, "Unable to allocate input buffer\n");
+		is_active = 0;
+	}
+
 	while(is_active) {
-		/* Read from input, either stdin or files */
-		r = input_byte(args_ptr, is_hex, &bytein);
-		switch(r) {
-			case 0:		/* Clean EOF */
-				is_active = 0;
-				break;
-			
-			case 1:		/* Byte received */
-				/* No action necessary */
-				ct_bytes ++;
-				break;
-				
-			default:
-				/* Error messages already printed by input_byte() */
-				is_active = 0;
+		/* Push out a partial batch before waiting for more input */
+		if (ct_pending > 0 && !input_ready()) {
+			r = (ct_dests > 0) ? fanout_flush(dests, ct_dests, 1) : flush_events(handle);
+			if (r < 0) {
+				fprintf(stderr, "Event write error: %s\n", strerror(-r));
 				break;
+			}
+			if (r > 0) {
+				ct_congested ++;
+			}
+			ct_pending = 0;
+			arena_release(&arena, 0);
+			microsleep(spacing_us);
+		}
+
+		/* Read from input, either stdin or files */
+		size_in = input_block(args_ptr, is_hex, is_timed, buffer, DEFAULT_BUFSIZE);
+		if (size_in <= 0) {
+			/* Clean EOF, or error messages already printed by input_block() */
+			is_active = 0;
+			break;
 		}
+		ct_bytes += size_in;
 		
-		/* Feed byte into parser, as int */
-		i = bytein;
-		r = snd_midi_event_encode_byte(parser, i, &ev);
-		switch(r) {
-			case 0:		/* More bytes needed for event */
-				/* No action necessary */
+		/* Feed the whole block into parser, it stops after each complete message */
+		for (pos = 0; is_active && pos < size_in; ) {
+			/* Timing record, possibly continued from the previous block */
+			if (is_timed && (mark_left > 0 || TIMED_MARK == buffer[pos])) {
+				if (0 == mark_left) {
+					mark_left = TIMED_RECSIZE - 1;
+					delay = 0;
+					pos ++;
+					continue;
+				}
+				delay = (delay << 8) | buffer[pos ++];
+				mark_left --;
+				if (0 == mark_left) {
+					time_us += delay;
+				}
+				continue;
+			}
+
+			/* SysEx is streamed in chunks from our arena, ALSA is told where to copy each one from */
+			is_chunk = 0;
+			if (SYSEX_START == buffer[pos] || (is_sysex && buffer[pos] < 0xF8)) {
+				end = pos;
+				if (SYSEX_START == buffer[pos]) {
+					if (is_sysex) {
+						ct_sysex_broken ++;
+						arena.len = arena.sent;
+					}
+					snd_midi_event_reset_encode(parser);
+					clock_gettime(CLOCK_MONOTONIC, &sysex_begin);
+					is_sysex = 1;
+					end ++;
+				}
+
+				/* Data bytes, up to the end of the chunk */
+				while (end < size_in && end - pos < SYSEX_CHUNK - (arena.len - arena.sent) && buffer[end] < 0x80) {
+					end ++;
+				}
+				if (end < size_in && SYSEX_END == buffer[end]) {
+					end ++;
+					is_sysex = 0;
+				}
+				else if (end < size_in && buffer[end] >= 0x80 && buffer[end] < 0xF8 && SYSEX_START != buffer[end]) {
+					/* Any other status byte cuts the SysEx short, like on a MIDI cable */
+					ct_sysex_broken ++;
+					arena.len = arena.sent;
+					is_sysex = 0;
+					pos = end;
+					continue;
+				}
+
+				r = arena_reserve(&arena, end - pos);
+				if (-EBUSY == r) {
+					/* Events still point into the arena, write them so it can grow */
+					r = flush_events(handle);
+					ct_pending = 0;
+					if (r > 0) {
+						ct_congested ++;
+					}
+					if (r >= 0) {
+						arena_release(&arena, 1);
+						r = arena_reserve(&arena, end - pos);
+					}
+				}
+				if (r < 0) {
+					fprintf(stderr, "Unable to buffer SysEx: %s\n", strerror(-r));
+					is_active = 0;
+					break;
+				}
+				memcpy(arena.buf + arena.len, buffer + pos, end - pos);
+				arena.len += end - pos;
+				ct_sysex_bytes += end - pos;
+				pos = end;
+
+				/* Wait for more, unless chunk is full or SysEx is finished */
+				if (is_sysex && arena.len - arena.sent < SYSEX_CHUNK) {
+					continue;
+				}
+				snd_seq_ev_clear(&ev);
+				ev.type = SND_SEQ_EVENT_SYSEX;
+				snd_seq_ev_set_varusr(&ev, arena.len - arena.sent, arena.buf + arena.sent);
+				arena.sent = arena.len;
+				is_chunk = 1;
+				if (!is_sysex) {
+					clock_gettime(CLOCK_MONOTONIC, &sysex_end);
+					sysex_secs += (sysex_end.tv_sec - sysex_begin.tv_sec) + (sysex_end.tv_nsec - sysex_begin.tv_nsec) / 1e9;
+					ct_sysex ++;
+				}
+			}
+
+			/* Encode MIDI bytes up to the next timing record */
+			size = size_in - pos;
+			if (is_chunk) {
+				size = 0;
+			}
+			else if (is_sysex) {
+				/* Real time message in the middle of SysEx */
+				size = 1;
+			}
+			else if (is_timed) {
+				mark = memchr(buffer + pos, TIMED_MARK, size);
+				if (NULL != mark) {
+					size = mark - (buffer + pos);
+				}
+			}
+			r = is_chunk ? 0 : snd_midi_event_encode(parser, buffer + pos, size, &ev);
+			if (r < 0) {
+				fprintf(stderr, "Internal error, from ALSA event encode: %s\n", strerror(-r));
+				is_active = 0;
 				break;
-				
-			case 1:		/* Message complete */
-				/* Send completed event into ALSA */
-				r = write_event(handle, &ev, port_ID, target_cli, target_port, spacing_us);
+			}
+			pos += r;
+
+			/* More bytes needed for event */
+			if (SND_SEQ_EVENT_NONE == ev.type) {
+				continue;
+			}
+
+			/* Message complete */
+			if (ct_dests > 0) {
+				/* Same event for every destination, each one buffers and drains on its own */
+				r = fanout_event(dests, ct_dests, &ev, queue, time_us);
+				ct_pending ++;
+				if (r >= 0 && ct_pending >= batch) {
+					r = fanout_flush(dests, ct_dests, 0);
+					ct_pending = 0;
+					microsleep(spacing_us);
+				}
+				if (r < 0) {
+					fprintf(stderr, "Event write error: %s\n", strerror(-r));
+					is_active = 0;
+					break;
+				}
+				snd_seq_ev_clear(&ev);
+				arena_release(&arena, 0);
+				ct_events ++;
+				continue;
+			}
+			if (batch > 0) {
+				/* Collect events, and write them into ALSA all at once */
+				r = queue_event(handle, &ev, port_ID, target_cli, target_port, queue, time_us);
+				ct_pending ++;
+				if (r >= 0 && ct_pending >= batch) {
+					r = flush_events(handle);
+					ct_pending = 0;
+					arena_release(&arena, 0);
+					microsleep(spacing_us);
+				}
 				if (r < 0) {
 					fprintf(stderr, "Event write error: %s\n", strerror(-r));
 					is_active = 0;
 					break;
 				}
 				if (r > 0) {
-					/* The return value was the number of retries */
 					ct_congested ++;
 				}
-
-				/* Reset event after write */
 				snd_seq_ev_clear(&ev);
 				ct_events ++;
-				
-				/* Wait for spacing between events, if desired */
-				microsleep(spacing_us);
-				break;
-				
-			default:	/* Error */
-				fprintf(stderr, "Internal error, from ALSA event encode byte: %s\n", strerror(-r));
+				continue;
+			}
+
+			/* Send completed event into ALSA */
+			r = write_event(handle, &ev, port_ID, target_cli, target_port, spacing_us);
+			if (r < 0) {
+				fprintf(stderr, "Event write error: %s\n", strerror(-r));
 				is_active = 0;
 				break;
+			}
+			if (r > 0) {
+				/* The return value was the number of retries */
+				ct_congested ++;
+			}
+
+			/* Reset event after write, ALSA has copied any SysEx from the arena */
+			snd_seq_ev_clear(&ev);
+			arena_release(&arena, 0);
+			ct_events ++;
+				
+			/* Wait for spacing between events, if desired */
+			microsleep(spacing_us);
 		}
 	}	
 
+	/* Input ended in the middle of SysEx */
+	if (is_sysex) {
+		ct_sysex_broken ++;
+	}
+
+	/* Write out what is left of the last batch */
+	if (ct_pending > 0 && ct_dests > 0) {
+		r = fanout_flush(dests, ct_dests, 1);
+		if (r < 0) {
+			fprintf(stderr, "Event write error: %s\n", strerror(-r));
+		}
+	}
+	else if (ct_pending > 0) {
+		r = flush_events(handle);
+		if (r < 0) {
+			fprintf(stderr, "Event write error: %s\n", strerror(-r));
+		}
+		if (r > 0) {
+			ct_congested ++;
+		}
+	}
+
+	/* Wait until the queue has played everything, then get rid of it */
+	if (queue >= 0) {
+		snd_seq_sync_output_queue(handle);
+		for (i = 0; i < ct_dests; i ++) {
+			snd_seq_sync_output_queue(dests[i].handle);
+		}
+		snd_seq_free_queue(handle, queue);
+	}
+
 	/* Input finished */
 	/* FUTURE: Perhaps an option to suppress this */
 	fprintf(stderr, "Input total: %d MIDI messages, %ld bytes", ct_events, ct_bytes);
 	if (ct_congested > 0) {
-		fprintf(stderr, ", %d events congested", ct_congested);
+		fprintf(stderr, ", %d %s congested", ct_congested, (batch > 0) ? "batches" : "events");
 	}
 	fprintf(stderr, "\n");
+	if (ct_sysex > 0 || ct_sysex_broken > 0) {
+		fprintf(stderr, "SysEx total: %d messages, %ld bytes", ct_sysex, ct_sysex_bytes);
+		if (sysex_secs > 0) {
+			fprintf(stderr, ", %.1f kB/s", ct_sysex_bytes / sysex_secs / 1000);
+		}
+		if (ct_sysex_broken > 0) {
+			fprintf(stderr, ", %d cut short", ct_sysex_broken);
+		}
+		fprintf(stderr, "\n");
+	}
+	for (i = 0; i < ct_dests; i ++) {
+		fprintf(stderr, "Port %d:%d: %ld MIDI messages", dests[i].target_cli, dests[i].target_port, dests[i].ct_events);
+		if (dests[i].ct_congested > 0) {
+			fprintf(stderr, ", %d times congested", dests[i].ct_congested);
+		}
+		if (dests[i].ct_dropped > 0) {
+			fprintf(stderr, ", %ld dropped", dests[i].ct_dropped);
+		}
+		fprintf(stderr, "\n");
+	}
 
 	/* Give some time for output-only if the user desires */
 	microsleep(1000000 * wait_sec);
@@ -1046,6 +1922,8 @@ stdin_loop(void *args)
 		}
 	}
 	
+	free(buffer);
+	free(arena.buf);
 	snd_midi_event_free(parser);
 	
 	/* FUTURE: Perhaps bubble up an error result */
@@ -1053,6 +1931,227 @@ stdin_loop(void *args)
 }
 
 
+/*
+ * Load generator, takes the place of stdin_loop()
+ * Schedules rate note on/off pairs per second on the ALSA queue,
+ * for duration seconds, cycling through all 16 channels
+ * Random pattern: random notes and velocities, each note held for half
+ * the time between pairs
+ * Worst pattern: notes jump between the ends of the range, at full
+ * velocity, each held long enough that LOADGEN_WORST_HOLD notes sound at once
+ * Every event is recorded in g_sent, so stdout_loop() can match its echo
+ */
+void *
+loadgen_loop(void *args)
+{
+	struct in_args_t *	in_args;
+	snd_seq_t *		handle;
+	snd_seq_event_t		ev;
+	unsigned char *		notes;
+	long long		t_on;
+	long long		t_off;
+	long long		time_us;
+	double			period_us;
+	double			hold_us;
+	long			total;
+	long			i_on = 0;
+	long			i_off = 0;
+	long			i;
+	int			ct_pending = 0;
+	int			ct_congested = 0;
+	int			is_active = 1;
+	int			r;
+
+	in_args = (struct in_args_t *)args;
+	handle = in_args->handle;
+
+	total = (long)in_args->rate * in_args->duration;
+	period_us = 1000000.0 / in_args->rate;
+	hold_us = in_args->is_worst ? period_us * LOADGEN_WORST_HOLD : period_us / 2;
+
+	/* Pick all notes up front, note off needs the note of its note on */
+	notes = malloc(total);
+	if (NULL == notes) {
+		fprintf(stderr, "Unable to allocate load generator notes\n");
+		is_active = 0;
+	}
+	srand(time(NULL));
+	for (i = 0; is_active && i < total; i ++) {
+		if (in_args->is_worst) {
+			notes[i] = (i & 1) ? 127 - (i / 2) % 128 : (i / 2) % 128;
+		}
+		else {
+			notes[i] = rand() % 128;
+		}
+	}
+
+	/* Emit note ons and offs in time order, so echoes come back in the order they were recorded */
+	while (is_active && (i_on < total || i_off < total)) {
+		t_on = TIMED_LEAD_US + (long long)(i_on * period_us);
+		t_off = TIMED_LEAD_US + (long long)(i_off * period_us + hold_us);
+		snd_seq_ev_clear(&ev);
+		if (i_on < total && t_on <= t_off) {
+			snd_seq_ev_set_noteon(&ev, i_on % 16, notes[i_on],
+				in_args->is_worst ? 127 : 1 + rand() % 127);
+			time_us = t_on;
+			i_on ++;
+		}
+		else {
+			snd_seq_ev_set_noteoff(&ev, i_off % 16, notes[i_off], 0);
+			time_us = t_off;
+			i_off ++;
+		}
+
+		/* Record before ALSA can possibly deliver it */
+		pthread_mutex_lock(&g_mutex);
+		g_sent[g_ct_sent].time_us = time_us;
+		g_sent[g_ct_sent].type = ev.type;
+		g_sent[g_ct_sent].channel = ev.data.note.channel;
+		g_sent[g_ct_sent].note = ev.data.note.note;
+		g_ct_sent ++;
+		pthread_mutex_unlock(&g_mutex);
+
+		r = queue_event(handle, &ev, in_args->port_ID, in_args->target_cli, in_args->target_port, in_args->queue, time_us);
+		ct_pending ++;
+		if (r >= 0 && ct_pending >= in_args->batch) {
+			r = flush_events(handle);
+			ct_pending = 0;
+		}
+		if (r < 0) {
+			fprintf(stderr, "Event write error: %s\n", strerror(-r));
+			is_active = 0;
+		}
+		if (r > 0) {
+			ct_congested ++;
+		}
+	}
+	if (ct_pending > 0) {
+		r = flush_events(handle);
+		if (r < 0) {
+			fprintf(stderr, "Event write error: %s\n", strerror(-r));
+		}
+	}
+	free(notes);
+
+	/* Wait until everything was played, then give the echoes time to come back */
+	snd_seq_sync_output_queue(handle);
+	microsleep(1000000 * ((in_args->wait_sec > 0) ? in_args->wait_sec : 1));
+
+	fprintf(stderr, "Load total: %ld MIDI messages", g_ct_sent);
+	if (ct_congested > 0) {
+		fprintf(stderr, ", %d batches congested", ct_congested);
+	}
+	fprintf(stderr, "\n");
+
+	/* Set global variable, under mutex, so other thread sees it */
+	pthread_mutex_lock(&g_mutex);
+	g_is_endinput = 1;
+	pthread_mutex_unlock(&g_mutex);
+
+	/* Send a dummy message to ourself, so ALSA gets unblocked in other thread */
+	snd_seq_ev_clear(&ev);
+	r = write_event(handle, &ev, in_args->port_ID, in_args->cli_ID, in_args->port_ID, 0);
+	if (r < 0) {
+		fprintf(stderr, "Final event write error: %s\n", strerror(-r));
+	}
+	return NULL;
+}
+
+
+/*
+ * Matches an event that came back to the load generator with the
+ * event it was sent as, by searching forward from the last match over
+ * at most LOADGEN_WINDOW sent events
+ * Sent events skipped over by the search count as dropped, an echo
+ * with no match in the window counts as unexpected
+ * Latency runs from the queue time the event was scheduled for to the
+ * time ALSA stamped on the echo when it arrived
+ * ev = The echo, time stamped by ALSA on the load generator queue
+ */
+void
+loadgen_echo(snd_seq_event_t *ev, long long mono_ns)
+{
+	struct sent_t *	sent;
+	long		i;
+	long		end;
+
+	if (SND_SEQ_EVENT_NOTEON != ev->type && SND_SEQ_EVENT_NOTEOFF != ev->type) {
+		return;
+	}
+
+	pthread_mutex_lock(&g_mutex);
+	end = g_ct_matched + g_ct_dropped + LOADGEN_WINDOW;
+	if (end > g_ct_sent) {
+		end = g_ct_sent;
+	}
+	for (i = g_ct_matched + g_ct_dropped; i < end; i ++) {
+		sent = &g_sent[i];
+		if (sent->type == ev->type && sent->channel == ev->data.note.channel && sent->note == ev->data.note.note) {
+			break;
+		}
+	}
+	if (i < end) {
+		g_ct_dropped = i - g_ct_matched;
+		g_latency_ns[g_ct_matched] = ev->time.time.tv_sec * 1000000000LL + ev->time.time.tv_nsec - sent->time_us * 1000;
+		g_ct_matched ++;
+		if (0 == g_first_echo_ns) {
+			g_first_echo_ns = mono_ns;
+		}
+		g_last_echo_ns = mono_ns;
+	}
+	else {
+		g_ct_unexpected ++;
+	}
+	pthread_mutex_unlock(&g_mutex);
+}
+
+
+int
+compare_latency(const void *a, const void *b)
+{
+	long long	la = *(const long long *)a;
+	long long	lb = *(const long long *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+
+/*
+ * Prints achieved rate, drops and round trip latency of the load generator
+ */
+void
+loadgen_report(void)
+{
+	static const double	percentiles[] = { 50, 90, 99, 99.9 };
+	double			secs;
+	long			dropped;
+	unsigned int		i;
+
+	dropped = g_ct_sent - g_ct_matched;
+	fprintf(stderr, "Load echoed: %ld of %ld MIDI messages, %ld dropped", g_ct_matched, g_ct_sent, dropped);
+	if (g_ct_unexpected > 0) {
+		fprintf(stderr, ", %ld unexpected", g_ct_unexpected);
+	}
+	fprintf(stderr, "\n");
+	if (g_ct_matched < 2) {
+		return;
+	}
+
+	secs = (g_last_echo_ns - g_first_echo_ns) / 1e9;
+	if (secs > 0) {
+		fprintf(stderr, "Achieved rate: %.1f note pairs per second\n", (g_ct_matched - 1) / secs / 2);
+	}
+
+	qsort(g_latency_ns, g_ct_matched, sizeof(g_latency_ns[0]), compare_latency);
+	fprintf(stderr, "Round trip latency: min %.3f ms", g_latency_ns[0] / 1e6);
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i ++) {
+		fprintf(stderr, ", %g%% %.3f ms", percentiles[i],
+			g_latency_ns[(long)((g_ct_matched - 1) * percentiles[i] / 100)] / 1e6);
+	}
+	fprintf(stderr, ", max %.3f ms\n", g_latency_ns[g_ct_matched - 1] / 1e6);
+}
+
+
 void *
 stdout_loop(void *args)
 {
@@ -1063,7 +2162,12 @@ stdout_loop(void *args)
 	snd_seq_event_t *	evptr;
 	long			size_ev;
 	long			ct_bytes = 0;
+	long long		mono_ns;
+	long long		seq_ns;
+	struct timespec		now;
 	int			is_hex;
+	int			is_stamp;
+	int			is_loadgen;
 	int			r;
 	int			is_active = 1;
 	int			ct_overruns = 0;
@@ -1075,6 +2179,8 @@ stdout_loop(void *args)
 	out_args = (struct out_args_t *)args;
 	handle = out_args->handle;
 	is_hex = out_args->is_hex;
+	is_stamp = out_args->is_stamp;
+	is_loadgen = out_args->is_loadgen;
 	
 	snd_midi_event_new(DEFAULT_BUFSIZE, &parser);
 	snd_midi_event_init(parser);
@@ -1091,8 +2197,17 @@ stdout_loop(void *args)
 		/* FUTURE: This is not threadsafe, but since this is the only thread that does ALSA event input, hopefully it's OK for now */
 		evptr = NULL;
 
+		/* Write out buffered output before blocking, so it is not held back */
+		if (0 == snd_seq_event_input_pending(handle, 0)) {
+			if (0 != buffer_stdout(NULL, 0)) {
+				fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+				break;
+			}
+		}
+
 		/* BLOCK until event comes in from ALSA */
 		r = snd_seq_event_input(handle, &evptr);
+		clock_gettime(CLOCK_MONOTONIC, &now);
 		if (r < 0) {
 			/* ENOSPC indicates that ALSA's internal buffer overran and we lost some events */
 			if (-ENOSPC == r) {
@@ -1124,6 +2239,13 @@ stdout_loop(void *args)
 			break;
 		}
 
+		/* The load generator only wants to know when its events came back */
+		if (is_loadgen) {
+			loadgen_echo(evptr, now.tv_sec * 1000000000LL + now.tv_nsec);
+			ct_events ++;
+			continue;
+		}
+
 		/* Unpack event into bytes */
 		size_ev = snd_midi_event_decode(parser, buffer, DEFAULT_BUFSIZE, evptr);
 		if (size_ev < 0) {
@@ -1145,7 +2267,18 @@ stdout_loop(void *args)
 		
 		/* Output to stdout */
 		if (size_ev > 0) {
-			r = write_stdout(buffer, size_ev, is_hex);
+			r = 0;
+			if (is_stamp) {
+				mono_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+				seq_ns = 0;
+				if (snd_seq_ev_is_real(evptr)) {
+					seq_ns = evptr->time.time.tv_sec * 1000000000LL + evptr->time.time.tv_nsec;
+				}
+				r = write_stamp(mono_ns, seq_ns, size_ev, is_hex);
+			}
+			if (0 == r) {
+				r = write_stdout(buffer, size_ev, is_hex);
+			}
 			if (r < 0) {
 				fprintf(stderr, "Error writing output: %s\n", strerror(errno));
 				is_active = 0;
@@ -1170,6 +2303,9 @@ stdout_loop(void *args)
 	}
 	fprintf(stderr, "\n");
 		
+	if (0 != buffer_stdout(NULL, 0)) {
+		fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+	}
 	free(buffer);
 	snd_midi_event_free(parser);
 	
@@ -1198,6 +2334,8 @@ help_screen(char *exename)
 	printf("       [--port CLIENT:PORT] [--addr CLIENT:PORT]\n");
 	printf("       [--hex] [--verbose] [--nowrite] [--noread]\n");
 	printf("       [--delay MILLISECONDS] [--wait SECONDS]\n");
+	printf("       [--batch EVENTS] [--timed] [--stamp]\n");
+	printf("       [--loadgen RATE] [--duration SECONDS] [--worst]\n");
 	printf("       input files....\n");
 	printf("aMIDIcat hooks up standard input and standard output to the ALSA sequencer.\n");
 	printf("Like cat(1), this program will concatenate multiple input files together.\n");
@@ -1214,6 +2352,9 @@ help_screen(char *exename)
 	printf("            a passive connection for use with ALSA \"subscription\".\n");
 	printf(" Syntax is either numeric CLIENT:PORT (example: 128:0), or name of\n");
 	printf(" another program's ALSA connection (use --list to see available).\n");
+	printf(" Give --port several times to send input to all of those ports, each\n");
+	printf(" with its own buffer, so a slow port gets messages dropped instead of\n");
+	printf(" holding up the others.  Only the first one is read from.\n");
 	printf("--addr    = For compatibility, an exact synonym of the --port option.\n");
 	printf("--hex     = Change input and output to be human-readable hex\n");
 	printf("            digits (example: 90 3C 7F) instead of binary MIDI bytes.\n");
@@ -1226,6 +2367,28 @@ help_screen(char *exename)
 	printf("--delay   = Inserts a delay, in milliseconds, between each MIDI\n");
 	printf("            event submitted to ALSA from standard input.\n");
 	printf("            Intended for avoiding event loss due to queue congestion.\n");
+	printf("--batch   = Collect up to this many events from input, and write them\n");
+	printf("            into ALSA at once, waiting for room instead of retrying.\n");
+	printf("            Much faster for large inputs.  --delay then applies\n");
+	printf("            between batches.  Default is 0, one event at a time.\n");
+	printf("--timed   = Input carries the delay before each message, and is played\n");
+	printf("            with that timing through an ALSA queue.  In hex, write\n");
+	printf("            +MICROSECONDS before a message (example: +500 90 3C 7F).\n");
+	printf("            In binary, byte F9 followed by the delay in microseconds,\n");
+	printf("            4 bytes, most significant first.\n");
+	printf("--stamp   = Precede each MIDI message in output with the CLOCK_MONOTONIC\n");
+	printf("            time it was read and the real time ALSA stamped it with.\n");
+	printf("            In hex, as seconds at the start of the line.  In binary,\n");
+	printf("            byte FD, both times in nanoseconds, 8 bytes each, and\n");
+	printf("            the message size, 4 bytes, all most significant first.\n");
+	printf("--loadgen = Instead of reading input, send RATE note on/off pairs per\n");
+	printf("            second, over all 16 channels, and time their echoes coming\n");
+	printf("            back to our port.  Reports achieved rate, drops and round\n");
+	printf("            trip latency percentiles.\n");
+	printf("--duration= How long --loadgen runs, in seconds, default is %d.\n", DEFAULT_DURATION);
+	printf("--worst   = For --loadgen, jump between lowest and highest notes at\n");
+	printf("            full velocity, holding %d notes at once, instead of\n", LOADGEN_WORST_HOLD);
+	printf("            random notes.\n");
 	printf("--wait    = After all input is finished, continue running program for\n");
 	printf("            this amount of time, in seconds.\n");
 	printf("            Intended for allowing output to continue after input.\n");
@@ -1249,6 +2412,12 @@ main(int argc, char **argv)
 		{ "version",	0, NULL, 'V' },
 		{ "nowrite",	0, NULL, 'W' },
 		{ "noread",	0, NULL, 'R' },
+		{ "batch",	1, NULL, 'b' },
+		{ "timed",	0, NULL, 't' },
+		{ "stamp",	0, NULL, 's' },
+		{ "loadgen",	1, NULL, 'g' },
+		{ "duration",	1, NULL, 'u' },
+		{ "worst",	0, NULL, 'k' },
 		{ NULL,   	0, NULL, 0 }
 	};
 	
@@ -1259,6 +2428,7 @@ main(int argc, char **argv)
 	pthread_t		out_thread;
 	int			is_in_started = 0;
 	int			is_out_started = 0;
+	struct dest_t		dests[MAX_DESTS];
 	
 	snd_seq_t *	handle = NULL;
 	char *		cli_name;
@@ -1279,13 +2449,22 @@ main(int argc, char **argv)
 	int		is_version = 0;
 	int		spacing_us = 0;
 	int		wait_sec = 0;
+	int		batch = 0;
+	int		is_timed = 0;
+	int		is_stamp = 0;
+	int		rate = 0;
+	int		duration = DEFAULT_DURATION;
+	int		is_worst = 0;
+	int		queue = -1;
+	int		ct_dests = 0;
+	int		i;
 
 	/* Initialize defaults */
 	cli_name = strdup(DEFAULT_CLI_NAME);
 		
 	/* Parse options */
 	while(!is_done) {
-		c = getopt_long(argc, argv, "hln:p:a:xd:w:vVWR", long_options, NULL);
+		c = getopt_long(argc, argv, "hln:p:a:xd:w:vVWRb:tsg:u:k", long_options, NULL);
 		switch(c) {
 			case 'h': /* --help */
 				is_help = 1;
@@ -1311,13 +2490,29 @@ main(int argc, char **argv)
 					ret = ERR_OPEN;
 					goto cleanup;
 				}
-				r = str_to_cli_port(handle, optarg, &target_cli, &target_port);
+				if (MAX_DESTS == ct_dests) {
+					fprintf(stderr, "Parameter --port can not be given more than %d times\n", MAX_DESTS);
+					ret = ERR_PARAM;
+					goto cleanup;
+				}
+				r = str_to_cli_port(handle, optarg, &dests[ct_dests].target_cli, &dests[ct_dests].target_port);
 				if (r < 0) {
 					/* Abort program if unable to locate target port */
 					fprintf(stderr, "Unable to find ALSA sequencer port: %s\n", optarg);
 					ret = ERR_FINDPORT;
 					goto cleanup;
 				}
+				dests[ct_dests].handle = NULL;
+				dests[ct_dests].ct_events = 0;
+				dests[ct_dests].ct_dropped = 0;
+				dests[ct_dests].ct_congested = 0;
+
+				/* The first port is also the one we read from */
+				if (0 == ct_dests) {
+					target_cli = dests[0].target_cli;
+					target_port = dests[0].target_port;
+				}
+				ct_dests ++;
 				break;
 
 			case 'x': /* --hex */
@@ -1354,6 +2549,60 @@ main(int argc, char **argv)
 				}
 				break;
 			
+			case 'b': /* --batch */
+				batch = better_atoi(optarg);
+				if (batch < 0) {
+					fprintf(stderr, "Parameter for --batch must be a positive integer: %s\n", optarg);
+					ret = ERR_PARAM;
+					goto cleanup;
+				}
+				if (batch > MAX_BATCH) {
+					fprintf(stderr, "Parameter for --batch must be %d or less: %s\n", MAX_BATCH, optarg);
+					ret = ERR_PARAM;
+					goto cleanup;
+				}
+				break;
+
+			case 't': /* --timed */
+				is_timed = 1;
+				break;
+
+			case 's': /* --stamp */
+				is_stamp = 1;
+				break;
+
+			case 'g': /* --loadgen */
+				rate = better_atoi(optarg);
+				if (rate <= 0) {
+					fprintf(stderr, "Parameter for --loadgen must be a positive integer: %s\n", optarg);
+					ret = ERR_PARAM;
+					goto cleanup;
+				}
+				if (rate > MAX_RATE) {
+					fprintf(stderr, "Parameter for --loadgen must be %d or less: %s\n", MAX_RATE, optarg);
+					ret = ERR_PARAM;
+					goto cleanup;
+				}
+				break;
+
+			case 'u': /* --duration */
+				duration = better_atoi(optarg);
+				if (duration <= 0) {
+					fprintf(stderr, "Parameter for --duration must be a positive integer: %s\n", optarg);
+					ret = ERR_PARAM;
+					goto cleanup;
+				}
+				if (duration > MAX_WAIT) {
+					fprintf(stderr, "Parameter for --duration must be %d or less: %s\n", MAX_WAIT, optarg);
+					ret = ERR_PARAM;
+					goto cleanup;
+				}
+				break;
+
+			case 'k': /* --worst */
+				is_worst = 1;
+				break;
+
 			case 'v': /* --verbose */
 				/* FUTURE: Perhaps multiple verbosity levels */
 				is_verbose = 1;
@@ -1409,6 +2658,25 @@ main(int argc, char **argv)
 		}
 	}
 
+	/* The load generator writes its own events and reads their echoes */
+	if (rate > 0) {
+		if (!is_read || !is_write) {
+			fprintf(stderr, "Parameter --loadgen cannot coexist with --noread or --nowrite\n");
+			ret = ERR_PARAM;
+			goto cleanup;
+		}
+		if (NULL != argv[optind]) {
+			fprintf(stderr, "Parameter --loadgen must not be used with any input files\n");
+			ret = ERR_PARAM;
+			goto cleanup;
+		}
+		if (ct_dests > 1) {
+			fprintf(stderr, "Parameter --loadgen can only be used with one --port\n");
+			ret = ERR_PARAM;
+			goto cleanup;
+		}
+	}
+
 	/* For --help, show help screen and exit successfully */
 	if (is_help) {
 		help_screen(argv[0]);
@@ -1447,6 +2715,15 @@ main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	/* Several ports each get a connection of their own */
+	if (ct_dests > 1 && is_write) {
+		r = fanout_open(dests, ct_dests, cli_name, batch);
+		if (r < 0) {
+			ret = ERR_CONNPORT;
+			goto cleanup;
+		}
+	}
+
 	if (is_verbose) {
 		fprintf(stderr, "Connected to ALSA sequencer on port %d:%d\n", cli_ID, port_ID);
 	}
@@ -1456,11 +2733,31 @@ main(int argc, char **argv)
 	pthread_cond_init(&g_cond, NULL);
 	g_is_endinput = 0;
 
+	/* Time stamps need a running queue, the load generator schedules on the same one */
+	if (is_read && (is_stamp || rate > 0)) {
+		queue = seq_timestamp(handle, port_ID);
+		if (queue < 0) {
+			ret = ERR_CONNPORT;
+			goto cleanup;
+		}
+	}
+	if (rate > 0) {
+		g_sent = malloc(2 * (long)rate * duration * sizeof(g_sent[0]));
+		g_latency_ns = malloc(2 * (long)rate * duration * sizeof(g_latency_ns[0]));
+		if (NULL == g_sent || NULL == g_latency_ns) {
+			fprintf(stderr, "Unable to allocate load generator buffers\n");
+			ret = ERR_PARAM;
+			goto cleanup;
+		}
+	}
+
 	/* The output thread reads from ALSA and provides output */
 	if (is_read) {
 		/* Start output thread first, to avoid input backlog */
 		out_args.handle = handle;
 		out_args.is_hex = is_hex;
+		out_args.is_stamp = is_stamp;
+		out_args.is_loadgen = (rate > 0);
 		r = pthread_create(&out_thread, NULL, stdout_loop, &out_args);
 		if (r != 0) {
 			fprintf(stderr, "Unable to start output thread: %s\n", strerror(errno));
@@ -1484,7 +2781,21 @@ main(int argc, char **argv)
 		in_args.spacing_us  = spacing_us;
 		in_args.wait_sec    = wait_sec;
 		in_args.is_read     = is_read;
-		r = pthread_create(&in_thread, NULL, stdin_loop, &in_args);
+		in_args.batch       = batch;
+		in_args.is_timed    = is_timed;
+		in_args.rate        = rate;
+		in_args.duration    = duration;
+		in_args.is_worst    = is_worst;
+		in_args.queue       = queue;
+		in_args.dests       = dests;
+		in_args.ct_dests    = (ct_dests > 1) ? ct_dests : 0;
+		if (in_args.ct_dests > 0 && 0 == batch) {
+			in_args.batch = 1;
+		}
+		if (rate > 0 && 0 == batch) {
+			in_args.batch = TIMED_BATCH;
+		}
+		r = pthread_create(&in_thread, NULL, (rate > 0) ? loadgen_loop : stdin_loop, &in_args);
 		if (r != 0) {
 			fprintf(stderr, "Unable to start input thread: %s\n", strerror(errno));
 			ret = ERR_THREAD;
@@ -1504,13 +2815,23 @@ threadwait:
 	if (is_out_started) {
 		pthread_join(out_thread, NULL);
 	}
+	if (rate > 0 && 0 == ret) {
+		loadgen_report();
+	}
 	
 cleanup:
 	/* Cleanup */
 	if (handle != NULL) {
 		seq_close(handle);
 	}
+	for (i = 0; i < ct_dests; i ++) {
+		if (dests[i].handle != NULL) {
+			seq_close(dests[i].handle);
+		}
+	}
 	free(cli_name);
+	free(g_sent);
+	free(g_latency_ns);
 	
 	return ret;
 }